@@ -17,1017 +17,5268 @@
 #include <linux/kernel.h>
 #include "rrpc_debug.h"
 
+#define CREATE_TRACE_POINTS
+#include "rrpc_debug_trace.h"
+
 static struct kmem_cache *rrpc_debug_gcb_cache, *rrpc_debug_rq_cache;
+static struct dentry *rrpc_debug_debugfs_root;
 static DECLARE_RWSEM(rrpc_debug_lock);
+static atomic64_t rrpc_debug_rc_hits, rrpc_debug_rc_misses;
 
-static int rrpc_debug_submit_io(struct rrpc_debug *rrpc_debug, struct bio *bio,
-				struct nvm_rq *rqd, unsigned long flags);
-
-#define rrpc_debug_for_each_lun(rrpc_debug, rlun, i) \
-		for ((i) = 0, rlun = &(rrpc_debug)->luns[0]; \
-			(i) < (rrpc_debug)->nr_luns; (i)++, rlun = &(rrpc_debug)->luns[(i)])
-
-static void rrpc_debug_page_invalidate(struct rrpc_debug *rrpc_debug, struct rrpc_debug_addr *a)
-{
-	struct rrpc_debug_block *rblk = a->rblk;
-	unsigned int pg_offset;
-
-	lockdep_assert_held(&rrpc_debug->rev_lock);
-
-	if (a->addr == ADDR_EMPTY || !rblk)
-		return;
+/* Debug counters of all targets. They cost a patched out branch unless
+ * enabled through debug_stats.
+ */
+enum {
+	RRPC_DEBUG_CNT_SUBMIT,
+	RRPC_DEBUG_CNT_COMPLETE,
+	RRPC_DEBUG_CNT_REQUEUE,
+	RRPC_DEBUG_CNT_MAP,
+	RRPC_DEBUG_CNT_GC_MOVE,
+	RRPC_DEBUG_CNT_GC_ERASE,
+	RRPC_DEBUG_NR_CNT,
+};
 
-	spin_lock(&rblk->lock);
+static const char * const rrpc_debug_cnt_names[RRPC_DEBUG_NR_CNT] = {
+	[RRPC_DEBUG_CNT_SUBMIT]		= "submit",
+	[RRPC_DEBUG_CNT_COMPLETE]	= "complete",
+	[RRPC_DEBUG_CNT_REQUEUE]	= "requeue",
+	[RRPC_DEBUG_CNT_MAP]		= "map_pages",
+	[RRPC_DEBUG_CNT_GC_MOVE]	= "gc_move_pages",
+	[RRPC_DEBUG_CNT_GC_ERASE]	= "gc_erase",
+};
 
-	div_u64_rem(a->addr, rrpc_debug->dev->pgs_per_blk, &pg_offset);
-	WARN_ON(test_and_set_bit(pg_offset, rblk->invalid_pages));
-	rblk->nr_invalid_pages++;
+struct rrpc_debug_counters {
+	u64 c[RRPC_DEBUG_NR_CNT];
+};
 
-	spin_unlock(&rblk->lock);
+static DEFINE_STATIC_KEY_FALSE(rrpc_debug_stats_on);
+static DEFINE_PER_CPU(struct rrpc_debug_counters, rrpc_debug_cnt);
 
-	rrpc_debug->rev_trans_map[a->addr - rrpc_debug->poffset].addr = ADDR_EMPTY;
+static inline void rrpc_debug_count(int idx, unsigned int n)
+{
+	if (static_branch_unlikely(&rrpc_debug_stats_on))
+		this_cpu_add(rrpc_debug_cnt.c[idx], n);
 }
 
-static void rrpc_debug_invalidate_range(struct rrpc_debug *rrpc_debug, sector_t slba,
-								unsigned len)
+static int rrpc_debug_stats_set(const char *val, const struct kernel_param *kp)
 {
-	sector_t i;
+	bool on;
+	int ret;
 
-	spin_lock(&rrpc_debug->rev_lock);
-	for (i = slba; i < slba + len; i++) {
-		struct rrpc_debug_addr *gp = &rrpc_debug->trans_map[i];
+	ret = strtobool(val, &on);
+	if (ret)
+		return ret;
 
-		rrpc_debug_page_invalidate(rrpc_debug, gp);
-		gp->rblk = NULL;
-	}
-	spin_unlock(&rrpc_debug->rev_lock);
+	if (on)
+		static_branch_enable(&rrpc_debug_stats_on);
+	else
+		static_branch_disable(&rrpc_debug_stats_on);
+
+	return 0;
 }
 
-static struct nvm_rq *rrpc_debug_inflight_laddr_acquire(struct rrpc_debug *rrpc_debug,
-					sector_t laddr, unsigned int pages)
+static int rrpc_debug_stats_get(char *buf, const struct kernel_param *kp)
 {
-	struct nvm_rq *rqd;
-	struct rrpc_debug_inflight_rq *inf;
+	int i, cpu, len = 0;
+	u64 sum;
 
-	rqd = mempool_alloc(rrpc_debug->rq_pool, GFP_ATOMIC);
-	if (!rqd)
-		return ERR_PTR(-ENOMEM);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "enabled=%d\n",
+			static_key_enabled(&rrpc_debug_stats_on) ? 1 : 0);
 
-	inf = rrpc_debug_get_inflight_rq(rqd);
-	if (rrpc_debug_lock_laddr(rrpc_debug, laddr, pages, inf)) {
-		mempool_free(rqd, rrpc_debug->rq_pool);
-		return NULL;
+	for (i = 0; i < RRPC_DEBUG_NR_CNT; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += per_cpu(rrpc_debug_cnt, cpu).c[i];
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s=%llu\n",
+				rrpc_debug_cnt_names[i], (unsigned long long)sum);
 	}
 
-	return rqd;
+	return len;
 }
 
-static void rrpc_debug_inflight_laddr_release(struct rrpc_debug *rrpc_debug, struct nvm_rq *rqd)
-{
-	struct rrpc_debug_inflight_rq *inf = rrpc_debug_get_inflight_rq(rqd);
+static const struct kernel_param_ops rrpc_debug_stats_ops = {
+	.set	= rrpc_debug_stats_set,
+	.get	= rrpc_debug_stats_get,
+};
+module_param_cb(debug_stats, &rrpc_debug_stats_ops, NULL, 0644);
+MODULE_PARM_DESC(debug_stats, "Write 1 to count I/O and GC events, read for the counts");
 
-	rrpc_debug_unlock_laddr(rrpc_debug, inf);
+static char *gc_policy = "greedy";
+module_param(gc_policy, charp, 0444);
+MODULE_PARM_DESC(gc_policy, "GC victim selection: greedy, cost-benefit or windowed");
 
-	mempool_free(rqd, rrpc_debug->rq_pool);
-}
+static unsigned int gc_window = 64;
+module_param(gc_window, uint, 0644);
+MODULE_PARM_DESC(gc_window, "Oldest GC candidates considered by the windowed and cost-benefit policies");
 
-static void rrpc_debug_discard(struct rrpc_debug *rrpc_debug, struct bio *bio)
-{
-	sector_t slba = bio->bi_iter.bi_sector / NR_PHY_IN_LOG;
-	sector_t len = bio->bi_iter.bi_size / RRPC_DEBUG_EXPOSED_PAGE_SIZE;
-	struct nvm_rq *rqd;
+static bool lun_affinity;
+module_param(lun_affinity, bool, 0444);
+MODULE_PARM_DESC(lun_affinity, "Let each cpu write to its own group of luns");
 
-	do {
-		rqd = rrpc_debug_inflight_laddr_acquire(rrpc_debug, slba, len);
-		schedule();
-	} while (!rqd);
+static unsigned int hot_threshold = 4;
+module_param(hot_threshold, uint, 0644);
+MODULE_PARM_DESC(hot_threshold, "Recent writes after which a logical region is written to the hot stream");
 
-	if (IS_ERR(rqd)) {
-		pr_err("rrpc_debug: unable to acquire inflight IO\n");
-		bio_io_error(bio);
-		return;
-	}
+static unsigned int heat_period_ms = 1000;
+module_param(heat_period_ms, uint, 0644);
+MODULE_PARM_DESC(heat_period_ms, "Period after which the write count of a logical region is halved");
 
-	rrpc_debug_invalidate_range(rrpc_debug, slba, len);
-	rrpc_debug_inflight_laddr_release(rrpc_debug, rqd);
-}
+static unsigned int gc_batch_pages = 16;
+module_param(gc_batch_pages, uint, 0644);
+MODULE_PARM_DESC(gc_batch_pages, "Valid pages moved by one GC vector command");
 
-static int block_is_full(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
-{
-	return (rblk->next_page == rrpc_debug->dev->pgs_per_blk);
-}
+static unsigned int gc_queue_depth = 4;
+module_param(gc_queue_depth, uint, 0644);
+MODULE_PARM_DESC(gc_queue_depth, "GC vector commands kept in flight while reclaiming a block");
 
-static u64 block_to_addr(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
-{
-	struct nvm_block *blk = rblk->parent;
+static unsigned int stripe_pages;
+module_param(stripe_pages, uint, 0444);
+MODULE_PARM_DESC(stripe_pages, "Pages of a write placed on one lun before the next, 0 for a flash page on every plane");
 
-	return blk->id * rrpc_debug->dev->pgs_per_blk;
-}
+static unsigned int read_cache_pages;
+module_param(read_cache_pages, uint, 0444);
+MODULE_PARM_DESC(read_cache_pages, "Logical pages kept in the read cache of a target, 0 disables it");
 
-static struct ppa_addr linear_to_generic_addr(struct nvm_dev *dev,
-							struct ppa_addr r)
-{
-	struct ppa_addr l;
-	int secs, pgs, blks, luns;
-	sector_t ppa = r.ppa;
+static bool write_buffer = true;
+module_param(write_buffer, bool, 0444);
+MODULE_PARM_DESC(write_buffer, "Gather single page writes into flash page sized units");
 
-	l.ppa = 0;
+static unsigned int wb_flush_ms = 5;
+module_param(wb_flush_ms, uint, 0644);
+MODULE_PARM_DESC(wb_flush_ms, "Time after which a partly filled write buffer unit is padded and written");
 
-	div_u64_rem(ppa, dev->sec_per_pg, &secs);
-	l.g.sec = secs;
+static unsigned int queue_depth = 16;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "User requests preallocated per online cpu, up to 1024 in all (default 16), 0 takes them from a shared pool");
 
-	sector_div(ppa, dev->sec_per_pg);
-	div_u64_rem(ppa, dev->sec_per_blk, &pgs);
-	l.g.pg = pgs;
+static unsigned int checkpoint_ms;
+module_param(checkpoint_ms, uint, 0644);
+MODULE_PARM_DESC(checkpoint_ms, "Period of mapping checkpoints to the first lun, 0 disables checkpoints and the journal");
 
-	sector_div(ppa, dev->pgs_per_blk);
-	div_u64_rem(ppa, dev->blks_per_lun, &blks);
-	l.g.blk = blks;
+static unsigned int journal_blocks = 4;
+module_param(journal_blocks, uint, 0444);
+MODULE_PARM_DESC(journal_blocks, "Blocks of each of the two journals of mapping changes since a checkpoint");
 
-	sector_div(ppa, dev->blks_per_lun);
-	div_u64_rem(ppa, dev->luns_per_chnl, &luns);
-	l.g.lun = luns;
+static bool scan_recovery;
+module_param(scan_recovery, bool, 0444);
+MODULE_PARM_DESC(scan_recovery, "Rebuild the map from the oob metadata of written pages, also without a device L2P table");
 
-	sector_div(ppa, dev->luns_per_chnl);
-	l.g.ch = ppa;
+static unsigned int map_cache_pages;
+module_param(map_cache_pages, uint, 0444);
+MODULE_PARM_DESC(map_cache_pages, "Translation pages of the map kept in memory, the rest is paged to the last blocks of every lun (0: whole map in memory)");
 
-	return l;
-}
+static bool map_hugepages;
+module_param(map_hugepages, bool, 0444);
+MODULE_PARM_DESC(map_hugepages, "Allocate the map partitions physically contiguous, covered by huge page mappings");
 
-static struct ppa_addr rrpc_debug_ppa_to_gaddr(struct nvm_dev *dev, u64 addr)
-{
-	struct ppa_addr paddr;
+static unsigned int map_prefetch = 2;
+module_param(map_prefetch, uint, 0644);
+MODULE_PARM_DESC(map_prefetch, "Translation pages loaded ahead of a miss");
 
-	paddr.ppa = addr;
-	return linear_to_generic_addr(dev, paddr);
-}
+static int rrpc_debug_map_run(struct rrpc_debug *rrpc_debug, sector_t laddr, int nr,
+						int is_gc, u64 *paddr);
+static struct rrpc_debug_addr *rrpc_debug_update_map(struct rrpc_debug *rrpc_debug, sector_t laddr,
+								u64 paddr);
+static int __rrpc_debug_map_run(struct rrpc_debug *rrpc_debug, struct rrpc_debug_lun *rlun,
+				sector_t laddr, int nr, int is_gc, u64 *paddr);
+static void rrpc_debug_page_written(struct rrpc_debug *rrpc_debug, u64 paddr);
+static void rrpc_debug_page_committed(struct rrpc_debug *rrpc_debug, u64 paddr);
+static void rrpc_debug_jnl_add(struct rrpc_debug *rrpc_debug, int type, u64 a,
+									u64 b);
+static void rrpc_debug_jnl_committed(struct rrpc_debug *rrpc_debug, u64 paddr);
+static void rrpc_debug_jnl_blk(struct rrpc_debug *rrpc_debug,
+				struct rrpc_debug_block *rblk, int used);
+static int rrpc_debug_jnl_sync(struct rrpc_debug *rrpc_debug, bool wait);
+static void rrpc_debug_map_cache_free(struct rrpc_debug *rrpc_debug);
+static void rrpc_debug_wb_kick(struct rrpc_debug *rrpc_debug, sector_t laddr,
+							unsigned int npages);
+static void rrpc_debug_wb_unpark(struct rrpc_debug *rrpc_debug);
 
-/* requires lun->lock taken */
-static void rrpc_debug_set_lun_cur(struct rrpc_debug_lun *rlun, struct rrpc_debug_block *rblk)
+#define rrpc_debug_for_each_lun(rrpc_debug, rlun, i) \
+		for ((i) = 0, rlun = &(rrpc_debug)->luns[0]; \
+			(i) < (rrpc_debug)->nr_luns; (i)++, rlun = &(rrpc_debug)->luns[(i)])
+
+static struct rrpc_debug_block *rrpc_debug_get_rblk(struct rrpc_debug_lun *rlun,
+								int blk_id)
 {
 	struct rrpc_debug *rrpc_debug = rlun->rrpc_debug;
+	int lun_blk = blk_id % rrpc_debug->dev->blks_per_lun;
 
-	BUG_ON(!rblk);
-
-	if (rlun->cur) {
-		spin_lock(&rlun->cur->lock);
-		WARN_ON(!block_is_full(rrpc_debug, rlun->cur));
-		spin_unlock(&rlun->cur->lock);
-	}
-	rlun->cur = rblk;
+	return &rlun->blocks[lun_blk];
 }
 
-static struct rrpc_debug_block *rrpc_debug_get_blk(struct rrpc_debug *rrpc_debug, struct rrpc_debug_lun *rlun,
-							unsigned long flags)
+static void rrpc_debug_div_init(struct rrpc_debug_div *div, u32 d)
 {
-	struct nvm_block *blk;
-	struct rrpc_debug_block *rblk;
-
-	printk(KERN_INFO "target_get_blk\n");
+	div->d = d;
+	div->shift = is_power_of_2(d) ? ilog2(d) : -1;
+	div->r = reciprocal_value(d);
+}
 
-	blk = nvm_get_blk(rrpc_debug->dev, rlun->parent, 0);
-	if (!blk)
-		return NULL;
+/* @a / @div, the remainder in @rem */
+static inline u64 rrpc_debug_div(u64 a, const struct rrpc_debug_div *div,
+								u32 *rem)
+{
+	u64 q;
 
-	rblk = &rlun->blocks[blk->id];
-	blk->priv = rblk;
+	if (div->shift >= 0) {
+		*rem = a & (div->d - 1);
+		return a >> div->shift;
+	}
 
-	bitmap_zero(rblk->invalid_pages, rrpc_debug->dev->pgs_per_blk);
-	rblk->next_page = 0;
-	rblk->nr_invalid_pages = 0;
-	atomic_set(&rblk->data_cmnt_size, 0);
+	if (a <= U32_MAX)
+		q = reciprocal_divide(a, div->r);
+	else
+		q = div_u64(a, div->d);
 
-	return rblk;
+	*rem = a - q * div->d;
+	return q;
 }
 
-static void rrpc_debug_put_blk(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
+/* Divisions of the address conversion are set up once per target. A physical
+ * address counts exposed pages, pgs_per_blk of them per block, the same unit
+ * as block_to_addr. Within a block they fill the sectors of a flash page,
+ * then the same page on the other planes, before moving to the next page.
+ * Such a program unit is only used if a block holds a whole number of them.
+ *
+ * Up to checkpoint version 3 the block was split off after the sectors,
+ * with sec_per_blk pages per block, and planes were not addressed. Both
+ * layouts agree when a block holds one sector per page on one plane, see
+ * rrpc_debug_ckpt_probe.
+ */
+static void rrpc_debug_geo_init(struct rrpc_debug *rrpc_debug)
 {
-	printk(KERN_INFO "target_put_blk\n");
-
-	nvm_put_blk(rrpc_debug->dev, rblk->parent);
+	struct rrpc_debug_geo *geo = &rrpc_debug->geo;
+	struct nvm_dev *dev = rrpc_debug->dev;
+	u32 sec = dev->sec_per_pg, pl = dev->nr_planes;
+
+	if (sec < 1 || dev->pgs_per_blk % sec)
+		sec = 1;
+	if (pl < 1 || dev->pgs_per_blk % (sec * pl))
+		pl = 1;
+
+	/* pages are only programmed together within a block */
+	rrpc_debug->prog_pages = sec * pl;
+
+	rrpc_debug_div_init(&geo->sec_per_pg, sec);
+	rrpc_debug_div_init(&geo->nr_planes, pl);
+	rrpc_debug_div_init(&geo->pgs_per_blk, dev->pgs_per_blk);
+	rrpc_debug_div_init(&geo->blks_per_lun, dev->blks_per_lun);
+	rrpc_debug_div_init(&geo->luns_per_chnl, dev->luns_per_chnl);
+
+	geo->pow2 = geo->sec_per_pg.shift >= 0 &&
+		    geo->nr_planes.shift >= 0 &&
+		    geo->pgs_per_blk.shift >= 0 &&
+		    geo->blks_per_lun.shift >= 0 &&
+		    geo->luns_per_chnl.shift >= 0;
 }
 
-static struct rrpc_debug_lun *get_next_lun(struct rrpc_debug *rrpc_debug)
+/* the owning block of a physical address follows from the device geometry */
+static struct rrpc_debug_block *rrpc_debug_addr_to_rblk(struct rrpc_debug *rrpc_debug,
+								u64 paddr)
 {
-	int next = atomic_inc_return(&rrpc_debug->next_lun);
+	struct rrpc_debug_geo *geo = &rrpc_debug->geo;
+	u32 pg, lun_blk;
+	u64 blk_id = rrpc_debug_div(paddr, &geo->pgs_per_blk, &pg);
+	u64 lun_id = rrpc_debug_div(blk_id, &geo->blks_per_lun, &lun_blk);
 
-	return &rrpc_debug->luns[next % rrpc_debug->nr_luns];
+	return &rrpc_debug->luns[lun_id - rrpc_debug->lun_offset].blocks[lun_blk];
 }
 
-static void rrpc_debug_gc_kick(struct rrpc_debug *rrpc_debug)
+static struct rrpc_debug_lun *rrpc_debug_addr_to_rlun(struct rrpc_debug *rrpc_debug,
+								u64 paddr)
 {
-	struct rrpc_debug_lun *rlun;
-	unsigned int i;
-
-	for (i = 0; i < rrpc_debug->nr_luns; i++) {
-		rlun = &rrpc_debug->luns[i];
-		queue_work(rrpc_debug->krqd_wq, &rlun->ws_gc);
-	}
+	return rrpc_debug_addr_to_rblk(rrpc_debug, paddr)->rlun;
 }
 
-/*
- * timed GC every interval.
- */
-static void rrpc_debug_gc_timer(unsigned long data)
+static void rrpc_debug_lun_stat(struct rrpc_debug *rrpc_debug, u64 paddr, int stat)
 {
-	struct rrpc_debug *rrpc_debug = (struct rrpc_debug *)data;
+	struct rrpc_debug_lun *rlun = rrpc_debug_addr_to_rlun(rrpc_debug, paddr);
 
-	rrpc_debug_gc_kick(rrpc_debug);
-	mod_timer(&rrpc_debug->gc_timer, jiffies + msecs_to_jiffies(10));
+	rrpc_debug_stat_add(rrpc_debug, rlun - rrpc_debug->luns, stat, 1);
 }
 
-static void rrpc_debug_end_sync_bio(struct bio *bio)
+/* requires rlun->lock */
+static void rrpc_debug_prio_add(struct rrpc_debug_lun *rlun, struct rrpc_debug_block *rblk)
 {
-	struct completion *waiting = bio->bi_private;
+	unsigned int nr_invalid = rblk->nr_invalid_pages;
 
-	if (bio->bi_error)
-		pr_err("nvm: gc request failed (%u).\n", bio->bi_error);
+	list_add_tail(&rblk->prio, &rlun->prio_buckets[nr_invalid]);
+	list_add_tail(&rblk->age, &rlun->age_list);
+	if (nr_invalid > rlun->prio_max)
+		rlun->prio_max = nr_invalid;
+	rlun->nr_prio++;
+}
 
-	complete(waiting);
+/* requires rlun->lock */
+static void rrpc_debug_prio_del(struct rrpc_debug_lun *rlun, struct rrpc_debug_block *rblk)
+{
+	list_del_init(&rblk->prio);
+	list_del_init(&rblk->age);
+	rlun->nr_prio--;
 }
 
-/*
- * rrpc_debug_move_valid_pages -- migrate live data off the block
- * @rrpc_debug: the 'rrpc_debug' structure
- * @block: the block from which to migrate live pages
- *
- * Description:
- *   GC algorithms may call this function to migrate remaining live
- *   pages off the block prior to erasing it. This function blocks
- *   further execution until the operation is complete.
- */
-static int rrpc_debug_move_valid_pages(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
+/* requires rlun->lock and rblk->lock */
+static void rrpc_debug_prio_update(struct rrpc_debug_lun *rlun,
+						struct rrpc_debug_block *rblk)
 {
-	struct request_queue *q = rrpc_debug->dev->q;
-	struct rrpc_debug_rev_addr *rev;
-	struct nvm_rq *rqd;
-	struct bio *bio;
-	struct page *page;
-	int slot;
-	int nr_pgs_per_blk = rrpc_debug->dev->pgs_per_blk;
-	u64 phys_addr;
-	DECLARE_COMPLETION_ONSTACK(wait);
+	unsigned int nr_invalid = rblk->nr_invalid_pages;
 
-	if (bitmap_full(rblk->invalid_pages, nr_pgs_per_blk))
-		return 0;
+	/* blocks being written or collected are not on a bucket */
+	if (list_empty(&rblk->prio))
+		return;
 
-	bio = bio_alloc(GFP_NOIO, 1);
-	if (!bio) {
-		pr_err("nvm: could not alloc bio to gc\n");
-		return -ENOMEM;
-	}
+	list_move_tail(&rblk->prio, &rlun->prio_buckets[nr_invalid]);
+	if (nr_invalid > rlun->prio_max)
+		rlun->prio_max = nr_invalid;
+}
 
-	page = mempool_alloc(rrpc_debug->page_pool, GFP_NOIO);
+static void rrpc_debug_page_invalidate(struct rrpc_debug *rrpc_debug, struct rrpc_debug_addr *a)
+{
+	struct rrpc_debug_block *rblk;
+	struct rrpc_debug_lun *rlun;
+	unsigned int pg_offset;
 
-	while ((slot = find_first_zero_bit(rblk->invalid_pages,
-					    nr_pgs_per_blk)) < nr_pgs_per_blk) {
+	if (a->addr == ADDR_EMPTY)
+		return;
 
-		/* Lock laddr */
-		phys_addr = (rblk->parent->id * nr_pgs_per_blk) + slot;
+	rblk = rrpc_debug_addr_to_rblk(rrpc_debug, a->addr);
+	rlun = rblk->rlun;
+	lockdep_assert_held(&rlun->rev_lock);
 
-try:
-		spin_lock(&rrpc_debug->rev_lock);
-		/* Get logical address from physical to logical table */
-		rev = &rrpc_debug->rev_trans_map[phys_addr - rrpc_debug->poffset];
-		/* already updated by previous regular write */
-		if (rev->addr == ADDR_EMPTY) {
-			spin_unlock(&rrpc_debug->rev_lock);
-			continue;
-		}
+	spin_lock(&rlun->lock);
+	spin_lock(&rblk->lock);
 
-		rqd = rrpc_debug_inflight_laddr_acquire(rrpc_debug, rev->addr, 1);
-		if (IS_ERR_OR_NULL(rqd)) {
-			spin_unlock(&rrpc_debug->rev_lock);
-			schedule();
-			goto try;
-		}
+	rrpc_debug_div(a->addr, &rrpc_debug->geo.pgs_per_blk, &pg_offset);
+	WARN_ON(test_and_set_bit(pg_offset, rblk->invalid_pages));
+	rblk->nr_invalid_pages++;
+	rrpc_debug_prio_update(rlun, rblk);
 
-		spin_unlock(&rrpc_debug->rev_lock);
+	spin_unlock(&rblk->lock);
+	spin_unlock(&rlun->lock);
 
-		/* Perform read to do GC */
-		bio->bi_iter.bi_sector = rrpc_debug_get_sector(rev->addr);
-		bio->bi_rw = READ;
-		bio->bi_private = &wait;
-		bio->bi_end_io = rrpc_debug_end_sync_bio;
+	rrpc_debug_rev(rrpc_debug, a->addr)->addr = ADDR_EMPTY;
+}
 
-		/* TODO: may fail when EXP_PG_SIZE > PAGE_SIZE */
-		bio_add_pc_page(q, bio, page, RRPC_DEBUG_EXPOSED_PAGE_SIZE, 0);
+/* copy the page of payload at @iter from or to @page, and step over it */
+static void rrpc_debug_bio_copy(struct bio *bio, struct bvec_iter *iter,
+					struct page *page, int to_bio)
+{
+	unsigned int off = 0, len;
+	struct bio_vec bv;
+	void *buf, *data;
+
+	buf = kmap_atomic(page);
+	while (off < RRPC_DEBUG_EXPOSED_PAGE_SIZE && iter->bi_size) {
+		bv = bio_iter_iovec(bio, *iter);
+		len = min_t(unsigned int, bv.bv_len,
+					RRPC_DEBUG_EXPOSED_PAGE_SIZE - off);
+
+		data = kmap_atomic(bv.bv_page);
+		if (to_bio)
+			memcpy(data + bv.bv_offset, buf + off, len);
+		else
+			memcpy(buf + off, data + bv.bv_offset, len);
+		kunmap_atomic(data);
+
+		bio_advance_iter(bio, iter, len);
+		off += len;
+	}
+	kunmap_atomic(buf);
+}
 
-		if (rrpc_debug_submit_io(rrpc_debug, bio, rqd, NVM_IOTYPE_GC)) {
-			pr_err("rrpc_debug: gc read failed.\n");
-			rrpc_debug_inflight_laddr_release(rrpc_debug, rqd);
-			goto finished;
-		}
-		wait_for_completion_io(&wait);
+static int rrpc_debug_rc_stats_get(char *buf, const struct kernel_param *kp)
+{
+	return scnprintf(buf, PAGE_SIZE, "hits=%llu misses=%llu\n",
+			(unsigned long long)atomic64_read(&rrpc_debug_rc_hits),
+			(unsigned long long)atomic64_read(&rrpc_debug_rc_misses));
+}
 
-		bio_reset(bio);
-		reinit_completion(&wait);
+static const struct kernel_param_ops rrpc_debug_rc_stats_ops = {
+	.get	= rrpc_debug_rc_stats_get,
+};
+module_param_cb(read_cache_stats, &rrpc_debug_rc_stats_ops, NULL, 0444);
+MODULE_PARM_DESC(read_cache_stats, "Read cache hits and misses of all targets");
 
-		bio->bi_iter.bi_sector = rrpc_debug_get_sector(rev->addr);
-		bio->bi_rw = WRITE;
-		bio->bi_private = &wait;
-		bio->bi_end_io = rrpc_debug_end_sync_bio;
+/* Serve a read from the cache if all of its pages are cached. The caller
+ * holds the range lock.
+ */
+static int rrpc_debug_rc_read(struct rrpc_debug *rrpc_debug, struct bio *bio,
+						sector_t laddr, int npages)
+{
+	struct rrpc_debug_rc_entry *e;
+	struct bvec_iter iter = bio->bi_iter;
+	unsigned long flags;
+	int i;
 
-		bio_add_pc_page(q, bio, page, RRPC_DEBUG_EXPOSED_PAGE_SIZE, 0);
+	if (!rrpc_debug->rc_nr)
+		return 0;
 
-		/* turn the command around and write the data back to a new
-		 * address
-		 */
-		if (rrpc_debug_submit_io(rrpc_debug, bio, rqd, NVM_IOTYPE_GC)) {
-			pr_err("rrpc_debug: gc write failed.\n");
-			rrpc_debug_inflight_laddr_release(rrpc_debug, rqd);
-			goto finished;
+	spin_lock_irqsave(&rrpc_debug->rc_lock, flags);
+	for (i = 0; i < npages; i++) {
+		if (!radix_tree_lookup(&rrpc_debug->rc_tree, laddr + i)) {
+			spin_unlock_irqrestore(&rrpc_debug->rc_lock, flags);
+			atomic64_inc(&rrpc_debug_rc_misses);
+			return 0;
 		}
-		wait_for_completion_io(&wait);
-
-		rrpc_debug_inflight_laddr_release(rrpc_debug, rqd);
-
-		bio_reset(bio);
 	}
 
-finished:
-	mempool_free(page, rrpc_debug->page_pool);
-	bio_put(bio);
-
-	if (!bitmap_full(rblk->invalid_pages, nr_pgs_per_blk)) {
-		pr_err("nvm: failed to garbage collect block\n");
-		return -EIO;
+	for (i = 0; i < npages; i++) {
+		e = radix_tree_lookup(&rrpc_debug->rc_tree, laddr + i);
+		e->ref = 1;
+		rrpc_debug_bio_copy(bio, &iter, e->page, 1);
 	}
+	spin_unlock_irqrestore(&rrpc_debug->rc_lock, flags);
 
-	return 0;
+	atomic64_inc(&rrpc_debug_rc_hits);
+	return 1;
 }
 
-static void rrpc_debug_block_gc(struct work_struct *work)
+/* Advance the hand to an entry that was not hit since it last passed. Entries
+ * being filled are skipped, NULL if the hand went around twice without one.
+ */
+static struct rrpc_debug_rc_entry *rrpc_debug_rc_evict(struct rrpc_debug *rrpc_debug)
 {
-	struct rrpc_debug_block_gc *gcb = container_of(work, struct rrpc_debug_block_gc,
-									ws_gc);
-	struct rrpc_debug *rrpc_debug = gcb->rrpc_debug;
-	struct rrpc_debug_block *rblk = gcb->rblk;
-	struct nvm_dev *dev = rrpc_debug->dev;
+	struct rrpc_debug_rc_entry *e;
+	unsigned int n;
 
-	pr_debug("nvm: block '%lu' being reclaimed\n", rblk->parent->id);
+	for (n = 0; ; n++) {
+		if (n == rrpc_debug->rc_nr * 2)
+			return NULL;
 
-	if (rrpc_debug_move_valid_pages(rrpc_debug, rblk))
-		goto done;
+		e = &rrpc_debug->rc_entries[rrpc_debug->rc_hand];
+		if (++rrpc_debug->rc_hand == rrpc_debug->rc_nr)
+			rrpc_debug->rc_hand = 0;
 
-	nvm_erase_blk(dev, rblk->parent);
-	rrpc_debug_put_blk(rrpc_debug, rblk);
-done:
-	mempool_free(gcb, rrpc_debug->gcb_pool);
+		if (e->busy)
+			continue;
+		if (!e->used)
+			return e;
+		if (!e->ref)
+			break;
+		e->ref = 0;
+	}
+
+	radix_tree_delete(&rrpc_debug->rc_tree, e->laddr);
+	e->used = 0;
+	return e;
 }
 
-/* the block with highest number of invalid pages, will be in the beginning
- * of the list
+/* Cache the pages of a completed read, from the payload at @iter. The caller
+ * holds the range lock and still owns the payload. An entry is taken out of
+ * the cache while its page is copied, outside of rc_lock.
  */
-static struct rrpc_debug_block *rblock_max_invalid(struct rrpc_debug_block *ra,
-							struct rrpc_debug_block *rb)
+static void rrpc_debug_rc_fill(struct rrpc_debug *rrpc_debug, struct bio *bio,
+			struct bvec_iter iter, sector_t laddr, int npages)
 {
-	if (ra->nr_invalid_pages == rb->nr_invalid_pages)
-		return ra;
+	struct rrpc_debug_rc_entry *e;
+	unsigned long flags;
+	int i;
+
+	if (!rrpc_debug->rc_nr)
+		return;
+
+	for (i = 0; i < npages; i++) {
+		spin_lock_irqsave(&rrpc_debug->rc_lock, flags);
+		if (radix_tree_lookup(&rrpc_debug->rc_tree, laddr + i)) {
+			spin_unlock_irqrestore(&rrpc_debug->rc_lock, flags);
+			bio_advance_iter(bio, &iter, RRPC_DEBUG_EXPOSED_PAGE_SIZE);
+			continue;
+		}
 
-	return (ra->nr_invalid_pages < rb->nr_invalid_pages) ? rb : ra;
+		e = rrpc_debug_rc_evict(rrpc_debug);
+		if (e)
+			e->busy = 1;
+		spin_unlock_irqrestore(&rrpc_debug->rc_lock, flags);
+		if (!e)
+			return;
+
+		rrpc_debug_bio_copy(bio, &iter, e->page, 0);
+
+		spin_lock_irqsave(&rrpc_debug->rc_lock, flags);
+		e->busy = 0;
+		if (!radix_tree_insert(&rrpc_debug->rc_tree, laddr + i, e)) {
+			e->laddr = laddr + i;
+			e->ref = 0;
+			e->used = 1;
+		}
+		spin_unlock_irqrestore(&rrpc_debug->rc_lock, flags);
+	}
 }
 
-/* linearly find the block with highest number of invalid pages
- * requires lun->lock
+/* Completion of a user read with the read cache on, run by the block layer
+ * before the bio is handed back to its owner, while the payload is still
+ * ours to read. end_io of the request follows.
  */
-static struct rrpc_debug_block *block_prio_find_max(struct rrpc_debug_lun *rlun)
+static void rrpc_debug_rc_end_io(struct bio *bio)
 {
-	struct list_head *prio_list = &rlun->prio_list;
-	struct rrpc_debug_block *rblock, *max;
+	struct nvm_rq *rqd = bio->bi_private;
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
+	struct rrpc_debug *rrpc_debug = container_of(rqd->ins, struct rrpc_debug,
+								instance);
 
-	BUG_ON(list_empty(prio_list));
+	bio->bi_end_io = rrqd->bi_end_io;
+	bio->bi_private = rrqd->bi_private;
 
-	max = list_first_entry(prio_list, struct rrpc_debug_block, prio);
-	list_for_each_entry(rblock, prio_list, prio)
-		max = rblock_max_invalid(max, rblock);
+	if (!bio->bi_error)
+		rrpc_debug_rc_fill(rrpc_debug, bio, rrqd->iter,
+				rrqd->iter.bi_sector / NR_PHY_IN_LOG,
+				rqd->nr_pages);
 
-	return max;
+	bio_endio(bio);
 }
 
-static void rrpc_debug_lun_gc(struct work_struct *work)
+/* drop cached copies of pages that are remapped or discarded */
+static void rrpc_debug_rc_invalidate(struct rrpc_debug *rrpc_debug, sector_t laddr,
+								int npages)
 {
-	struct rrpc_debug_lun *rlun = container_of(work, struct rrpc_debug_lun, ws_gc);
-	struct rrpc_debug *rrpc_debug = rlun->rrpc_debug;
-	struct nvm_lun *lun = rlun->parent;
-	struct rrpc_debug_block_gc *gcb;
-	unsigned int nr_blocks_need;
-
-	nr_blocks_need = rrpc_debug->dev->blks_per_lun / GC_LIMIT_INVERSE;
-
-	if (nr_blocks_need < rrpc_debug->nr_luns)
-		nr_blocks_need = rrpc_debug->nr_luns;
+	struct rrpc_debug_rc_entry *e;
+	unsigned long flags;
+	int i;
 
-	spin_lock(&lun->lock);
-	while (nr_blocks_need > lun->nr_free_blocks &&
-					!list_empty(&rlun->prio_list)) {
-		struct rrpc_debug_block *rblock = block_prio_find_max(rlun);
-		struct nvm_block *block = rblock->parent;
+	if (!rrpc_debug->rc_nr)
+		return;
 
-		if (!rblock->nr_invalid_pages)
-			break;
+	spin_lock_irqsave(&rrpc_debug->rc_lock, flags);
+	for (i = 0; i < npages; i++) {
+		e = radix_tree_delete(&rrpc_debug->rc_tree, laddr + i);
+		if (e)
+			e->used = 0;
+	}
+	spin_unlock_irqrestore(&rrpc_debug->rc_lock, flags);
+}
 
-		list_del_init(&rblock->prio);
+static void rrpc_debug_invalidate_range(struct rrpc_debug *rrpc_debug, sector_t slba,
+								unsigned len)
+{
+	sector_t i;
 
-		BUG_ON(!block_is_full(rrpc_debug, rblock));
+	rrpc_debug_rc_invalidate(rrpc_debug, slba, len);
 
-		pr_debug("rrpc_debug: selected block '%lu' for GC\n", block->id);
+	/* the caller holds the range lock, so the entries cannot change */
+	for (i = slba; i < slba + len; i++) {
+		struct rrpc_debug_addr *gp = rrpc_debug_l2p(rrpc_debug, i);
+		struct rrpc_debug_lun *rlun;
 
-		gcb = mempool_alloc(rrpc_debug->gcb_pool, GFP_ATOMIC);
-		if (!gcb)
-			break;
+		if (gp->addr == ADDR_EMPTY)
+			continue;
 
-		gcb->rrpc_debug = rrpc_debug;
-		gcb->rblk = rblock;
-		INIT_WORK(&gcb->ws_gc, rrpc_debug_block_gc);
+		rlun = rrpc_debug_addr_to_rlun(rrpc_debug, gp->addr);
 
-		queue_work(rrpc_debug->kgc_wq, &gcb->ws_gc);
+		spin_lock(&rlun->rev_lock);
+		rrpc_debug_page_invalidate(rrpc_debug, gp);
+		gp->addr = ADDR_EMPTY;
+		spin_unlock(&rlun->rev_lock);
+		rrpc_debug_map_dirty(rrpc_debug, i);
 
-		nr_blocks_need--;
+		rrpc_debug_jnl_add(rrpc_debug, RRPC_DEBUG_JNL_MAP, i, ADDR_EMPTY);
 	}
-	spin_unlock(&lun->lock);
-
-	/* TODO: Hint that request queue can be started again */
 }
 
-static void rrpc_debug_gc_queue(struct work_struct *work)
+static struct nvm_rq *rrpc_debug_set_get_rq(struct rrpc_debug_rq_set *set,
+								int state)
 {
-	struct rrpc_debug_block_gc *gcb = container_of(work, struct rrpc_debug_block_gc,
-									ws_gc);
-	struct rrpc_debug *rrpc_debug = gcb->rrpc_debug;
-	struct rrpc_debug_block *rblk = gcb->rblk;
-	struct nvm_lun *lun = rblk->parent->lun;
-	struct rrpc_debug_lun *rlun = &rrpc_debug->luns[lun->id - rrpc_debug->lun_offset];
+	struct nvm_rq *rqd;
+	int tag;
 
-	spin_lock(&rlun->lock);
-	list_add_tail(&rblk->prio, &rlun->prio_list);
-	spin_unlock(&rlun->lock);
+	if (!set->nr)
+		return NULL;
 
-	mempool_free(gcb, rrpc_debug->gcb_pool);
-	pr_debug("nvm: block '%lu' is full, allow GC (sched)\n",
-							rblk->parent->id);
-}
+	tag = percpu_ida_alloc(&set->tags, state);
+	if (tag < 0)
+		return NULL;
 
-static const struct block_device_operations rrpc_debug_fops = {
-	.owner		= THIS_MODULE,
-};
+	rqd = set->rqs[tag];
+	memset(rqd, 0, sizeof(struct nvm_rq));
 
-static struct rrpc_debug_lun *rrpc_debug_get_lun_rr(struct rrpc_debug *rrpc_debug, int is_gc)
+	return rqd;
+}
+
+static struct nvm_rq *__rrpc_debug_alloc_rq(struct rrpc_debug *rrpc_debug,
+							gfp_t gfp_mask)
 {
-	unsigned int i;
-	struct rrpc_debug_lun *rlun, *max_free;
+	struct rrpc_debug_rq *rrqd;
+	struct nvm_rq *rqd;
 
-	if (!is_gc)
-		return get_next_lun(rrpc_debug);
+	rqd = mempool_alloc(rrpc_debug->rq_pool, gfp_mask);
+	if (!rqd)
+		return NULL;
 
-	/* during GC, we don't care about RR, instead we want to make
-	 * sure that we maintain evenness between the block luns.
-	 */
-	max_free = &rrpc_debug->luns[0];
-	/* prevent GC-ing lun from devouring pages of a lun with
-	 * little free blocks. We don't take the lock as we only need an
-	 * estimate.
-	 */
-	rrpc_debug_for_each_lun(rrpc_debug, rlun, i) {
-		if (rlun->parent->nr_free_blocks >
-					max_free->parent->nr_free_blocks)
-			max_free = rlun;
-	}
+	memset(rqd, 0, sizeof(struct nvm_rq));
+	rrqd = nvm_rq_to_pdu(rqd);
+	rrqd->set = NULL;
+	rrqd->dma_buf = NULL;
 
-	return max_free;
+	return rqd;
 }
 
-static struct rrpc_debug_addr *rrpc_debug_update_map(struct rrpc_debug *rrpc_debug, sector_t laddr,
-					struct rrpc_debug_block *rblk, u64 paddr)
+/* requests of internal I/O, never waiting for a tag */
+static struct nvm_rq *rrpc_debug_alloc_rq(struct rrpc_debug *rrpc_debug, gfp_t gfp_mask)
 {
-	struct rrpc_debug_addr *gp;
-	struct rrpc_debug_rev_addr *rev;
+	struct nvm_rq *rqd;
 
-	printk(KERN_INFO "target_update_map\n");
+	rqd = rrpc_debug_set_get_rq(&rrpc_debug->int_rqs, TASK_RUNNING);
+	if (rqd)
+		return rqd;
 
-	BUG_ON(laddr >= rrpc_debug->nr_pages);
+	return __rrpc_debug_alloc_rq(rrpc_debug, gfp_mask);
+}
 
-	gp = &rrpc_debug->trans_map[laddr];
-	spin_lock(&rrpc_debug->rev_lock);
-	if (gp->rblk)
-		rrpc_debug_page_invalidate(rrpc_debug, gp);
+/* requests of user I/O, the tag allocation sleeps while the queue is full */
+static struct nvm_rq *rrpc_debug_alloc_tagged_rq(struct rrpc_debug *rrpc_debug)
+{
+	if (!rrpc_debug->user_rqs.nr)
+		return __rrpc_debug_alloc_rq(rrpc_debug, GFP_KERNEL);
+
+	return rrpc_debug_set_get_rq(&rrpc_debug->user_rqs, TASK_UNINTERRUPTIBLE);
+}
 
-	gp->addr = paddr;
-	gp->rblk = rblk;
+static void rrpc_debug_free_rq(struct rrpc_debug *rrpc_debug, struct nvm_rq *rqd)
+{
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
 
-	rev = &rrpc_debug->rev_trans_map[gp->addr - rrpc_debug->poffset];
-	rev->addr = laddr;
-	spin_unlock(&rrpc_debug->rev_lock);
+	if (rqd->metadata &&
+	    rqd->metadata != rrqd->dma_buf + RRPC_DEBUG_OOB_OFFSET)
+		nvm_dev_dma_free(rrpc_debug->dev, rqd->metadata,
+							rqd->dma_metadata);
 
-	return gp;
+	if (rrqd->set)
+		percpu_ida_free(&rrqd->set->tags, rrqd->tag);
+	else
+		mempool_free(rqd, rrpc_debug->rq_pool);
 }
 
-static u64 rrpc_debug_alloc_addr(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
+static void *rrpc_debug_get_ppa_list(struct rrpc_debug *rrpc_debug,
+					struct nvm_rq *rqd, gfp_t gfp_mask)
 {
-	u64 addr = ADDR_EMPTY;
-
-	spin_lock(&rblk->lock);
-	if (block_is_full(rrpc_debug, rblk))
-		goto out;
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
 
-	addr = block_to_addr(rrpc_debug, rblk) + rblk->next_page;
+	if (rrqd->dma_buf) {
+		rqd->dma_ppa_list = rrqd->dma_buf_addr;
+		return rrqd->dma_buf;
+	}
 
-	rblk->next_page++;
-out:
-	spin_unlock(&rblk->lock);
-	return addr;
+	return nvm_dev_dma_alloc(rrpc_debug->dev, gfp_mask, &rqd->dma_ppa_list);
 }
 
-/* Simple round-robin Logical to physical address translation.
- *
- * Retrieve the mapping using the active append point. Then update the ap for
- * the next write to the disk.
- *
- * Returns rrpc_debug_addr with the physical address and block. Remember to return to
- * rrpc_debug->addr_cache when request is finished.
- */
-static struct rrpc_debug_addr *rrpc_debug_map_page(struct rrpc_debug *rrpc_debug, sector_t laddr,
-								int is_gc)
+static void rrpc_debug_put_ppa_list(struct rrpc_debug *rrpc_debug,
+							struct nvm_rq *rqd)
 {
-	struct rrpc_debug_lun *rlun;
-	struct rrpc_debug_block *rblk;
-	struct nvm_lun *lun;
-	u64 paddr;
-
-	printk(KERN_INFO "target_map_page\n");
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
 
-	rlun = rrpc_debug_get_lun_rr(rrpc_debug, is_gc);
-	lun = rlun->parent;
+	if ((void *)rqd->ppa_list != rrqd->dma_buf)
+		nvm_dev_dma_free(rrpc_debug->dev, rqd->ppa_list,
+							rqd->dma_ppa_list);
+}
 
-	if (!is_gc && lun->nr_free_blocks < rrpc_debug->nr_luns * 4)
-		return NULL;
+/* oob areas for the @nr pages of a write, freed with the request */
+static int rrpc_debug_oob_alloc(struct rrpc_debug *rrpc_debug,
+				struct nvm_rq *rqd, int nr, gfp_t gfp_mask)
+{
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
 
-	spin_lock(&rlun->lock);
+	if (!rrpc_debug->oob_size)
+		return 0;
 
-	rblk = rlun->cur;
-retry:
-	paddr = rrpc_debug_alloc_addr(rrpc_debug, rblk);
+	if (rrqd->dma_buf && RRPC_DEBUG_OOB_OFFSET +
+				nr * rrpc_debug->oob_size <= PAGE_SIZE) {
+		rqd->metadata = rrqd->dma_buf + RRPC_DEBUG_OOB_OFFSET;
+		rqd->dma_metadata = rrqd->dma_buf_addr + RRPC_DEBUG_OOB_OFFSET;
+	} else {
+		rqd->metadata = nvm_dev_dma_alloc(rrpc_debug->dev, gfp_mask,
+							&rqd->dma_metadata);
+		if (!rqd->metadata)
+			return -ENOMEM;
+	}
 
-	if (paddr == ADDR_EMPTY) {
-		rblk = rrpc_debug_get_blk(rrpc_debug, rlun, 0);
-		if (rblk) {
-			rrpc_debug_set_lun_cur(rlun, rblk);
-			goto retry;
-		}
+	memset(rqd->metadata, 0, nr * rrpc_debug->oob_size);
+	return 0;
+}
 
-		if (is_gc) {
-			/* retry from emergency gc block */
-			paddr = rrpc_debug_alloc_addr(rrpc_debug, rlun->gc_cur);
-			if (paddr == ADDR_EMPTY) {
-				rblk = rrpc_debug_get_blk(rrpc_debug, rlun, 1);
-				if (!rblk) {
-					pr_err("rrpc_debug: no more blocks");
-					goto err;
-				}
+/* tag page @i of a write with the logical page it holds */
+static void rrpc_debug_oob_set(struct rrpc_debug *rrpc_debug,
+					struct nvm_rq *rqd, int i, u64 laddr)
+{
+	struct rrpc_debug_oob *oob;
 
-				rlun->gc_cur = rblk;
-				paddr = rrpc_debug_alloc_addr(rrpc_debug, rlun->gc_cur);
-			}
-			rblk = rlun->gc_cur;
-		}
-	}
+	if (!rqd->metadata)
+		return;
 
-	spin_unlock(&rlun->lock);
-	return rrpc_debug_update_map(rrpc_debug, laddr, rblk, paddr);
-err:
-	spin_unlock(&rlun->lock);
-	return NULL;
+	oob = rqd->metadata + i * rrpc_debug->oob_size;
+	oob->laddr = cpu_to_le64(laddr);
+	oob->seq = cpu_to_le64(atomic64_inc_return(&rrpc_debug->oob_seq));
 }
 
-static void rrpc_debug_run_gc(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
+static struct nvm_rq *rrpc_debug_inflight_laddr_acquire(struct rrpc_debug *rrpc_debug,
+					sector_t laddr, unsigned int pages)
 {
-	struct rrpc_debug_block_gc *gcb;
+	struct nvm_rq *rqd;
+	struct rrpc_debug_inflight_rq *inf;
 
-	printk(KERN_INFO "target_run_gc\n");
+	rqd = rrpc_debug_alloc_rq(rrpc_debug, GFP_ATOMIC);
+	if (!rqd)
+		return ERR_PTR(-ENOMEM);
 
-	gcb = mempool_alloc(rrpc_debug->gcb_pool, GFP_ATOMIC);
-	if (!gcb) {
-		pr_err("rrpc_debug: unable to queue block for gc.");
-		return;
+	inf = rrpc_debug_get_inflight_rq(rqd);
+	if (rrpc_debug_lock_laddr(rrpc_debug, laddr, pages, inf)) {
+		rrpc_debug_free_rq(rrpc_debug, rqd);
+		return NULL;
 	}
 
-	gcb->rrpc_debug = rrpc_debug;
-	gcb->rblk = rblk;
-
-	INIT_WORK(&gcb->ws_gc, rrpc_debug_gc_queue);
-	queue_work(rrpc_debug->kgc_wq, &gcb->ws_gc);
+	return rqd;
 }
 
-static void rrpc_debug_end_io_write(struct rrpc_debug *rrpc_debug, struct rrpc_debug_rq *rrqd,
-						sector_t laddr, uint8_t npages)
+static void rrpc_debug_inflight_laddr_release(struct rrpc_debug *rrpc_debug, struct nvm_rq *rqd)
 {
-	struct rrpc_debug_addr *p;
-	struct rrpc_debug_block *rblk;
-	struct nvm_lun *lun;
-	int cmnt_size, i;
+	struct rrpc_debug_inflight_rq *inf = rrpc_debug_get_inflight_rq(rqd);
 
-	for (i = 0; i < npages; i++) {
-		p = &rrpc_debug->trans_map[laddr + i];
-		rblk = p->rblk;
-		lun = rblk->parent->lun;
+	rrpc_debug_unlock_laddr(rrpc_debug, inf);
 
-		cmnt_size = atomic_inc_return(&rblk->data_cmnt_size);
-		if (unlikely(cmnt_size == rrpc_debug->dev->pgs_per_blk))
-			rrpc_debug_run_gc(rrpc_debug, rblk);
-	}
+	rrpc_debug_free_rq(rrpc_debug, rqd);
 }
 
-static int rrpc_debug_end_io(struct nvm_rq *rqd, int error)
+static void rrpc_debug_discard(struct rrpc_debug *rrpc_debug, struct bio *bio)
 {
-	struct rrpc_debug *rrpc_debug = container_of(rqd->ins, struct rrpc_debug, instance);
-	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
-	uint8_t npages = rqd->nr_pages;
-	sector_t laddr = rrpc_debug_get_laddr(rqd->bio) - npages;
+	sector_t slba = bio->bi_iter.bi_sector / NR_PHY_IN_LOG;
+	sector_t len = bio->bi_iter.bi_size / RRPC_DEBUG_EXPOSED_PAGE_SIZE;
+	struct nvm_rq *rqd;
+	unsigned int nr;
 
-	printk(KERN_INFO "target_end_io\n");
+	while (len) {
+		/* a locked range may not be longer than an inflight stripe */
+		nr = min_t(sector_t, len, RRPC_DEBUG_INFLIGHT_STRIPE);
 
-	if (bio_data_dir(rqd->bio) == WRITE)
-		rrpc_debug_end_io_write(rrpc_debug, rrqd, laddr, npages);
+		/* buffered pages are locked until written, get them going */
+		rrpc_debug_wb_kick(rrpc_debug, slba, nr);
 
-	if (rrqd->flags & NVM_IOTYPE_GC)
-		return 0;
+		wait_event(rrpc_debug->inflight_wait,
+			(rqd = rrpc_debug_inflight_laddr_acquire(rrpc_debug,
+								slba, nr)));
 
-	rrpc_debug_unlock_rq(rrpc_debug, rqd);
-	bio_put(rqd->bio);
+		if (IS_ERR(rqd)) {
+			pr_err("rrpc_debug: unable to acquire inflight IO\n");
+			bio_io_error(bio);
+			return;
+		}
 
-	if (npages > 1)
-		nvm_dev_dma_free(rrpc_debug->dev, rqd->ppa_list, rqd->dma_ppa_list);
-	if (rqd->metadata)
-		nvm_dev_dma_free(rrpc_debug->dev, rqd->metadata, rqd->dma_metadata);
+		rrpc_debug_invalidate_range(rrpc_debug, slba, nr);
+		rrpc_debug_inflight_laddr_release(rrpc_debug, rqd);
 
-	mempool_free(rqd, rrpc_debug->rq_pool);
+		slba += nr;
+		len -= nr;
+	}
+}
 
-	return 0;
+static int block_is_full(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
+{
+	return (rblk->next_page == rrpc_debug->dev->pgs_per_blk);
 }
 
-static int rrpc_debug_read_ppalist_rq(struct rrpc_debug *rrpc_debug, struct bio *bio,
-			struct nvm_rq *rqd, unsigned long flags, int npages)
+static u64 block_to_addr(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
 {
-	struct rrpc_debug_inflight_rq *r = rrpc_debug_get_inflight_rq(rqd);
-	struct rrpc_debug_addr *gp;
-	sector_t laddr = rrpc_debug_get_laddr(bio);
-	int is_gc = flags & NVM_IOTYPE_GC;
-	int i;
+	struct nvm_block *blk = rblk->parent;
 
-	if (!is_gc && rrpc_debug_lock_rq(rrpc_debug, bio, rqd)) {
-		nvm_dev_dma_free(rrpc_debug->dev, rqd->ppa_list, rqd->dma_ppa_list);
-		return NVM_IO_REQUEUE;
-	}
+	return blk->id * rrpc_debug->dev->pgs_per_blk;
+}
 
-	for (i = 0; i < npages; i++) {
-		/* We assume that mapping occurs at 4KB granularity */
-		BUG_ON(!(laddr + i >= 0 && laddr + i < rrpc_debug->nr_pages));
-		gp = &rrpc_debug->trans_map[laddr + i];
+static struct ppa_addr rrpc_debug_ppa_to_gaddr(struct rrpc_debug *rrpc_debug,
+								u64 addr)
+{
+	const struct rrpc_debug_geo *geo = &rrpc_debug->geo;
+	struct ppa_addr l;
+	u32 off, rem;
 
-		if (gp->rblk) {
-			rqd->ppa_list[i] = rrpc_debug_ppa_to_gaddr(rrpc_debug->dev,
-								gp->addr);
-		} else {
-			BUG_ON(is_gc);
-			rrpc_debug_unlock_laddr(rrpc_debug, r);
-			nvm_dev_dma_free(rrpc_debug->dev, rqd->ppa_list,
-							rqd->dma_ppa_list);
-			return NVM_IO_DONE;
-		}
+	l.ppa = 0;
+
+	if (geo->pow2) {
+		off = addr & (geo->pgs_per_blk.d - 1);
+		l.g.sec = off & (geo->sec_per_pg.d - 1);
+		off >>= geo->sec_per_pg.shift;
+		l.g.pl = off & (geo->nr_planes.d - 1);
+		l.g.pg = off >> geo->nr_planes.shift;
+		addr >>= geo->pgs_per_blk.shift;
+		l.g.blk = addr & (geo->blks_per_lun.d - 1);
+		addr >>= geo->blks_per_lun.shift;
+		l.g.lun = addr & (geo->luns_per_chnl.d - 1);
+		l.g.ch = addr >> geo->luns_per_chnl.shift;
+		return l;
 	}
 
-	rqd->opcode = NVM_OP_HBREAD;
+	addr = rrpc_debug_div(addr, &geo->pgs_per_blk, &off);
+	off = rrpc_debug_div(off, &geo->sec_per_pg, &rem);
+	l.g.sec = rem;
+	l.g.pg = rrpc_debug_div(off, &geo->nr_planes, &rem);
+	l.g.pl = rem;
+	addr = rrpc_debug_div(addr, &geo->blks_per_lun, &rem);
+	l.g.blk = rem;
+	addr = rrpc_debug_div(addr, &geo->luns_per_chnl, &rem);
+	l.g.lun = rem;
+	l.g.ch = addr;
 
-	return NVM_IO_OK;
+	return l;
 }
 
-static int rrpc_debug_read_rq(struct rrpc_debug *rrpc_debug, struct bio *bio, struct nvm_rq *rqd,
-							unsigned long flags)
+/* step @p to the next page, unless that is in another block */
+static bool rrpc_debug_ppa_next(const struct rrpc_debug_geo *geo,
+							struct ppa_addr *p)
 {
-	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
-	int is_gc = flags & NVM_IOTYPE_GC;
-	sector_t laddr = rrpc_debug_get_laddr(bio);
-	struct rrpc_debug_addr *gp;
-
-	printk(KERN_INFO "target_read_rq\n");
-
-	if (!is_gc && rrpc_debug_lock_rq(rrpc_debug, bio, rqd))
-		return NVM_IO_REQUEUE;
-
-	BUG_ON(!(laddr >= 0 && laddr < rrpc_debug->nr_pages));
-	gp = &rrpc_debug->trans_map[laddr];
+	if (p->g.sec + 1 < geo->sec_per_pg.d) {
+		p->g.sec++;
+		return true;
+	}
 
-	if (gp->rblk) {
-		rqd->ppa_addr = rrpc_debug_ppa_to_gaddr(rrpc_debug->dev, gp->addr);
-	} else {
-		BUG_ON(is_gc);
-		rrpc_debug_unlock_rq(rrpc_debug, rqd);
-		return NVM_IO_DONE;
+	if (p->g.pl + 1 < geo->nr_planes.d) {
+		p->g.sec = 0;
+		p->g.pl++;
+		return true;
 	}
 
-	rqd->opcode = NVM_OP_HBREAD;
-	rrqd->addr = gp;
+	if ((p->g.pg + 1) * geo->sec_per_pg.d * geo->nr_planes.d <
+							geo->pgs_per_blk.d) {
+		p->g.sec = 0;
+		p->g.pl = 0;
+		p->g.pg++;
+		return true;
+	}
 
-	return NVM_IO_OK;
+	return false;
 }
 
-static int rrpc_debug_write_ppalist_rq(struct rrpc_debug *rrpc_debug, struct bio *bio,
-			struct nvm_rq *rqd, unsigned long flags, int npages)
+/* device addresses of the @nr pages from @paddr on */
+static void rrpc_debug_ppa_run(struct rrpc_debug *rrpc_debug,
+			struct ppa_addr *list, u64 paddr, int nr)
 {
-	struct rrpc_debug_inflight_rq *r = rrpc_debug_get_inflight_rq(rqd);
-	struct rrpc_debug_addr *p;
-	sector_t laddr = rrpc_debug_get_laddr(bio);
-	int is_gc = flags & NVM_IOTYPE_GC;
 	int i;
 
-	if (!is_gc && rrpc_debug_lock_rq(rrpc_debug, bio, rqd)) {
-		nvm_dev_dma_free(rrpc_debug->dev, rqd->ppa_list, rqd->dma_ppa_list);
-		return NVM_IO_REQUEUE;
+	list[0] = rrpc_debug_ppa_to_gaddr(rrpc_debug, paddr);
+	for (i = 1; i < nr; i++) {
+		list[i] = list[i - 1];
+		if (!rrpc_debug_ppa_next(&rrpc_debug->geo, &list[i]))
+			list[i] = rrpc_debug_ppa_to_gaddr(rrpc_debug, paddr + i);
 	}
+}
 
-	for (i = 0; i < npages; i++) {
-		/* We assume that mapping occurs at 4KB granularity */
-		p = rrpc_debug_map_page(rrpc_debug, laddr + i, is_gc);
-		if (!p) {
-			BUG_ON(is_gc);
-			rrpc_debug_unlock_laddr(rrpc_debug, r);
-			nvm_dev_dma_free(rrpc_debug->dev, rqd->ppa_list,
-							rqd->dma_ppa_list);
-			rrpc_debug_gc_kick(rrpc_debug);
-			return NVM_IO_REQUEUE;
+/* Device addresses of the @nr pages in @paddr. Pages following the one
+ * before them are mostly in the same block, and only stepped to.
+ */
+static void rrpc_debug_ppa_list(struct rrpc_debug *rrpc_debug,
+			struct ppa_addr *list, const u64 *paddr, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (i && paddr[i] == paddr[i - 1] + 1) {
+			list[i] = list[i - 1];
+			if (rrpc_debug_ppa_next(&rrpc_debug->geo, &list[i]))
+				continue;
 		}
 
-		rqd->ppa_list[i] = rrpc_debug_ppa_to_gaddr(rrpc_debug->dev,
-								p->addr);
+		list[i] = rrpc_debug_ppa_to_gaddr(rrpc_debug, paddr[i]);
 	}
-
-	rqd->opcode = NVM_OP_HBWRITE;
-
-	return NVM_IO_OK;
 }
 
-static int rrpc_debug_write_rq(struct rrpc_debug *rrpc_debug, struct bio *bio,
-				struct nvm_rq *rqd, unsigned long flags)
+/* requires lun->lock taken */
+static void rrpc_debug_set_lun_cur(struct rrpc_debug_lun *rlun, int stream,
+						struct rrpc_debug_block *rblk)
 {
-	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
-	struct rrpc_debug_addr *p;
-	int is_gc = flags & NVM_IOTYPE_GC;
-	sector_t laddr = rrpc_debug_get_laddr(bio);
-
-	printk(KERN_INFO "target_write_rq\n");
+	struct rrpc_debug *rrpc_debug = rlun->rrpc_debug;
+	struct rrpc_debug_block *cur = rlun->cur[stream];
 
-	if (!is_gc && rrpc_debug_lock_rq(rrpc_debug, bio, rqd))
-		return NVM_IO_REQUEUE;
+	BUG_ON(!rblk);
 
-	p = rrpc_debug_map_page(rrpc_debug, laddr, is_gc);
-	if (!p) {
-		BUG_ON(is_gc);
-		rrpc_debug_unlock_rq(rrpc_debug, rqd);
-		rrpc_debug_gc_kick(rrpc_debug);
-		return NVM_IO_REQUEUE;
+	if (cur) {
+		spin_lock(&cur->lock);
+		WARN_ON(!block_is_full(rrpc_debug, cur));
+		spin_unlock(&cur->lock);
 	}
+	rlun->cur[stream] = rblk;
+}
 
-	rqd->ppa_addr = rrpc_debug_ppa_to_gaddr(rrpc_debug->dev, p->addr);
-	rqd->opcode = NVM_OP_HBWRITE;
-	rrqd->addr = p;
+static u32 rrpc_debug_heat_epoch(void)
+{
+	unsigned long period = msecs_to_jiffies(max_t(unsigned int,
+					READ_ONCE(heat_period_ms), 1));
 
-	return NVM_IO_OK;
+	return (u32)(jiffies / period);
 }
 
-static int rrpc_debug_setup_rq(struct rrpc_debug *rrpc_debug, struct bio *bio,
-			struct nvm_rq *rqd, unsigned long flags, uint8_t npages)
+/* write count of the region, decayed up to @epoch */
+static unsigned int rrpc_debug_heat_read(struct rrpc_debug_heat *h, u32 epoch)
 {
-	printk(KERN_INFO "target_setup_rq\n");
+	u32 age = epoch - h->epoch;
 
-	if (npages > 1) {
-		rqd->ppa_list = nvm_dev_dma_alloc(rrpc_debug->dev, GFP_KERNEL,
-							&rqd->dma_ppa_list);
-		if (!rqd->ppa_list) {
+	return (age >= 8) ? 0 : h->count >> age;
+}
+
+/* account one write to the region holding @laddr */
+static void rrpc_debug_heat_update(struct rrpc_debug *rrpc_debug, sector_t laddr)
+{
+	struct rrpc_debug_heat *h =
+			&rrpc_debug->heat[laddr >> RRPC_DEBUG_HEAT_SHIFT];
+	u32 epoch = rrpc_debug_heat_epoch();
+	unsigned int count = rrpc_debug_heat_read(h, epoch);
+
+	if (count < U8_MAX)
+		count++;
+
+	h->count = count;
+	h->epoch = epoch;
+}
+
+static int rrpc_debug_get_stream(struct rrpc_debug *rrpc_debug, sector_t laddr,
+								int is_gc)
+{
+	struct rrpc_debug_heat *h;
+
+	if (is_gc)
+		return RRPC_DEBUG_STREAM_GC;
+
+	h = &rrpc_debug->heat[laddr >> RRPC_DEBUG_HEAT_SHIFT];
+	if (rrpc_debug_heat_read(h, rrpc_debug_heat_epoch()) >=
+						READ_ONCE(hot_threshold))
+		return RRPC_DEBUG_STREAM_HOT;
+
+	return RRPC_DEBUG_STREAM_COLD;
+}
+
+/* requeue @rlun in the free block ordering after it got or put a block */
+static void rrpc_debug_free_tree_update(struct rrpc_debug *rrpc_debug,
+						struct rrpc_debug_lun *rlun)
+{
+	struct rb_node **new = &rrpc_debug->free_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct rrpc_debug_lun *this;
+
+	spin_lock(&rrpc_debug->free_lock);
+	if (!RB_EMPTY_NODE(&rlun->free_node))
+		rb_erase(&rlun->free_node, &rrpc_debug->free_tree);
+
+	rlun->free_key = rlun->parent->nr_free_blocks;
+
+	while (*new) {
+		this = rb_entry(*new, struct rrpc_debug_lun, free_node);
+		parent = *new;
+
+		if (rlun->free_key > this->free_key ||
+		    (rlun->free_key == this->free_key && rlun > this))
+			new = &(*new)->rb_right;
+		else
+			new = &(*new)->rb_left;
+	}
+
+	rb_link_node(&rlun->free_node, parent, new);
+	rb_insert_color(&rlun->free_node, &rrpc_debug->free_tree);
+	spin_unlock(&rrpc_debug->free_lock);
+}
+
+static struct rrpc_debug_block *rrpc_debug_get_blk(struct rrpc_debug *rrpc_debug, struct rrpc_debug_lun *rlun,
+							unsigned long flags)
+{
+	struct nvm_block *blk;
+	struct rrpc_debug_block *rblk;
+
+	blk = nvm_get_blk(rrpc_debug->dev, rlun->parent, 0);
+	if (!blk)
+		return NULL;
+
+	trace_rrpc_debug_get_blk(rrpc_debug, blk->id);
+
+	rblk = rrpc_debug_get_rblk(rlun, blk->id);
+	blk->priv = rblk;
+
+	bitmap_zero(rblk->invalid_pages, rrpc_debug->dev->pgs_per_blk);
+	rblk->next_page = 0;
+	rblk->nr_invalid_pages = 0;
+	atomic_set(&rblk->data_cmnt_size, 0);
+
+	rrpc_debug_free_tree_update(rrpc_debug, rlun);
+	rrpc_debug_jnl_blk(rrpc_debug, rblk, 1);
+
+	return rblk;
+}
+
+/* retry the bios parked until a block is put back or a translation page
+ * is loaded
+ */
+static void rrpc_debug_retry_nospace(struct rrpc_debug *rrpc_debug)
+{
+	struct bio_list bios;
+	unsigned long flags;
+
+	atomic_inc(&rrpc_debug->free_seq);
+
+	spin_lock_irqsave(&rrpc_debug->bio_lock, flags);
+	bios = rrpc_debug->nospace_bios;
+	bio_list_init(&rrpc_debug->nospace_bios);
+	spin_unlock_irqrestore(&rrpc_debug->bio_lock, flags);
+
+	rrpc_debug_requeue_bios(rrpc_debug, &bios);
+	rrpc_debug_wb_unpark(rrpc_debug);
+}
+
+static void rrpc_debug_put_blk(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
+{
+	trace_rrpc_debug_put_blk(rrpc_debug, rblk->parent->id);
+
+	nvm_put_blk(rrpc_debug->dev, rblk->parent);
+	rrpc_debug_free_tree_update(rrpc_debug, rblk->rlun);
+	rrpc_debug_jnl_blk(rrpc_debug, rblk, 0);
+
+	/* writes waiting for space may make progress now */
+	rrpc_debug_retry_nospace(rrpc_debug);
+}
+
+static unsigned int rrpc_debug_lun_load(struct rrpc_debug_lun *rlun)
+{
+	return atomic_read(&rlun->inflight) +
+			atomic_read(&rlun->erasing) * RRPC_DEBUG_ERASE_LOAD;
+}
+
+static void rrpc_debug_lun_io_add(struct rrpc_debug *rrpc_debug, u64 paddr, int delta)
+{
+	atomic_add(delta, &rrpc_debug_addr_to_rlun(rrpc_debug, paddr)->inflight);
+}
+
+/* account the pages of a mapped request against the luns serving them */
+static void rrpc_debug_rq_io_add(struct rrpc_debug *rrpc_debug, sector_t laddr,
+						unsigned int npages, int delta)
+{
+	unsigned int i;
+	u64 paddr;
+
+	for (i = 0; i < npages; i++) {
+		paddr = rrpc_debug_l2p(rrpc_debug, laddr + i)->addr;
+		if (paddr != ADDR_EMPTY)
+			rrpc_debug_lun_io_add(rrpc_debug, paddr, delta);
+	}
+}
+
+static struct rrpc_debug_lun *rrpc_debug_cursor_lun(struct rrpc_debug *rrpc_debug,
+						int cpu, unsigned int next)
+{
+	int groups = rrpc_debug->nr_lun_groups;
+	int group, nr_in_group;
+
+	if (!rrpc_debug->lun_affinity)
+		return rrpc_debug->lun_order[next % rrpc_debug->nr_luns];
+
+	group = cpu % groups;
+	nr_in_group = (rrpc_debug->nr_luns - group + groups - 1) / groups;
+
+	return rrpc_debug->lun_order[group + (next % nr_in_group) * groups];
+}
+
+/* Each cpu round-robins over the luns with a cursor of its own, starting at
+ * a different lun, so concurrent writers neither share a counter nor line up
+ * on the same lun lock. In affinity mode a cpu only visits the luns of its
+ * group, which makes writers on different groups fully independent.
+ */
+static struct rrpc_debug_lun *get_next_lun(struct rrpc_debug *rrpc_debug)
+{
+	int cpu = get_cpu();
+	unsigned int next = ++(*per_cpu_ptr(rrpc_debug->lun_cursor, cpu));
+	struct rrpc_debug_lun *rlun, *alt;
+
+	put_cpu();
+
+	/* of the lun the cursor points at and its successor, write to the
+	 * one with less outstanding I/O and erases
+	 */
+	rlun = rrpc_debug_cursor_lun(rrpc_debug, cpu, next);
+	alt = rrpc_debug_cursor_lun(rrpc_debug, cpu, next + 1);
+
+	if (rrpc_debug_lun_load(alt) < rrpc_debug_lun_load(rlun))
+		return alt;
+
+	return rlun;
+}
+
+/* Queue work on the lun to a cpu of its node. Unbound workqueues pick
+ * their worker pool by the node of that cpu.
+ */
+static void rrpc_debug_queue_lun_work(struct workqueue_struct *wq,
+			struct rrpc_debug_lun *rlun, struct work_struct *work)
+{
+	int cpu = WORK_CPU_UNBOUND;
+
+	if (rlun->node != NUMA_NO_NODE) {
+		cpu = cpumask_any_and(cpumask_of_node(rlun->node),
+							cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = WORK_CPU_UNBOUND;
+	}
+
+	queue_work_on(cpu, wq, work);
+}
+
+static void rrpc_debug_gc_kick(struct rrpc_debug *rrpc_debug)
+{
+	struct rrpc_debug_lun *rlun;
+	unsigned int i;
+
+	for (i = 0; i < rrpc_debug->nr_luns; i++) {
+		rlun = &rrpc_debug->luns[i];
+		rrpc_debug_queue_lun_work(rrpc_debug->krqd_wq, rlun,
+							&rlun->ws_gc);
+	}
+}
+
+/*
+ * timed GC every interval.
+ */
+static void rrpc_debug_gc_timer(unsigned long data)
+{
+	struct rrpc_debug *rrpc_debug = (struct rrpc_debug *)data;
+
+	rrpc_debug_gc_kick(rrpc_debug);
+	mod_timer(&rrpc_debug->gc_timer, jiffies + msecs_to_jiffies(10));
+}
+
+static struct rrpc_debug_wb_shard *rrpc_debug_wb_shard(struct rrpc_debug *rrpc_debug,
+								sector_t laddr)
+{
+	return &rrpc_debug->wb_shards[laddr & (RRPC_DEBUG_WB_SHARDS - 1)];
+}
+
+/* hand the open unit of @rlun to the flush worker, requires rlun->wb_lock */
+static void rrpc_debug_wb_close(struct rrpc_debug *rrpc_debug, struct rrpc_debug_lun *rlun)
+{
+	struct rrpc_debug_wb_unit *unit = rlun->wb_open;
+	int i;
+
+	lockdep_assert_held(&rlun->wb_lock);
+
+	unit->state = RRPC_DEBUG_WB_FLUSHING;
+	atomic_inc(&rrpc_debug->wb_flushing);
+	rrpc_debug_queue_lun_work(rrpc_debug->krqd_wq, rlun, &unit->ws_flush);
+
+	rlun->wb_open = NULL;
+	for (i = 0; i < RRPC_DEBUG_WB_UNITS; i++) {
+		if (rlun->wb_units[i].state == RRPC_DEBUG_WB_FREE) {
+			rlun->wb_units[i].state = RRPC_DEBUG_WB_OPEN;
+			rlun->wb_open = &rlun->wb_units[i];
+			break;
+		}
+	}
+}
+
+/* write out all buffered pages, and wait for them to be on the media */
+static void rrpc_debug_wb_flush(struct rrpc_debug *rrpc_debug, int wait)
+{
+	struct rrpc_debug_lun *rlun;
+	unsigned long flags;
+	int i;
+
+	if (!rrpc_debug->wb_pages)
+		return;
+
+	rrpc_debug_for_each_lun(rrpc_debug, rlun, i) {
+		spin_lock_irqsave(&rlun->wb_lock, flags);
+		if (rlun->wb_open && rlun->wb_open->nr_pages)
+			rrpc_debug_wb_close(rrpc_debug, rlun);
+		spin_unlock_irqrestore(&rlun->wb_lock, flags);
+	}
+
+	if (wait)
+		wait_event(rrpc_debug->wb_wait,
+				!atomic_read(&rrpc_debug->wb_flushing));
+}
+
+/* start writing the units holding any of the given pages */
+static void rrpc_debug_wb_kick(struct rrpc_debug *rrpc_debug, sector_t laddr,
+							unsigned int npages)
+{
+	struct rrpc_debug_wb_shard *shard;
+	struct rrpc_debug_wb_slot *slot;
+	struct rrpc_debug_lun *rlun;
+	unsigned long flags;
+	unsigned int i;
+
+	if (!atomic_read(&rrpc_debug->wb_buffered))
+		return;
+
+	for (i = 0; i < npages; i++) {
+		shard = rrpc_debug_wb_shard(rrpc_debug, laddr + i);
+
+		spin_lock_irqsave(&shard->lock, flags);
+		slot = radix_tree_lookup(&shard->tree, laddr + i);
+		if (slot) {
+			rlun = slot->unit->rlun;
+			spin_lock(&rlun->wb_lock);
+			if (slot->unit->state == RRPC_DEBUG_WB_OPEN)
+				rrpc_debug_wb_close(rrpc_debug, rlun);
+			spin_unlock(&rlun->wb_lock);
+		}
+		spin_unlock_irqrestore(&shard->lock, flags);
+	}
+}
+
+static void rrpc_debug_wb_timer(unsigned long data)
+{
+	rrpc_debug_wb_flush((struct rrpc_debug *)data, 0);
+}
+
+static int rrpc_debug_wb_write(struct rrpc_debug *rrpc_debug, struct bio *bio)
+{
+	sector_t laddr = rrpc_debug_get_laddr(bio);
+	struct rrpc_debug_wb_shard *shard = rrpc_debug_wb_shard(rrpc_debug, laddr);
+	struct rrpc_debug_wb_slot *slot;
+	struct rrpc_debug_wb_unit *unit;
+	struct rrpc_debug_lun *rlun;
+	struct page *page, *old;
+	struct bvec_iter iter;
+	unsigned long flags;
+	int buffered = 0;
+
+	page = mempool_alloc(rrpc_debug->page_pool, GFP_NOIO);
+	if (!page)
+		return 0;
+
+	iter = bio->bi_iter;
+	rrpc_debug_bio_copy(bio, &iter, page, 0);
+	old = page;
+
+	rlun = get_next_lun(rrpc_debug);
+
+	spin_lock_irqsave(&shard->lock, flags);
+	slot = radix_tree_lookup(&shard->tree, laddr);
+	if (slot) {
+		/* overwrite while the page is still gathered, otherwise wait
+		 * for it to be written out
+		 */
+		spin_lock(&slot->unit->rlun->wb_lock);
+		if (slot->unit->state == RRPC_DEBUG_WB_OPEN) {
+			old = slot->page;
+			slot->page = page;
+			buffered = 1;
+		}
+		spin_unlock(&slot->unit->rlun->wb_lock);
+		goto out;
+	}
+
+	spin_lock(&rlun->wb_lock);
+	unit = rlun->wb_open;
+	if (!unit)
+		goto out_unlock;
+
+	slot = &unit->slots[unit->nr_pages];
+	if (__rrpc_debug_lock_laddr(rrpc_debug, laddr, 1, &slot->inflight))
+		goto out_unlock;
+
+	if (radix_tree_insert(&shard->tree, laddr, slot)) {
+		rrpc_debug_unlock_laddr(rrpc_debug, &slot->inflight);
+		goto out_unlock;
+	}
+
+	slot->laddr = laddr;
+	slot->page = page;
+	old = NULL;
+	buffered = 1;
+	atomic_inc(&rrpc_debug->wb_buffered);
+
+	if (!unit->nr_pages++ && !timer_pending(&rrpc_debug->wb_timer))
+		mod_timer(&rrpc_debug->wb_timer,
+				jiffies + msecs_to_jiffies(wb_flush_ms));
+
+	if (unit->nr_pages == rrpc_debug->wb_pages)
+		rrpc_debug_wb_close(rrpc_debug, rlun);
+out_unlock:
+	spin_unlock(&rlun->wb_lock);
+out:
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	if (old)
+		mempool_free(old, rrpc_debug->page_pool);
+
+	if (buffered)
+		rrpc_debug_heat_update(rrpc_debug, laddr);
+
+	return buffered;
+}
+
+static int rrpc_debug_wb_read(struct rrpc_debug *rrpc_debug, struct bio *bio)
+{
+	sector_t laddr = rrpc_debug_get_laddr(bio);
+	struct rrpc_debug_wb_shard *shard;
+	struct rrpc_debug_wb_slot *slot;
+	struct bvec_iter iter = bio->bi_iter;
+	unsigned long flags;
+
+	if (!atomic_read(&rrpc_debug->wb_buffered))
+		return 0;
+
+	shard = rrpc_debug_wb_shard(rrpc_debug, laddr);
+
+	spin_lock_irqsave(&shard->lock, flags);
+	slot = radix_tree_lookup(&shard->tree, laddr);
+	if (slot)
+		rrpc_debug_bio_copy(bio, &iter, slot->page, 1);
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	return slot != NULL;
+}
+
+/* Serve a single page bio from the write buffer. Returns 1 if the bio is
+ * complete, 0 if it has to go to the media.
+ */
+static int rrpc_debug_wb_rq(struct rrpc_debug *rrpc_debug, struct bio *bio)
+{
+	if (!rrpc_debug->wb_pages ||
+	    bio->bi_iter.bi_size != RRPC_DEBUG_EXPOSED_PAGE_SIZE)
+		return 0;
+
+	if (bio_rw(bio) == WRITE) {
+		if (bio->bi_rw & REQ_FUA)
+			return 0;
+		return rrpc_debug_wb_write(rrpc_debug, bio);
+	}
+
+	return rrpc_debug_wb_read(rrpc_debug, bio);
+}
+
+/* Reserve the pages of a unit on its lun and point the buffered logical pages
+ * at them, falling back to other luns. Returns -ENOSPC if none has space
+ * left outside the GC reserve; the pages reserved so far are kept for the
+ * next attempt.
+ */
+static int rrpc_debug_wb_map(struct rrpc_debug *rrpc_debug, struct rrpc_debug_wb_unit *unit)
+{
+	sector_t laddr = unit->slots[0].laddr;
+	struct rrpc_debug_addr pad;
+	struct rrpc_debug_lun *rlun;
+	u64 paddr;
+	int i, j, n;
+
+	for (i = unit->nr_mapped; i < rrpc_debug->wb_pages; i += n) {
+		n = __rrpc_debug_map_run(rrpc_debug, unit->rlun, laddr,
+					rrpc_debug->wb_pages - i, 0, &paddr);
+		if (!n)
+			n = rrpc_debug_map_run(rrpc_debug, laddr,
+					rrpc_debug->wb_pages - i, 0, &paddr);
+		if (!n) {
+			unit->nr_mapped = i;
+			return -ENOSPC;
+		}
+
+		for (j = 0; j < n; j++)
+			unit->paddr[i + j] = paddr + j;
+	}
+	unit->nr_mapped = 0;
+
+	for (i = 0; i < unit->nr_pages; i++)
+		rrpc_debug_update_map(rrpc_debug, unit->slots[i].laddr,
+							unit->paddr[i]);
+
+	/* padding is invalid as soon as it is written */
+	for (; i < rrpc_debug->wb_pages; i++) {
+		pad.addr = unit->paddr[i];
+		rlun = rrpc_debug_addr_to_rlun(rrpc_debug, pad.addr);
+
+		spin_lock(&rlun->rev_lock);
+		rrpc_debug_page_invalidate(rrpc_debug, &pad);
+		spin_unlock(&rlun->rev_lock);
+	}
+
+	return 0;
+}
+
+/* Wait for a block to be freed. Buffered pages hold their ranges locked and
+ * GC may be waiting on them, so the unit must not block the workqueue GC
+ * runs on. @seq is free_seq before the pages were reserved.
+ */
+static void rrpc_debug_wb_park(struct rrpc_debug *rrpc_debug,
+			struct rrpc_debug_wb_unit *unit, unsigned int seq)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&rrpc_debug->wb_park_lock, flags);
+	if (atomic_read(&rrpc_debug->free_seq) == seq) {
+		list_add_tail(&unit->park, &rrpc_debug->wb_parked);
+		unit = NULL;
+	}
+	spin_unlock_irqrestore(&rrpc_debug->wb_park_lock, flags);
+
+	if (unit)
+		rrpc_debug_queue_lun_work(rrpc_debug->krqd_wq, unit->rlun,
+							&unit->ws_flush);
+	else
+		rrpc_debug_gc_kick(rrpc_debug);
+}
+
+static void rrpc_debug_wb_unpark(struct rrpc_debug *rrpc_debug)
+{
+	struct rrpc_debug_wb_unit *unit, *next;
+	unsigned long flags;
+	LIST_HEAD(units);
+
+	if (!rrpc_debug->wb_pages)
+		return;
+
+	spin_lock_irqsave(&rrpc_debug->wb_park_lock, flags);
+	list_splice_init(&rrpc_debug->wb_parked, &units);
+	spin_unlock_irqrestore(&rrpc_debug->wb_park_lock, flags);
+
+	list_for_each_entry_safe(unit, next, &units, park) {
+		list_del_init(&unit->park);
+		rrpc_debug_queue_lun_work(rrpc_debug->krqd_wq, unit->rlun,
+							&unit->ws_flush);
+	}
+}
+
+static void rrpc_debug_wb_end_io(struct rrpc_debug *rrpc_debug, struct nvm_rq *rqd,
+								int error)
+{
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
+	struct rrpc_debug_wb_unit *unit = rrqd->unit;
+	struct rrpc_debug_lun *rlun = unit->rlun;
+	struct rrpc_debug_wb_shard *shard;
+	struct rrpc_debug_wb_slot *slot;
+	unsigned long flags;
+	int i;
+
+	rrpc_debug_lat_add(rrpc_debug, RRPC_DEBUG_LAT_WRITE, rrqd->start);
+
+	for (i = 0; i < rrpc_debug->wb_pages; i++) {
+		rrpc_debug_lun_io_add(rrpc_debug, unit->paddr[i], -1);
+		if (error) {
+			rrpc_debug_page_written(rrpc_debug, unit->paddr[i]);
+			continue;
+		}
+
+		rrpc_debug_page_committed(rrpc_debug, unit->paddr[i]);
+		if (i < unit->nr_pages)
+			rrpc_debug_lun_stat(rrpc_debug, unit->paddr[i],
+						RRPC_DEBUG_STAT_USER_PAGES);
+	}
+
+	if (rqd->ppa_list)
+		rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+	bio_put(rqd->bio);
+	rrpc_debug_free_rq(rrpc_debug, rqd);
+
+	/* the pages are still buffered and their ranges locked, write them
+	 * again to new places. Remapping invalidates the failed ones.
+	 */
+	if (error && unit->retries++ < RRPC_DEBUG_WB_RETRIES) {
+		pr_err("rrpc_debug: write buffer flush failed: %d, retrying\n",
+									error);
+		rrpc_debug_queue_lun_work(rrpc_debug->krqd_wq, rlun,
+							&unit->ws_flush);
+		return;
+	}
+
+	if (error) {
+		pr_err("rrpc_debug: write buffer flush failed: %d, %d pages lost\n",
+							error, unit->nr_pages);
+		atomic_set(&rrpc_debug->wb_error, 1);
+	} else {
+		atomic64_add(unit->nr_pages,
+				&rrpc_debug->gc_policy->user_pages);
+	}
+
+	for (i = 0; i < unit->nr_pages; i++) {
+		slot = &unit->slots[i];
+		shard = rrpc_debug_wb_shard(rrpc_debug, slot->laddr);
+
+		spin_lock_irqsave(&shard->lock, flags);
+		radix_tree_delete(&shard->tree, slot->laddr);
+		rrpc_debug_unlock_laddr(rrpc_debug, &slot->inflight);
+		spin_unlock_irqrestore(&shard->lock, flags);
+
+		mempool_free(slot->page, rrpc_debug->page_pool);
+	}
+	atomic_sub(unit->nr_pages, &rrpc_debug->wb_buffered);
+
+	spin_lock_irqsave(&rlun->wb_lock, flags);
+	unit->nr_pages = 0;
+	unit->retries = 0;
+	unit->state = RRPC_DEBUG_WB_FREE;
+	if (!rlun->wb_open) {
+		unit->state = RRPC_DEBUG_WB_OPEN;
+		rlun->wb_open = unit;
+	}
+	spin_unlock_irqrestore(&rlun->wb_lock, flags);
+
+	if (atomic_dec_and_test(&rrpc_debug->wb_flushing))
+		wake_up_all(&rrpc_debug->wb_wait);
+}
+
+/* write a closed unit, padded to its full size */
+static void rrpc_debug_wb_flush_unit(struct work_struct *work)
+{
+	struct rrpc_debug_wb_unit *unit = container_of(work, struct rrpc_debug_wb_unit,
+								ws_flush);
+	struct rrpc_debug *rrpc_debug = unit->rlun->rrpc_debug;
+	struct nvm_dev *dev = rrpc_debug->dev;
+	unsigned int seq = atomic_read(&rrpc_debug->free_seq);
+	struct rrpc_debug_rq *rrqd;
+	struct nvm_rq *rqd;
+	struct page *page;
+	struct bio *bio;
+	int i, err = -ENOMEM;
+
+	if (rrpc_debug_wb_map(rrpc_debug, unit)) {
+		rrpc_debug_wb_park(rrpc_debug, unit, seq);
+		return;
+	}
+
+	bio = bio_alloc(GFP_NOIO, rrpc_debug->wb_pages);
+	rqd = rrpc_debug_alloc_rq(rrpc_debug, GFP_NOIO);
+
+	rqd->bio = bio;
+	rqd->ins = &rrpc_debug->instance;
+	rqd->nr_pages = rrpc_debug->wb_pages;
+	rqd->opcode = NVM_OP_HBWRITE;
+
+	rrqd = nvm_rq_to_pdu(rqd);
+	rrqd->flags = NVM_IOTYPE_NONE;
+	rrqd->wait = NULL;
+	rrqd->unit = unit;
+
+	for (i = 0; i < rrpc_debug->wb_pages; i++)
+		rrpc_debug_lun_io_add(rrpc_debug, unit->paddr[i], 1);
+
+	rqd->ppa_list = rrpc_debug_get_ppa_list(rrpc_debug, rqd, GFP_NOIO);
+	if (!rqd->ppa_list)
+		goto err;
+
+	if (rrpc_debug_oob_alloc(rrpc_debug, rqd, rrpc_debug->wb_pages, GFP_NOIO))
+		goto err;
+
+	rrpc_debug_ppa_list(rrpc_debug, rqd->ppa_list, unit->paddr,
+							rrpc_debug->wb_pages);
+	for (i = 0; i < rrpc_debug->wb_pages; i++) {
+		rrpc_debug_oob_set(rrpc_debug, rqd, i, i < unit->nr_pages ?
+					unit->slots[i].laddr : ADDR_EMPTY);
+
+		page = i < unit->nr_pages ? unit->slots[i].page : ZERO_PAGE(0);
+		if (bio_add_pc_page(dev->q, bio, page,
+				RRPC_DEBUG_EXPOSED_PAGE_SIZE, 0) !=
+						RRPC_DEBUG_EXPOSED_PAGE_SIZE)
+			goto err;
+	}
+
+	bio->bi_iter.bi_sector = rrpc_debug_get_sector(unit->slots[0].laddr);
+	bio->bi_rw = WRITE;
+
+	rrqd->start = ktime_get_ns();
+	err = nvm_submit_io(dev, rqd);
+	if (!err)
+		return;
+err:
+	rrpc_debug_wb_end_io(rrpc_debug, rqd, err);
+}
+
+static void rrpc_debug_gc_release(struct rrpc_debug *rrpc_debug,
+				struct rrpc_debug_gc_batch *batch, int from)
+{
+	int i;
+
+	for (i = from; i < batch->nr_pages; i++) {
+		rrpc_debug_unlock_laddr(rrpc_debug, &batch->inflight[i]);
+		mempool_free(batch->pages[i], rrpc_debug->page_pool);
+	}
+
+	batch->nr_pages = from;
+}
+
+/* lock valid pages from @slot onwards until the batch is full, returns the
+ * slot to continue from. Only a pipeline that holds no pages yet (@first)
+ * waits for the page pool, the pipelines of the other luns may hold all of
+ * it and complete without waiting themselves.
+ */
+static int rrpc_debug_gc_fill(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk,
+			struct rrpc_debug_gc_batch *batch, int slot, int *busy,
+			bool first)
+{
+	struct rrpc_debug_lun *rlun = rblk->rlun;
+	int nr_pgs_per_blk = rrpc_debug->dev->pgs_per_blk;
+	struct page *page = NULL;
+	u64 paddr;
+	sector_t laddr;
+
+	batch->nr_pages = 0;
+
+	while (batch->nr_pages < rrpc_debug->gc_batch) {
+		slot = find_next_zero_bit(rblk->invalid_pages, nr_pgs_per_blk,
+									slot);
+		if (slot >= nr_pgs_per_blk)
+			break;
+
+		if (!page) {
+			page = mempool_alloc(rrpc_debug->page_pool,
+					(first && !batch->nr_pages) ?
+					GFP_NOIO : GFP_NOWAIT);
+			if (!page)
+				break;
+		}
+
+		paddr = block_to_addr(rrpc_debug, rblk) + slot++;
+
+		spin_lock(&rlun->rev_lock);
+		/* Get logical address from physical to logical table */
+		laddr = rrpc_debug_rev(rrpc_debug, paddr)->addr;
+		/* already updated by previous regular write */
+		if (laddr == ADDR_EMPTY) {
+			spin_unlock(&rlun->rev_lock);
+			continue;
+		}
+
+		if (rrpc_debug_lock_laddr(rrpc_debug, laddr, 1,
+					&batch->inflight[batch->nr_pages])) {
+			spin_unlock(&rlun->rev_lock);
+			(*busy)++;
+			continue;
+		}
+		spin_unlock(&rlun->rev_lock);
+
+		batch->laddr[batch->nr_pages] = laddr;
+		batch->paddr[batch->nr_pages] = paddr;
+		batch->pages[batch->nr_pages] = page;
+		batch->nr_pages++;
+		page = NULL;
+	}
+
+	if (page)
+		mempool_free(page, rrpc_debug->page_pool);
+
+	return slot;
+}
+
+/* remap the locked logical addresses to new physical pages */
+static int rrpc_debug_gc_map(struct rrpc_debug *rrpc_debug, struct rrpc_debug_gc_batch *batch)
+{
+	u64 paddr;
+	int i, j, n;
+
+	/* destinations are reserved in runs, the valid pages moved seldom
+	 * have consecutive logical addresses so the maps are updated per page
+	 */
+	for (i = 0; i < batch->nr_pages; i += n) {
+		n = rrpc_debug_map_run(rrpc_debug, batch->laddr[i],
+					batch->nr_pages - i, 1, &paddr);
+		if (!n) {
+			rrpc_debug_gc_release(rrpc_debug, batch, i);
+			return -ENOSPC;
+		}
+
+		for (j = 0; j < n; j++) {
+			rrpc_debug_update_map(rrpc_debug, batch->laddr[i + j],
+								paddr + j);
+			batch->paddr[i + j] = paddr + j;
+		}
+	}
+
+	return 0;
+}
+
+/* submit the batch as one vector command against batch->paddr */
+static int rrpc_debug_gc_submit(struct rrpc_debug *rrpc_debug,
+				struct rrpc_debug_gc_batch *batch, int rw)
+{
+	struct nvm_dev *dev = rrpc_debug->dev;
+	struct rrpc_debug_rq *rrqd;
+	struct nvm_rq *rqd;
+	struct bio *bio;
+	int i;
+
+	bio = bio_alloc(GFP_NOIO, batch->nr_pages);
+	if (!bio) {
+		pr_err("nvm: could not alloc bio to gc\n");
+		return -ENOMEM;
+	}
+
+	/* TODO: may fail when EXP_PG_SIZE > PAGE_SIZE */
+	for (i = 0; i < batch->nr_pages; i++) {
+		if (bio_add_pc_page(dev->q, bio, batch->pages[i],
+				RRPC_DEBUG_EXPOSED_PAGE_SIZE, 0) !=
+						RRPC_DEBUG_EXPOSED_PAGE_SIZE)
+			goto err_bio;
+	}
+
+	bio->bi_iter.bi_sector = rrpc_debug_get_sector(batch->laddr[0]);
+	bio->bi_rw = rw;
+
+	rqd = rrpc_debug_alloc_rq(rrpc_debug, GFP_NOIO);
+
+	if (rw == WRITE && rrpc_debug_oob_alloc(rrpc_debug, rqd,
+						batch->nr_pages, GFP_NOIO))
+		goto err_rqd;
+
+	if (batch->nr_pages > 1) {
+		rqd->ppa_list = rrpc_debug_get_ppa_list(rrpc_debug, rqd, GFP_NOIO);
+		if (!rqd->ppa_list)
+			goto err_rqd;
+
+		rrpc_debug_ppa_list(rrpc_debug, rqd->ppa_list, batch->paddr,
+							batch->nr_pages);
+	} else {
+		rqd->ppa_addr = rrpc_debug_ppa_to_gaddr(rrpc_debug,
+							batch->paddr[0]);
+	}
+
+	if (rw == WRITE)
+		for (i = 0; i < batch->nr_pages; i++)
+			rrpc_debug_oob_set(rrpc_debug, rqd, i, batch->laddr[i]);
+
+	rqd->opcode = (rw == WRITE) ? NVM_OP_HBWRITE : NVM_OP_HBREAD;
+	rqd->bio = bio;
+	rqd->ins = &rrpc_debug->instance;
+	rqd->nr_pages = batch->nr_pages;
+
+	rrqd = nvm_rq_to_pdu(rqd);
+	rrqd->flags = NVM_IOTYPE_GC;
+	rrqd->wait = &batch->wait;
+	rrqd->unit = NULL;
+
+	batch->rqd = rqd;
+	batch->bio = bio;
+	reinit_completion(&batch->wait);
+
+	for (i = 0; i < batch->nr_pages; i++)
+		rrpc_debug_lun_io_add(rrpc_debug, batch->paddr[i], 1);
+
+	if (nvm_submit_io(dev, rqd)) {
+		for (i = 0; i < batch->nr_pages; i++)
+			rrpc_debug_lun_io_add(rrpc_debug, batch->paddr[i], -1);
+		if (batch->nr_pages > 1)
+			rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+		goto err_rqd;
+	}
+
+	return 0;
+err_rqd:
+	rrpc_debug_free_rq(rrpc_debug, rqd);
+err_bio:
+	bio_put(bio);
+	return -EIO;
+}
+
+static int rrpc_debug_gc_wait(struct rrpc_debug *rrpc_debug, struct rrpc_debug_gc_batch *batch)
+{
+	struct nvm_rq *rqd = batch->rqd;
+	int err, i;
+
+	wait_for_completion_io(&batch->wait);
+
+	for (i = 0; i < batch->nr_pages; i++)
+		rrpc_debug_lun_io_add(rrpc_debug, batch->paddr[i], -1);
+
+	err = batch->bio->bi_error;
+	if (err)
+		pr_err("nvm: gc request failed (%u).\n", err);
+
+	if (rqd->nr_pages > 1)
+		rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+	rrpc_debug_free_rq(rrpc_debug, rqd);
+	bio_put(batch->bio);
+
+	batch->rqd = NULL;
+	batch->bio = NULL;
+
+	return err;
+}
+
+/*
+ * rrpc_debug_move_valid_pages -- migrate live data off the block
+ * @rrpc_debug: the 'rrpc_debug' structure
+ * @block: the block from which to migrate live pages
+ *
+ * Description:
+ *   GC algorithms may call this function to migrate remaining live
+ *   pages off the block prior to erasing it. Valid pages are gathered into
+ *   vectors of up to gc_batch pages. Up to gc_qd vector reads are kept in
+ *   flight, and each is rewritten as one vector write once its read
+ *   completes. This function blocks further execution until the operation
+ *   is complete.
+ */
+static int rrpc_debug_move_valid_pages(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
+{
+	struct rrpc_debug_lun *rlun = rblk->rlun;
+	struct rrpc_debug_gc_batch *batch;
+	int nr_pgs_per_blk = rrpc_debug->dev->pgs_per_blk;
+	int slot, busy, nr_batches, i, j;
+	int err = 0;
+
+	if (bitmap_full(rblk->invalid_pages, nr_pgs_per_blk))
+		return 0;
+
+	mutex_lock(&rlun->gc_mutex);
+	do {
+		slot = 0;
+		busy = 0;
+
+		for (nr_batches = 0; nr_batches < rrpc_debug->gc_qd;
+								nr_batches++) {
+			batch = &rlun->gc_batches[nr_batches];
+
+			slot = rrpc_debug_gc_fill(rrpc_debug, rblk, batch, slot,
+							&busy, !nr_batches);
+			if (!batch->nr_pages)
+				break;
+
+			if (rrpc_debug_gc_submit(rrpc_debug, batch, READ)) {
+				pr_err("rrpc_debug: gc read failed.\n");
+				rrpc_debug_gc_release(rrpc_debug, batch, 0);
+				err = -EIO;
+				break;
+			}
+		}
+
+		/* turn each vector around as soon as its read is done */
+		for (i = 0; i < nr_batches; i++) {
+			batch = &rlun->gc_batches[i];
+
+			if (rrpc_debug_gc_wait(rrpc_debug, batch)) {
+				rrpc_debug_gc_release(rrpc_debug, batch, 0);
+				err = -EIO;
+				continue;
+			}
+
+			if (rrpc_debug_gc_map(rrpc_debug, batch))
+				err = -ENOSPC;
+
+			if (batch->nr_pages &&
+			    rrpc_debug_gc_submit(rrpc_debug, batch, WRITE)) {
+				pr_err("rrpc_debug: gc write failed.\n");
+				rrpc_debug_gc_release(rrpc_debug, batch, 0);
+				err = -EIO;
+			}
+		}
+
+		for (i = 0; i < nr_batches; i++) {
+			batch = &rlun->gc_batches[i];
+			if (!batch->nr_pages)
+				continue;
+
+			if (rrpc_debug_gc_wait(rrpc_debug, batch))
+				err = -EIO;
+
+			for (j = 0; j < batch->nr_pages; j++)
+				rrpc_debug_page_committed(rrpc_debug,
+							batch->paddr[j]);
+			atomic64_add(batch->nr_pages,
+					&rrpc_debug->gc_policy->gc_pages);
+
+			trace_rrpc_debug_gc_move(rrpc_debug, rblk->parent->id,
+							batch->nr_pages);
+			rrpc_debug_stat_add(rrpc_debug, rlun - rrpc_debug->luns,
+					RRPC_DEBUG_STAT_GC_PAGES, batch->nr_pages);
+			rrpc_debug_count(RRPC_DEBUG_CNT_GC_MOVE, batch->nr_pages);
+
+			rrpc_debug_gc_release(rrpc_debug, batch, 0);
+		}
+
+		/* only pages locked by in-flight user I/O or buffered writes
+		 * are left
+		 */
+		if (!nr_batches && busy) {
+			DEFINE_WAIT(wait);
+
+			rrpc_debug_wb_flush(rrpc_debug, 0);
+
+			/* sleep until a range is unlocked. The timeout covers
+			 * an unlock that raced with going to sleep.
+			 */
+			prepare_to_wait(&rrpc_debug->inflight_wait, &wait,
+							TASK_UNINTERRUPTIBLE);
+			io_schedule_timeout(msecs_to_jiffies(10));
+			finish_wait(&rrpc_debug->inflight_wait, &wait);
+		}
+	} while (!err && (nr_batches || busy));
+	mutex_unlock(&rlun->gc_mutex);
+
+	if (!bitmap_full(rblk->invalid_pages, nr_pgs_per_blk)) {
+		pr_err("nvm: failed to garbage collect block\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static void rrpc_debug_block_gc(struct work_struct *work)
+{
+	struct rrpc_debug_block_gc *gcb = container_of(work, struct rrpc_debug_block_gc,
+									ws_gc);
+	struct rrpc_debug *rrpc_debug = gcb->rrpc_debug;
+	struct rrpc_debug_block *rblk = gcb->rblk;
+	struct nvm_dev *dev = rrpc_debug->dev;
+	u64 start = ktime_get_ns();
+
+	pr_debug("nvm: block '%lu' being reclaimed\n", rblk->parent->id);
+
+	if (rrpc_debug_move_valid_pages(rrpc_debug, rblk))
+		goto done;
+
+	/* the moved pages' records must reach the journal before their old
+	 * copies are erased, or a crash replays the map into an empty block.
+	 * If some were dropped, the block waits for the checkpoint that
+	 * covers them.
+	 */
+	if (rrpc_debug_jnl_sync(rrpc_debug, false)) {
+		spin_lock(&rblk->rlun->lock);
+		rrpc_debug_prio_add(rblk->rlun, rblk);
+		spin_unlock(&rblk->rlun->lock);
+		goto done;
+	}
+
+	trace_rrpc_debug_gc_erase(rrpc_debug, rblk->parent->id);
+	rrpc_debug_count(RRPC_DEBUG_CNT_GC_ERASE, 1);
+
+	atomic_inc(&rblk->rlun->erasing);
+	nvm_erase_blk(dev, rblk->parent);
+	atomic_dec(&rblk->rlun->erasing);
+	rrpc_debug_put_blk(rrpc_debug, rblk);
+
+	rrpc_debug_stat_add(rrpc_debug, rblk->rlun - rrpc_debug->luns,
+						RRPC_DEBUG_STAT_ERASES, 1);
+	rrpc_debug_lat_add(rrpc_debug, RRPC_DEBUG_LAT_GC, start);
+done:
+	mempool_free(gcb, rrpc_debug->gcb_pool);
+}
+
+/* the block with highest number of invalid pages heads the highest non-empty
+ * bucket. prio_max only moves down past buckets emptied since the last pick.
+ * requires rlun->lock
+ */
+static struct rrpc_debug_block *block_prio_find_max(struct rrpc_debug_lun *rlun)
+{
+	BUG_ON(!rlun->nr_prio);
+
+	while (list_empty(&rlun->prio_buckets[rlun->prio_max]))
+		rlun->prio_max--;
+
+	return list_first_entry(&rlun->prio_buckets[rlun->prio_max],
+					struct rrpc_debug_block, prio);
+}
+
+/* greedy: reclaim the block with the most invalid pages */
+static struct rrpc_debug_block *rrpc_debug_gc_select_greedy(struct rrpc_debug_lun *rlun)
+{
+	return block_prio_find_max(rlun);
+}
+
+static u64 rrpc_debug_gc_score(struct rrpc_debug *rrpc_debug,
+					struct rrpc_debug_block *rblk)
+{
+	unsigned int nr_valid = rrpc_debug->dev->pgs_per_blk -
+						rblk->nr_invalid_pages;
+	u64 age = jiffies - rblk->closed + 1;
+
+	if (!nr_valid)
+		return U64_MAX;
+
+	return div_u64((age * rblk->nr_invalid_pages) << 10, 2 * nr_valid);
+}
+
+/* cost-benefit: maximize age * (1 - u) / 2u, where u is the fraction of
+ * valid pages that must be moved. Cold blocks win over equally utilized hot
+ * ones, which are likely to invalidate more pages if left alone.
+ *
+ * Only the gc_window oldest candidates and the one with the most invalid
+ * pages are scored, so a pick under rlun->lock stays bounded.
+ */
+static struct rrpc_debug_block *rrpc_debug_gc_select_cost_benefit(struct rrpc_debug_lun *rlun)
+{
+	struct rrpc_debug *rrpc_debug = rlun->rrpc_debug;
+	struct rrpc_debug_block *rblk, *max;
+	unsigned int window = max_t(unsigned int, READ_ONCE(gc_window), 1);
+	u64 score, max_score;
+
+	max = block_prio_find_max(rlun);
+	max_score = rrpc_debug_gc_score(rrpc_debug, max);
+
+	list_for_each_entry(rblk, &rlun->age_list, age) {
+		if (max_score == U64_MAX)
+			break;
+
+		score = rrpc_debug_gc_score(rrpc_debug, rblk);
+		if (score > max_score) {
+			max = rblk;
+			max_score = score;
+		}
+		if (!--window)
+			break;
+	}
+
+	return max;
+}
+
+/* windowed greedy: greedy among the gc_window oldest candidates. Falls back
+ * to plain greedy when none of them has an invalid page, younger blocks may.
+ */
+static struct rrpc_debug_block *rrpc_debug_gc_select_windowed(struct rrpc_debug_lun *rlun)
+{
+	struct rrpc_debug_block *rblk, *max = NULL;
+	unsigned int window = max_t(unsigned int, READ_ONCE(gc_window), 1);
+
+	list_for_each_entry(rblk, &rlun->age_list, age) {
+		if (rblk->nr_invalid_pages &&
+		    (!max || rblk->nr_invalid_pages > max->nr_invalid_pages))
+			max = rblk;
+		if (!--window)
+			break;
+	}
+
+	return max ? max : block_prio_find_max(rlun);
+}
+
+static struct rrpc_debug_gc_policy rrpc_debug_gc_policies[] = {
+	{
+		.name	= "greedy",
+		.select	= rrpc_debug_gc_select_greedy,
+	},
+	{
+		.name	= "cost-benefit",
+		.select	= rrpc_debug_gc_select_cost_benefit,
+	},
+	{
+		.name	= "windowed",
+		.select	= rrpc_debug_gc_select_windowed,
+	},
+};
+
+static struct rrpc_debug_gc_policy *rrpc_debug_gc_policy_get(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(rrpc_debug_gc_policies); i++)
+		if (sysfs_streq(name, rrpc_debug_gc_policies[i].name))
+			return &rrpc_debug_gc_policies[i];
+
+	return NULL;
+}
+
+static int rrpc_debug_gc_stats_get(char *buf, const struct kernel_param *kp)
+{
+	int i, len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(rrpc_debug_gc_policies); i++) {
+		struct rrpc_debug_gc_policy *pol = &rrpc_debug_gc_policies[i];
+		u64 user = atomic64_read(&pol->user_pages);
+		u64 gc = atomic64_read(&pol->gc_pages);
+		u64 wa = user ? div64_u64((user + gc) * 1000, user) : 0;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+			"%s user_pages=%llu gc_pages=%llu wa=%llu.%03llu\n",
+			pol->name, user, gc, div_u64(wa, 1000),
+			wa - div_u64(wa, 1000) * 1000);
+	}
+
+	return len;
+}
+
+static const struct kernel_param_ops rrpc_debug_gc_stats_ops = {
+	.get	= rrpc_debug_gc_stats_get,
+};
+module_param_cb(gc_stats, &rrpc_debug_gc_stats_ops, NULL, 0444);
+MODULE_PARM_DESC(gc_stats, "Write amplification per GC policy");
+
+static void rrpc_debug_lun_gc(struct work_struct *work)
+{
+	struct rrpc_debug_lun *rlun = container_of(work, struct rrpc_debug_lun, ws_gc);
+	struct rrpc_debug *rrpc_debug = rlun->rrpc_debug;
+	struct nvm_lun *lun = rlun->parent;
+	struct rrpc_debug_block_gc *gcb;
+	unsigned int nr_blocks_need;
+
+	nr_blocks_need = rrpc_debug->dev->blks_per_lun / GC_LIMIT_INVERSE;
+
+	if (nr_blocks_need < rrpc_debug->nr_luns)
+		nr_blocks_need = rrpc_debug->nr_luns;
+
+	spin_lock(&rlun->lock);
+	while (nr_blocks_need > lun->nr_free_blocks && rlun->nr_prio) {
+		struct rrpc_debug_block *rblock =
+					rrpc_debug->gc_policy->select(rlun);
+		struct nvm_block *block = rblock->parent;
+
+		if (!rblock->nr_invalid_pages)
+			break;
+
+		BUG_ON(!block_is_full(rrpc_debug, rblock));
+
+		gcb = mempool_alloc(rrpc_debug->gcb_pool, GFP_ATOMIC);
+		if (!gcb)
+			break;
+
+		rrpc_debug_prio_del(rlun, rblock);
+
+		trace_rrpc_debug_gc_select(rrpc_debug, block->id,
+						rblock->nr_invalid_pages);
+
+		gcb->rrpc_debug = rrpc_debug;
+		gcb->rblk = rblock;
+		INIT_WORK(&gcb->ws_gc, rrpc_debug_block_gc);
+
+		rrpc_debug_queue_lun_work(rrpc_debug->kgc_wq, rlun,
+							&gcb->ws_gc);
+
+		nr_blocks_need--;
+	}
+	spin_unlock(&rlun->lock);
+
+	/* TODO: Hint that request queue can be started again */
+}
+
+static void rrpc_debug_gc_queue(struct work_struct *work)
+{
+	struct rrpc_debug_block_gc *gcb = container_of(work, struct rrpc_debug_block_gc,
+									ws_gc);
+	struct rrpc_debug *rrpc_debug = gcb->rrpc_debug;
+	struct rrpc_debug_block *rblk = gcb->rblk;
+	struct nvm_lun *lun = rblk->parent->lun;
+	struct rrpc_debug_lun *rlun = &rrpc_debug->luns[lun->id - rrpc_debug->lun_offset];
+
+	spin_lock(&rlun->lock);
+	rblk->closed = jiffies;
+	rrpc_debug_prio_add(rlun, rblk);
+	spin_unlock(&rlun->lock);
+
+	mempool_free(gcb, rrpc_debug->gcb_pool);
+	pr_debug("nvm: block '%lu' is full, allow GC (sched)\n",
+							rblk->parent->id);
+}
+
+static const struct block_device_operations rrpc_debug_fops = {
+	.owner		= THIS_MODULE,
+};
+
+static struct rrpc_debug_lun *rrpc_debug_get_lun_rr(struct rrpc_debug *rrpc_debug, int is_gc)
+{
+	struct rrpc_debug_lun *max_free = &rrpc_debug->luns[0];
+	struct rb_node *node;
+
+	if (!is_gc)
+		return get_next_lun(rrpc_debug);
+
+	/* during GC, we don't care about RR, instead we want to make
+	 * sure that we maintain evenness between the block luns.
+	 * prevent GC-ing lun from devouring pages of a lun with
+	 * little free blocks.
+	 */
+	spin_lock(&rrpc_debug->free_lock);
+	node = rb_last(&rrpc_debug->free_tree);
+	if (node)
+		max_free = rb_entry(node, struct rrpc_debug_lun, free_node);
+	spin_unlock(&rrpc_debug->free_lock);
+
+	return max_free;
+}
+
+/* Point the @nr logical pages from @laddr at the physical pages from @paddr.
+ * The physical run must come from a single block, see rrpc_debug_map_run.
+ * The logical run may cross translation pages, so entries are looked up one
+ * by one.
+ */
+static void rrpc_debug_update_map_run(struct rrpc_debug *rrpc_debug, sector_t laddr,
+							u64 paddr, int nr)
+{
+	struct rrpc_debug_addr *gp;
+	struct rrpc_debug_lun *rlun, *held = NULL;
+	int i;
+
+	BUG_ON(laddr + nr > rrpc_debug->nr_pages);
+
+	rrpc_debug_rc_invalidate(rrpc_debug, laddr, nr);
+
+	/* old mappings of a run tend to share luns, only switch rev_lock
+	 * when they do not
+	 */
+	for (i = 0; i < nr; i++) {
+		gp = rrpc_debug_l2p(rrpc_debug, laddr + i);
+		if (gp->addr == ADDR_EMPTY)
+			continue;
+
+		rlun = rrpc_debug_addr_to_rlun(rrpc_debug, gp->addr);
+		if (rlun != held) {
+			if (held)
+				spin_unlock(&held->rev_lock);
+			spin_lock(&rlun->rev_lock);
+			held = rlun;
+		}
+
+		rrpc_debug_page_invalidate(rrpc_debug, gp);
+	}
+	if (held)
+		spin_unlock(&held->rev_lock);
+
+	rlun = rrpc_debug_addr_to_rlun(rrpc_debug, paddr);
+
+	spin_lock(&rlun->rev_lock);
+	for (i = 0; i < nr; i++) {
+		rrpc_debug_l2p(rrpc_debug, laddr + i)->addr = paddr + i;
+		rrpc_debug_rev(rrpc_debug, paddr + i)->addr = laddr + i;
+	}
+	spin_unlock(&rlun->rev_lock);
+
+	/* a run spans two translation pages at most */
+	rrpc_debug_map_dirty(rrpc_debug, laddr);
+	if (nr > 1)
+		rrpc_debug_map_dirty(rrpc_debug, laddr + nr - 1);
+}
+
+static struct rrpc_debug_addr *rrpc_debug_update_map(struct rrpc_debug *rrpc_debug, sector_t laddr,
+								u64 paddr)
+{
+	rrpc_debug_update_map_run(rrpc_debug, laddr, paddr, 1);
+
+	return rrpc_debug_l2p(rrpc_debug, laddr);
+}
+
+/* Reserve up to @nr consecutive pages of @rblk within one program unit.
+ * Returns the number reserved, the first one in @paddr.
+ */
+static int rrpc_debug_alloc_run(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk,
+							int nr, u64 *paddr)
+{
+	int prog = rrpc_debug->prog_pages;
+	int free;
+
+	spin_lock(&rblk->lock);
+	free = rrpc_debug->dev->pgs_per_blk - rblk->next_page;
+	if (nr > free)
+		nr = free;
+
+	/* do not straddle two program units, so that a run maps onto one
+	 * multi-plane program
+	 */
+	if (nr > prog - rblk->next_page % prog)
+		nr = prog - rblk->next_page % prog;
+
+	*paddr = block_to_addr(rrpc_debug, rblk) + rblk->next_page;
+	rblk->next_page += nr;
+	spin_unlock(&rblk->lock);
+
+	return nr;
+}
+
+/* Simple round-robin Logical to physical address translation.
+ *
+ * Reserve a run of up to @nr pages on the active append point of the stream
+ * @laddr belongs to, in the next lun. The run ends early when the block fills
+ * up and a new one has to be opened; callers loop for the rest, possibly
+ * landing on another lun.
+ *
+ * Returns the length of the run with its first page in @paddr, 0 if no space
+ * is left. The mapping is not updated.
+ */
+static int __rrpc_debug_map_run(struct rrpc_debug *rrpc_debug, struct rrpc_debug_lun *rlun,
+				sector_t laddr, int nr, int is_gc, u64 *paddr)
+{
+	struct nvm_lun *lun = rlun->parent;
+	struct rrpc_debug_block *rblk;
+	int stream, n;
+
+	if (!is_gc && lun->nr_free_blocks < rrpc_debug->nr_luns * 4)
+		return 0;
+
+	stream = rrpc_debug_get_stream(rrpc_debug, laddr, is_gc);
+
+	spin_lock(&rlun->lock);
+
+	rblk = rlun->cur[stream];
+retry:
+	n = rrpc_debug_alloc_run(rrpc_debug, rblk, nr, paddr);
+
+	if (!n) {
+		rblk = rrpc_debug_get_blk(rrpc_debug, rlun, 0);
+		if (rblk) {
+			rrpc_debug_set_lun_cur(rlun, stream, rblk);
+			goto retry;
+		}
+
+		if (is_gc) {
+			/* retry from emergency gc block */
+			n = rrpc_debug_alloc_run(rrpc_debug, rlun->gc_cur, nr, paddr);
+			if (!n) {
+				rblk = rrpc_debug_get_blk(rrpc_debug, rlun, 1);
+				if (!rblk) {
+					pr_err("rrpc_debug: no more blocks");
+					goto out;
+				}
+
+				rlun->gc_cur = rblk;
+				n = rrpc_debug_alloc_run(rrpc_debug, rlun->gc_cur, nr,
+									paddr);
+			}
+		}
+	}
+
+out:
+	spin_unlock(&rlun->lock);
+
+	if (n) {
+		trace_rrpc_debug_map(rrpc_debug, laddr, *paddr, n,
+						lun->id, stream);
+		rrpc_debug_count(RRPC_DEBUG_CNT_MAP, n);
+	}
+
+	return n;
+}
+
+static int rrpc_debug_map_run(struct rrpc_debug *rrpc_debug, sector_t laddr, int nr,
+						int is_gc, u64 *paddr)
+{
+	struct rrpc_debug_lun *rlun = rrpc_debug_get_lun_rr(rrpc_debug, is_gc);
+
+	return __rrpc_debug_map_run(rrpc_debug, rlun, laddr, nr, is_gc, paddr);
+}
+
+static struct rrpc_debug_addr *rrpc_debug_map_page(struct rrpc_debug *rrpc_debug, sector_t laddr,
+								int is_gc)
+{
+	u64 paddr;
+
+	if (!rrpc_debug_map_run(rrpc_debug, laddr, 1, is_gc, &paddr))
+		return NULL;
+
+	return rrpc_debug_update_map(rrpc_debug, laddr, paddr);
+}
+
+static void rrpc_debug_run_gc(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
+{
+	struct rrpc_debug_block_gc *gcb;
+
+	gcb = mempool_alloc(rrpc_debug->gcb_pool, GFP_ATOMIC);
+	if (!gcb) {
+		pr_err("rrpc_debug: unable to queue block for gc.");
+		return;
+	}
+
+	gcb->rrpc_debug = rrpc_debug;
+	gcb->rblk = rblk;
+
+	INIT_WORK(&gcb->ws_gc, rrpc_debug_gc_queue);
+	rrpc_debug_queue_lun_work(rrpc_debug->kgc_wq, rblk->rlun, &gcb->ws_gc);
+}
+
+/* the write of @paddr is over, whether it made it to the media or not */
+static void rrpc_debug_page_written(struct rrpc_debug *rrpc_debug, u64 paddr)
+{
+	struct rrpc_debug_block *rblk = rrpc_debug_addr_to_rblk(rrpc_debug, paddr);
+	int cmnt_size;
+
+	cmnt_size = atomic_inc_return(&rblk->data_cmnt_size);
+	if (unlikely(cmnt_size == rrpc_debug->dev->pgs_per_blk))
+		rrpc_debug_run_gc(rrpc_debug, rblk);
+}
+
+static void rrpc_debug_page_committed(struct rrpc_debug *rrpc_debug, u64 paddr)
+{
+	rrpc_debug_jnl_committed(rrpc_debug, paddr);
+	rrpc_debug_page_written(rrpc_debug, paddr);
+}
+
+static void rrpc_debug_end_io_write(struct rrpc_debug *rrpc_debug, struct rrpc_debug_rq *rrqd,
+						sector_t laddr, uint8_t npages)
+{
+	u64 paddr;
+	int i;
+
+	for (i = 0; i < npages; i++) {
+		paddr = rrpc_debug_l2p(rrpc_debug, laddr + i)->addr;
+
+		rrpc_debug_page_committed(rrpc_debug, paddr);
+		rrpc_debug_lun_stat(rrpc_debug, paddr, RRPC_DEBUG_STAT_USER_PAGES);
+	}
+
+	atomic64_add(npages, &rrpc_debug->gc_policy->user_pages);
+}
+
+static void rrpc_debug_ra_put(struct bio *bio)
+{
+	struct bio_vec *bv;
+	int i;
+
+	bio_for_each_segment_all(bv, bio, i)
+		__free_page(bv->bv_page);
+	bio_put(bio);
+}
+
+static int rrpc_debug_end_io(struct nvm_rq *rqd, int error)
+{
+	struct rrpc_debug *rrpc_debug = container_of(rqd->ins, struct rrpc_debug, instance);
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
+	uint8_t npages = rqd->nr_pages;
+	sector_t laddr = rrpc_debug_get_laddr(rqd->bio) - npages;
+
+	/* GC vectors and metadata I/O are completed by their waiters */
+	if (rrqd->wait) {
+		complete(rrqd->wait);
+		return 0;
+	}
+
+	if (rrqd->unit) {
+		rrpc_debug_wb_end_io(rrpc_debug, rqd, error);
+		return 0;
+	}
+
+	rrpc_debug_rq_io_add(rrpc_debug, laddr, npages, -1);
+
+	trace_rrpc_debug_complete(rrpc_debug, laddr, npages,
+					bio_data_dir(rqd->bio), error);
+	rrpc_debug_count(RRPC_DEBUG_CNT_COMPLETE, 1);
+	rrpc_debug_lat_add(rrpc_debug, bio_data_dir(rqd->bio) == WRITE ?
+		RRPC_DEBUG_LAT_WRITE : RRPC_DEBUG_LAT_READ, rrqd->start);
+
+	if (bio_data_dir(rqd->bio) == WRITE)
+		rrpc_debug_end_io_write(rrpc_debug, rrqd, laddr, npages);
+	else if (!error && (rrqd->flags & RRPC_DEBUG_IOTYPE_RA))
+		rrpc_debug_rc_fill(rrpc_debug, rqd->bio, rrqd->iter, laddr,
+								npages);
+
+	if (rrqd->flags & NVM_IOTYPE_GC)
+		return 0;
+
+	rrpc_debug_unlock_rq(rrpc_debug, rqd);
+	bio_put(rqd->bio);
+	if (rrqd->flags & RRPC_DEBUG_IOTYPE_RA)
+		rrpc_debug_ra_put(rqd->bio);
+
+	if (npages > 1)
+		rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+
+	rrpc_debug_free_rq(rrpc_debug, rqd);
+
+	return 0;
+}
+
+static int rrpc_debug_read_ppalist_rq(struct rrpc_debug *rrpc_debug, struct bio *bio,
+			struct nvm_rq *rqd, unsigned long flags, int npages)
+{
+	struct rrpc_debug_inflight_rq *r = rrpc_debug_get_inflight_rq(rqd);
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
+	struct rrpc_debug_addr *gp;
+	sector_t laddr = rrpc_debug_get_laddr(bio);
+	int is_gc = flags & NVM_IOTYPE_GC;
+	int i;
+
+	if (!is_gc && rrpc_debug_lock_rq(rrpc_debug, bio, rqd)) {
+		rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+		return NVM_IO_REQUEUE;
+	}
+
+	if (!is_gc && rrpc_debug_rc_read(rrpc_debug, bio, laddr, npages)) {
+		rrqd->flags |= RRPC_DEBUG_RQ_RC_HIT;
+		rrpc_debug_unlock_laddr(rrpc_debug, r);
+		rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+		return NVM_IO_DONE;
+	}
+
+	for (i = 0; i < npages; i++) {
+		/* We assume that mapping occurs at 4KB granularity */
+		BUG_ON(!(laddr + i >= 0 && laddr + i < rrpc_debug->nr_pages));
+		gp = rrpc_debug_l2p(rrpc_debug, laddr + i);
+
+		if (gp->addr != ADDR_EMPTY) {
+			rqd->ppa_list[i] = rrpc_debug_ppa_to_gaddr(rrpc_debug,
+								gp->addr);
+		} else {
+			BUG_ON(is_gc);
+			rrpc_debug_unlock_laddr(rrpc_debug, r);
+			rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+			return NVM_IO_DONE;
+		}
+	}
+
+	rqd->opcode = NVM_OP_HBREAD;
+
+	return NVM_IO_OK;
+}
+
+static int rrpc_debug_read_rq(struct rrpc_debug *rrpc_debug, struct bio *bio, struct nvm_rq *rqd,
+							unsigned long flags)
+{
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
+	int is_gc = flags & NVM_IOTYPE_GC;
+	sector_t laddr = rrpc_debug_get_laddr(bio);
+	struct rrpc_debug_addr *gp;
+
+	if (!is_gc && rrpc_debug_lock_rq(rrpc_debug, bio, rqd))
+		return NVM_IO_REQUEUE;
+
+	if (!is_gc && rrpc_debug_rc_read(rrpc_debug, bio, laddr, 1)) {
+		rrqd->flags |= RRPC_DEBUG_RQ_RC_HIT;
+		rrpc_debug_unlock_rq(rrpc_debug, rqd);
+		return NVM_IO_DONE;
+	}
+
+	BUG_ON(!(laddr >= 0 && laddr < rrpc_debug->nr_pages));
+	gp = rrpc_debug_l2p(rrpc_debug, laddr);
+
+	if (gp->addr != ADDR_EMPTY) {
+		rqd->ppa_addr = rrpc_debug_ppa_to_gaddr(rrpc_debug, gp->addr);
+	} else {
+		BUG_ON(is_gc);
+		rrpc_debug_unlock_rq(rrpc_debug, rqd);
+		return NVM_IO_DONE;
+	}
+
+	rqd->opcode = NVM_OP_HBREAD;
+	rrqd->addr = gp;
+
+	return NVM_IO_OK;
+}
+
+static int rrpc_debug_write_ppalist_rq(struct rrpc_debug *rrpc_debug, struct bio *bio,
+			struct nvm_rq *rqd, unsigned long flags, int npages)
+{
+	struct rrpc_debug_inflight_rq *r = rrpc_debug_get_inflight_rq(rqd);
+	sector_t laddr = rrpc_debug_get_laddr(bio);
+	int stripe = rrpc_debug->stripe_pages;
+	int is_gc = flags & NVM_IOTYPE_GC;
+	struct rrpc_debug_lun *rlun = NULL;
+	struct rrpc_debug_addr pad;
+	u64 paddr;
+	u32 off;
+	int i, j, n;
+
+	if (!is_gc && rrpc_debug_lock_rq(rrpc_debug, bio, rqd)) {
+		rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+		return NVM_IO_REQUEUE;
+	}
+
+	if (!is_gc)
+		rrpc_debug_heat_update(rrpc_debug, laddr);
+
+	/* Reserve the request stripe by stripe, each on the next lun in
+	 * channel order, so its programs run in parallel. ppa_list holds the
+	 * physical addresses until all are reserved, the map is left alone
+	 * if one can not be.
+	 */
+	for (i = 0; i < npages; i += n) {
+		/* We assume that mapping occurs at 4KB granularity */
+		if (!(i % stripe))
+			rlun = rrpc_debug_get_lun_rr(rrpc_debug, is_gc);
+
+		n = __rrpc_debug_map_run(rrpc_debug, rlun, laddr + i,
+				min(npages - i, stripe - i % stripe), is_gc, &paddr);
+		if (!n) {
+			BUG_ON(is_gc);
+			goto requeue;
+		}
+
+		for (j = 0; j < n; j++)
+			rqd->ppa_list[i + j].ppa = paddr + j;
+	}
+
+	/* runs are split again where they were reserved: at a lun or block
+	 * boundary the next page does not follow
+	 */
+	for (i = 0; i < npages; i += n) {
+		paddr = rqd->ppa_list[i].ppa;
+		for (n = 1; i + n < npages; n++) {
+			if (rqd->ppa_list[i + n].ppa != paddr + n)
+				break;
+			rrpc_debug_div(paddr + n, &rrpc_debug->geo.pgs_per_blk,
+									&off);
+			if (!off)
+				break;
+		}
+
+		rrpc_debug_update_map_run(rrpc_debug, laddr + i, paddr, n);
+
+		rrpc_debug_ppa_run(rrpc_debug, &rqd->ppa_list[i], paddr, n);
+		for (j = 0; j < n; j++)
+			rrpc_debug_oob_set(rrpc_debug, rqd, i + j, laddr + i + j);
+	}
+
+	rqd->opcode = NVM_OP_HBWRITE;
+
+	return NVM_IO_OK;
+
+requeue:
+	/* pages reserved so far are never written, they count as written
+	 * invalid pages so that GC reclaims their blocks
+	 */
+	for (j = 0; j < i; j++) {
+		pad.addr = rqd->ppa_list[j].ppa;
+		rlun = rrpc_debug_addr_to_rlun(rrpc_debug, pad.addr);
+
+		spin_lock(&rlun->rev_lock);
+		rrpc_debug_page_invalidate(rrpc_debug, &pad);
+		spin_unlock(&rlun->rev_lock);
+
+		rrpc_debug_page_written(rrpc_debug, rqd->ppa_list[j].ppa);
+	}
+
+	rrpc_debug_unlock_laddr(rrpc_debug, r);
+	rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+	rrpc_debug_gc_kick(rrpc_debug);
+	return NVM_IO_REQUEUE;
+}
+
+static int rrpc_debug_write_rq(struct rrpc_debug *rrpc_debug, struct bio *bio,
+				struct nvm_rq *rqd, unsigned long flags)
+{
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
+	struct rrpc_debug_addr *p;
+	int is_gc = flags & NVM_IOTYPE_GC;
+	sector_t laddr = rrpc_debug_get_laddr(bio);
+
+	if (!is_gc && rrpc_debug_lock_rq(rrpc_debug, bio, rqd))
+		return NVM_IO_REQUEUE;
+
+	if (!is_gc)
+		rrpc_debug_heat_update(rrpc_debug, laddr);
+
+	p = rrpc_debug_map_page(rrpc_debug, laddr, is_gc);
+	if (!p) {
+		BUG_ON(is_gc);
+		rrpc_debug_unlock_rq(rrpc_debug, rqd);
+		rrpc_debug_gc_kick(rrpc_debug);
+		return NVM_IO_REQUEUE;
+	}
+
+	rqd->ppa_addr = rrpc_debug_ppa_to_gaddr(rrpc_debug, p->addr);
+	rrpc_debug_oob_set(rrpc_debug, rqd, 0, laddr);
+	rqd->opcode = NVM_OP_HBWRITE;
+	rrqd->addr = p;
+
+	return NVM_IO_OK;
+}
+
+static int rrpc_debug_setup_rq(struct rrpc_debug *rrpc_debug, struct bio *bio,
+			struct nvm_rq *rqd, unsigned long flags, uint8_t npages)
+{
+	if (bio_rw(bio) == WRITE &&
+	    rrpc_debug_oob_alloc(rrpc_debug, rqd, npages, GFP_KERNEL)) {
+		pr_err("rrpc_debug: not able to allocate oob metadata\n");
+		return NVM_IO_ERR;
+	}
+
+	if (npages > 1) {
+		rqd->ppa_list = rrpc_debug_get_ppa_list(rrpc_debug, rqd, GFP_KERNEL);
+		if (!rqd->ppa_list) {
 			pr_err("rrpc_debug: not able to allocate ppa list\n");
 			return NVM_IO_ERR;
 		}
 
-		if (bio_rw(bio) == WRITE)
-			return rrpc_debug_write_ppalist_rq(rrpc_debug, bio, rqd, flags,
-									npages);
+		if (bio_rw(bio) == WRITE)
+			return rrpc_debug_write_ppalist_rq(rrpc_debug, bio, rqd, flags,
+									npages);
+
+		return rrpc_debug_read_ppalist_rq(rrpc_debug, bio, rqd, flags, npages);
+	}
+
+	if (bio_rw(bio) == WRITE)
+		return rrpc_debug_write_rq(rrpc_debug, bio, rqd, flags);
+
+	return rrpc_debug_read_rq(rrpc_debug, bio, rqd, flags);
+}
+
+static int rrpc_debug_submit_io(struct rrpc_debug *rrpc_debug, struct bio *bio,
+				struct nvm_rq *rqd, unsigned long flags)
+{
+	int err;
+	struct rrpc_debug_rq *rrq = nvm_rq_to_pdu(rqd);
+	uint8_t nr_pages = rrpc_debug_get_pages(bio);
+	sector_t laddr;
+	int bio_size = bio_sectors(bio) << 9;
+
+	if (bio_size < rrpc_debug->dev->sec_size)
+		return NVM_IO_ERR;
+	else if (bio_size > rrpc_debug->dev->max_rq_size)
+		return NVM_IO_ERR;
+
+	rrq->flags = flags;
+	err = rrpc_debug_setup_rq(rrpc_debug, bio, rqd, flags, nr_pages);
+	if (err)
+		return err;
+
+	bio_get(bio);
+	rqd->bio = bio;
+	rqd->ins = &rrpc_debug->instance;
+	rqd->nr_pages = nr_pages;
+	rrq->wait = NULL;
+	rrq->unit = NULL;
+	rrq->iter = bio->bi_iter;
+	rrq->start = ktime_get_ns();
+
+	laddr = rrpc_debug_get_laddr(bio);
+	rrpc_debug_rq_io_add(rrpc_debug, laddr, nr_pages, 1);
+
+	trace_rrpc_debug_submit(rrpc_debug, laddr, nr_pages, bio_data_dir(bio),
+									flags);
+	rrpc_debug_count(RRPC_DEBUG_CNT_SUBMIT, 1);
+
+	/* prefetch bios are ours, they are cached from end_io */
+	if (rrpc_debug->rc_nr && bio_data_dir(bio) == READ &&
+	    !(flags & (NVM_IOTYPE_GC | RRPC_DEBUG_IOTYPE_RA))) {
+		rrq->bi_end_io = bio->bi_end_io;
+		rrq->bi_private = bio->bi_private;
+		bio->bi_end_io = rrpc_debug_rc_end_io;
+		bio->bi_private = rqd;
+	}
+
+	err = nvm_submit_io(rrpc_debug->dev, rqd);
+	if (err) {
+		pr_err("rrpc_debug: I/O submission failed: %d\n", err);
+		if (bio->bi_end_io == rrpc_debug_rc_end_io) {
+			bio->bi_end_io = rrq->bi_end_io;
+			bio->bi_private = rrq->bi_private;
+		}
+		rrpc_debug_rq_io_add(rrpc_debug, laddr, nr_pages, -1);
+		rrpc_debug_unlock_rq(rrpc_debug, rqd);
+		if (nr_pages > 1)
+			rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+		bio_put(bio);
+		return NVM_IO_ERR;
+	}
+
+	return NVM_IO_OK;
+}
+
+/* read @nr pages from @laddr into the read cache, one vector command over
+ * whichever luns hold them. Prefetch is best effort: it is dropped if memory
+ * is short or the range is busy or unmapped.
+ */
+static void rrpc_debug_ra_submit(struct rrpc_debug *rrpc_debug, sector_t laddr,
+							unsigned int nr)
+{
+	struct nvm_dev *dev = rrpc_debug->dev;
+	struct nvm_rq *rqd;
+	struct page *page;
+	struct bio *bio;
+	unsigned int i;
+
+	bio = bio_alloc(GFP_NOIO, nr);
+	if (!bio)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		page = alloc_page(GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
+		if (!page)
+			break;
+
+		if (bio_add_pc_page(dev->q, bio, page,
+				RRPC_DEBUG_EXPOSED_PAGE_SIZE, 0) !=
+						RRPC_DEBUG_EXPOSED_PAGE_SIZE) {
+			__free_page(page);
+			break;
+		}
+	}
+
+	if (!i)
+		goto err_bio;
+
+	bio->bi_iter.bi_sector = rrpc_debug_get_sector(laddr);
+	bio->bi_rw = READ;
+
+	rqd = rrpc_debug_alloc_rq(rrpc_debug, GFP_NOIO);
+
+	if (rrpc_debug_submit_io(rrpc_debug, bio, rqd, RRPC_DEBUG_IOTYPE_RA) ==
+								NVM_IO_OK)
+		return;
+
+	rrpc_debug_free_rq(rrpc_debug, rqd);
+err_bio:
+	rrpc_debug_ra_put(bio);
+}
+
+/* Follow the sequential streams with a user read of @npages at @laddr, @hit
+ * if it was served without going to the media.
+ */
+static void rrpc_debug_ra(struct rrpc_debug *rrpc_debug, sector_t laddr,
+					unsigned int npages, int hit)
+{
+	struct rrpc_debug_ra_stream *s, *lru;
+	sector_t start = 0;
+	unsigned int nr = 0;
+	int i;
+
+	if (!rrpc_debug->rc_nr)
+		return;
+
+	spin_lock(&rrpc_debug->ra_lock);
+	lru = &rrpc_debug->ra_streams[0];
+	for (i = 0; i < RRPC_DEBUG_RA_STREAMS; i++) {
+		s = &rrpc_debug->ra_streams[i];
+		if (s->next == laddr)
+			goto found;
+		if (time_before(s->used, lru->used))
+			lru = s;
+	}
+
+	/* a new reader, prefetch once it reads on sequentially */
+	lru->next = laddr + npages;
+	lru->ra_start = lru->ra_end = lru->next;
+	lru->depth = RRPC_DEBUG_RA_MIN;
+	lru->used = jiffies;
+	spin_unlock(&rrpc_debug->ra_lock);
+	return;
+
+found:
+	if (laddr >= s->ra_start && laddr < s->ra_end) {
+		if (hit)
+			s->depth = min(s->depth * 2, rrpc_debug->ra_max);
+		else
+			s->depth = max_t(unsigned int, s->depth / 2,
+							RRPC_DEBUG_RA_MIN);
+	}
+
+	s->next = laddr + npages;
+	s->used = jiffies;
+	if (s->ra_end < s->next)
+		s->ra_end = s->next;
+
+	/* keep at least half a window ahead of the reader */
+	if (s->ra_end - s->next < s->depth / 2 &&
+	    s->ra_end < rrpc_debug->nr_pages) {
+		start = s->ra_end;
+		nr = min_t(sector_t, s->depth, rrpc_debug->nr_pages - start);
+
+		s->ra_start = s->next;
+		s->ra_end += nr;
+	}
+	spin_unlock(&rrpc_debug->ra_lock);
+
+	if (nr)
+		rrpc_debug_ra_submit(rrpc_debug, start, nr);
+}
+
+static void rrpc_debug_requeue_stat(struct rrpc_debug *rrpc_debug, sector_t laddr)
+{
+	u64 paddr = rrpc_debug_map_peek(rrpc_debug, laddr);
+
+	if (paddr == ADDR_EMPTY)
+		rrpc_debug_stat_add(rrpc_debug, rrpc_debug->nr_luns,
+						RRPC_DEBUG_STAT_REQUEUES, 1);
+	else
+		rrpc_debug_lun_stat(rrpc_debug, paddr, RRPC_DEBUG_STAT_REQUEUES);
+}
+
+/* Park a bio that could not be served until the event it waits for: the
+ * unlock of the conflicting range, the load of a translation page, or a block
+ * being put back. If that event already happened since the attempt, retry
+ * right away.
+ */
+static void rrpc_debug_park(struct rrpc_debug *rrpc_debug, struct bio *bio,
+							struct nvm_rq *rqd)
+{
+	struct rrpc_debug_rq *rrqd = nvm_rq_to_pdu(rqd);
+	struct rrpc_debug_inflight_bucket *b = rrqd->inflight_rq.busy;
+	struct rrpc_debug_map_waiters *w = rrqd->inflight_rq.fault;
+	struct bio_list bios;
+	unsigned long flags;
+
+	if (b) {
+		spin_lock_irqsave(&b->lock, flags);
+		if (b->seq == rrqd->inflight_rq.busy_seq) {
+			bio_list_add(&b->waiters, bio);
+			bio = NULL;
+		}
+		spin_unlock_irqrestore(&b->lock, flags);
+	} else if (w) {
+		spin_lock_irqsave(&w->lock, flags);
+		if (w->seq == rrqd->inflight_rq.busy_seq) {
+			bio_list_add(&w->bios, bio);
+			bio = NULL;
+		}
+		spin_unlock_irqrestore(&w->lock, flags);
+	} else {
+		spin_lock_irqsave(&rrpc_debug->bio_lock, flags);
+		if (atomic_read(&rrpc_debug->free_seq) == rrqd->free_seq) {
+			bio_list_add(&rrpc_debug->nospace_bios, bio);
+			bio = NULL;
+		}
+		spin_unlock_irqrestore(&rrpc_debug->bio_lock, flags);
+	}
+
+	if (!bio)
+		return;
+
+	bio_list_init(&bios);
+	bio_list_add(&bios, bio);
+	rrpc_debug_requeue_bios(rrpc_debug, &bios);
+}
+
+static blk_qc_t rrpc_debug_make_rq(struct request_queue *q, struct bio *bio)
+{
+	struct rrpc_debug *rrpc_debug = q->queuedata;
+	sector_t laddr = rrpc_debug_get_laddr(bio);
+	unsigned int npages = rrpc_debug_get_pages(bio);
+	int is_read = bio_data_dir(bio) == READ;
+	struct rrpc_debug_rq *rrqd;
+	struct nvm_rq *rqd;
+	int err;
+
+	if (unlikely(READ_ONCE(rrpc_debug->map_lost))) {
+		bio_io_error(bio);
+		return BLK_QC_T_NONE;
+	}
+
+	if (bio->bi_rw & REQ_DISCARD) {
+		rrpc_debug_discard(rrpc_debug, bio);
+		return BLK_QC_T_NONE;
+	}
+
+	if (bio->bi_rw & REQ_FLUSH) {
+		rrpc_debug_wb_flush(rrpc_debug, 1);
+		err = rrpc_debug_jnl_sync(rrpc_debug, true);
+		if (atomic_xchg(&rrpc_debug->wb_error, 0) || err) {
+			bio_io_error(bio);
+			return BLK_QC_T_NONE;
+		}
+		if (!bio->bi_iter.bi_size) {
+			bio_endio(bio);
+			return BLK_QC_T_NONE;
+		}
+	}
+
+	if (rrpc_debug_wb_rq(rrpc_debug, bio)) {
+		bio_endio(bio);
+		return BLK_QC_T_NONE;
+	}
+
+	rqd = rrpc_debug_alloc_tagged_rq(rrpc_debug);
+	if (!rqd) {
+		pr_err_ratelimited("rrpc_debug: not able to queue bio.");
+		bio_io_error(bio);
+		return BLK_QC_T_NONE;
+	}
+	rrqd = nvm_rq_to_pdu(rqd);
+	rrqd->free_seq = atomic_read(&rrpc_debug->free_seq);
+
+	err = rrpc_debug_submit_io(rrpc_debug, bio, rqd, NVM_IOTYPE_NONE);
+	switch (err) {
+	case NVM_IO_OK:
+		if (is_read)
+			rrpc_debug_ra(rrpc_debug, laddr, npages, 0);
+		return BLK_QC_T_NONE;
+	case NVM_IO_ERR:
+		bio_io_error(bio);
+		break;
+	case NVM_IO_DONE:
+		bio_endio(bio);
+		if (is_read)
+			rrpc_debug_ra(rrpc_debug, laddr, npages,
+				!!(rrqd->flags & RRPC_DEBUG_RQ_RC_HIT));
+		break;
+	case NVM_IO_REQUEUE:
+		trace_rrpc_debug_requeue(rrpc_debug, laddr, npages);
+		rrpc_debug_count(RRPC_DEBUG_CNT_REQUEUE, 1);
+		rrpc_debug_requeue_stat(rrpc_debug, laddr);
+		rrpc_debug_wb_kick(rrpc_debug, laddr, npages);
+		rrpc_debug_park(rrpc_debug, bio, rqd);
+		break;
+	}
+
+	rrpc_debug_free_rq(rrpc_debug, rqd);
+	return BLK_QC_T_NONE;
+}
+
+static void rrpc_debug_requeue(struct work_struct *work)
+{
+	struct rrpc_debug *rrpc_debug = container_of(work, struct rrpc_debug, ws_requeue);
+	struct bio_list bios;
+	struct bio *bio;
+
+	bio_list_init(&bios);
+
+	spin_lock_irq(&rrpc_debug->bio_lock);
+	bio_list_merge(&bios, &rrpc_debug->requeue_bios);
+	bio_list_init(&rrpc_debug->requeue_bios);
+	spin_unlock_irq(&rrpc_debug->bio_lock);
+
+	while ((bio = bio_list_pop(&bios)))
+		rrpc_debug_make_rq(rrpc_debug->disk->queue, bio);
+}
+
+static void rrpc_debug_gc_free(struct rrpc_debug *rrpc_debug)
+{
+	struct rrpc_debug_lun *rlun;
+	int i;
+
+	if (rrpc_debug->krqd_wq)
+		destroy_workqueue(rrpc_debug->krqd_wq);
+
+	if (rrpc_debug->kgc_wq)
+		destroy_workqueue(rrpc_debug->kgc_wq);
+
+	if (!rrpc_debug->luns)
+		return;
+
+	for (i = 0; i < rrpc_debug->nr_luns; i++) {
+		rlun = &rrpc_debug->luns[i];
+
+		kfree(rlun->gc_batches);
+
+		if (!rlun->blocks)
+			break;
+		vfree(rlun->blocks);
+		kfree(rlun->prio_buckets);
+	}
+}
+
+static int rrpc_debug_gc_init(struct rrpc_debug *rrpc_debug)
+{
+	struct rrpc_debug_lun *rlun;
+	int i, j;
+
+	rrpc_debug_for_each_lun(rrpc_debug, rlun, i) {
+		mutex_init(&rlun->gc_mutex);
+
+		rlun->gc_batches = kzalloc_node(rrpc_debug->gc_qd *
+				sizeof(struct rrpc_debug_gc_batch), GFP_KERNEL,
+				rlun->node);
+		if (!rlun->gc_batches)
+			return -ENOMEM;
+
+		for (j = 0; j < rrpc_debug->gc_qd; j++)
+			init_completion(&rlun->gc_batches[j].wait);
+	}
+
+	rrpc_debug->krqd_wq = alloc_workqueue("rrpc_debug-lun", WQ_MEM_RECLAIM|WQ_UNBOUND,
+								rrpc_debug->nr_luns);
+	if (!rrpc_debug->krqd_wq)
+		return -ENOMEM;
+
+	/* unbound so that victims of all luns are reclaimed in parallel */
+	rrpc_debug->kgc_wq = alloc_workqueue("rrpc_debug-bg",
+					WQ_MEM_RECLAIM|WQ_UNBOUND, 0);
+	if (!rrpc_debug->kgc_wq)
+		return -ENOMEM;
+
+	setup_timer(&rrpc_debug->gc_timer, rrpc_debug_gc_timer, (unsigned long)rrpc_debug);
+
+	return 0;
+}
+
+static void rrpc_debug_wb_free(struct rrpc_debug *rrpc_debug)
+{
+	struct rrpc_debug_lun *rlun;
+	int i;
+
+	if (!rrpc_debug->luns)
+		return;
+
+	rrpc_debug_for_each_lun(rrpc_debug, rlun, i)
+		kfree(rlun->wb_units);
+}
+
+static int rrpc_debug_wb_init(struct rrpc_debug *rrpc_debug)
+{
+	struct nvm_dev *dev = rrpc_debug->dev;
+	struct rrpc_debug_wb_unit *unit;
+	struct rrpc_debug_lun *rlun;
+	int i, j, k, pages;
+
+	for (i = 0; i < RRPC_DEBUG_WB_SHARDS; i++) {
+		spin_lock_init(&rrpc_debug->wb_shards[i].lock);
+		INIT_RADIX_TREE(&rrpc_debug->wb_shards[i].tree, GFP_ATOMIC);
+	}
+	INIT_LIST_HEAD(&rrpc_debug->wb_parked);
+	spin_lock_init(&rrpc_debug->wb_park_lock);
+	atomic_set(&rrpc_debug->wb_buffered, 0);
+	atomic_set(&rrpc_debug->wb_flushing, 0);
+	atomic_set(&rrpc_debug->wb_error, 0);
+	init_waitqueue_head(&rrpc_debug->wb_wait);
+	setup_timer(&rrpc_debug->wb_timer, rrpc_debug_wb_timer, (unsigned long)rrpc_debug);
+
+	pages = min_t(int, rrpc_debug->prog_pages, RRPC_DEBUG_WB_MAX_PAGES);
+	pages = min_t(int, pages, dev->max_rq_size / RRPC_DEBUG_EXPOSED_PAGE_SIZE);
+
+	if (!write_buffer || pages < 2)
+		return 0;
+
+	rrpc_debug_for_each_lun(rrpc_debug, rlun, i) {
+		spin_lock_init(&rlun->wb_lock);
+		rlun->wb_units = kcalloc(RRPC_DEBUG_WB_UNITS,
+				sizeof(struct rrpc_debug_wb_unit), GFP_KERNEL);
+		if (!rlun->wb_units)
+			return -ENOMEM;
+
+		for (j = 0; j < RRPC_DEBUG_WB_UNITS; j++) {
+			unit = &rlun->wb_units[j];
+			unit->rlun = rlun;
+			INIT_WORK(&unit->ws_flush, rrpc_debug_wb_flush_unit);
+			INIT_LIST_HEAD(&unit->park);
+
+			for (k = 0; k < RRPC_DEBUG_WB_MAX_PAGES; k++)
+				unit->slots[k].unit = unit;
+		}
+
+		rlun->wb_units[0].state = RRPC_DEBUG_WB_OPEN;
+		rlun->wb_open = &rlun->wb_units[0];
+	}
+
+	rrpc_debug->wb_pages = pages;
+
+	return 0;
+}
+
+static void rrpc_debug_rc_free(struct rrpc_debug *rrpc_debug)
+{
+	unsigned int i;
+
+	if (!rrpc_debug->rc_entries)
+		return;
+
+	for (i = 0; i < rrpc_debug->rc_nr; i++)
+		if (rrpc_debug->rc_entries[i].page)
+			__free_page(rrpc_debug->rc_entries[i].page);
+
+	vfree(rrpc_debug->rc_entries);
+}
+
+static int rrpc_debug_rc_init(struct rrpc_debug *rrpc_debug)
+{
+	unsigned int i, nr = min_t(unsigned long long, read_cache_pages,
+							rrpc_debug->nr_pages);
+
+	spin_lock_init(&rrpc_debug->rc_lock);
+	INIT_RADIX_TREE(&rrpc_debug->rc_tree, GFP_ATOMIC);
+
+	spin_lock_init(&rrpc_debug->ra_lock);
+	rrpc_debug->ra_max = min_t(unsigned int, RRPC_DEBUG_RA_MAX,
+		rrpc_debug->dev->max_rq_size / RRPC_DEBUG_EXPOSED_PAGE_SIZE);
+
+	if (!nr)
+		return 0;
+
+	rrpc_debug->rc_entries = vzalloc(sizeof(struct rrpc_debug_rc_entry) * nr);
+	if (!rrpc_debug->rc_entries)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		rrpc_debug->rc_entries[i].page = alloc_page(GFP_KERNEL);
+		if (!rrpc_debug->rc_entries[i].page)
+			break;
+	}
+
+	/* keep what could be allocated */
+	rrpc_debug->rc_nr = i;
+
+	return 0;
+}
+
+/* bytes of partition @i of a map of @nr entries */
+static size_t rrpc_debug_part_size(u64 nr, u64 i, size_t esize)
+{
+	return min_t(u64, nr - (i << RRPC_DEBUG_MAP_PART_SHIFT),
+					RRPC_DEBUG_MAP_PART_ENTRIES) * esize;
+}
+
+/* Partitions of the forward map are spread over the nodes of all luns, as
+ * any cpu may look up any logical page. Those of the reverse map go to the
+ * node of the lun they cover.
+ */
+static int rrpc_debug_part_node(struct rrpc_debug *rrpc_debug, u64 i, int rev)
+{
+	struct nvm_dev *dev = rrpc_debug->dev;
+	u64 lun;
+
+	/* physical addresses step by page, pgs_per_blk of them per block */
+	if (!rev)
+		lun = do_div(i, rrpc_debug->nr_luns);
+	else
+		lun = min_t(u64, div_u64(i << RRPC_DEBUG_MAP_PART_SHIFT,
+				dev->pgs_per_blk * dev->blks_per_lun),
+				rrpc_debug->nr_luns - 1);
+
+	return rrpc_debug->luns[lun].node;
+}
+
+static void rrpc_debug_parts_free(struct rrpc_debug *rrpc_debug, void *map,
+								size_t esize)
+{
+	u64 nr = rrpc_debug->nr_pages;
+	void **parts = map;
+	size_t size;
+	u64 i;
+
+	if (!parts)
+		return;
+
+	for (i = 0; i < DIV_ROUND_UP_ULL(nr, RRPC_DEBUG_MAP_PART_ENTRIES); i++) {
+		size = rrpc_debug_part_size(nr, i, esize);
+		if (is_vmalloc_addr(parts[i]))
+			vfree(parts[i]);
+		else if (parts[i])
+			free_pages((unsigned long)parts[i], get_order(size));
+	}
+	kfree(parts);
+}
+
+/* Allocate a map of nr_pages entries of @esize bytes. With map_hugepages a
+ * partition is taken from the page allocator if it can be, so it lies in
+ * the linear mapping of the kernel and costs a single TLB entry.
+ */
+static void *rrpc_debug_parts_alloc(struct rrpc_debug *rrpc_debug,
+						size_t esize, int rev)
+{
+	u64 nr = rrpc_debug->nr_pages;
+	u64 i, nr_parts = DIV_ROUND_UP_ULL(nr, RRPC_DEBUG_MAP_PART_ENTRIES);
+	struct page *page;
+	void **parts;
+	size_t size;
+	int node;
+
+	parts = kcalloc(nr_parts, sizeof(void *), GFP_KERNEL);
+	if (!parts)
+		return NULL;
+
+	for (i = 0; i < nr_parts; i++) {
+		size = rrpc_debug_part_size(nr, i, esize);
+		node = rrpc_debug_part_node(rrpc_debug, i, rev);
+
+		if (map_hugepages) {
+			page = alloc_pages_node(node, GFP_KERNEL | __GFP_NOWARN |
+					__GFP_NORETRY, get_order(size));
+			if (page) {
+				parts[i] = page_address(page);
+				continue;
+			}
+		}
+
+		parts[i] = vmalloc_node(size, node);
+		if (!parts[i]) {
+			rrpc_debug_parts_free(rrpc_debug, parts, esize);
+			return NULL;
+		}
+	}
+
+	return parts;
+}
+
+static void rrpc_debug_map_free(struct rrpc_debug *rrpc_debug)
+{
+	vfree(rrpc_debug->heat);
+	rrpc_debug_parts_free(rrpc_debug, rrpc_debug->rev_trans_map,
+					sizeof(struct rrpc_debug_rev_addr));
+	rrpc_debug_parts_free(rrpc_debug, rrpc_debug->trans_map,
+					sizeof(struct rrpc_debug_addr));
+	rrpc_debug_map_cache_free(rrpc_debug);
+}
+
+static int rrpc_debug_l2p_update(u64 slba, u32 nlb, __le64 *entries, void *private)
+{
+	struct rrpc_debug *rrpc_debug = (struct rrpc_debug *)private;
+	struct nvm_dev *dev = rrpc_debug->dev;
+	sector_t max_pages = dev->total_pages * (dev->sec_size >> 9);
+	u64 poffset = rrpc_debug->poffset;
+	u64 elba = slba + nlb;
+	u64 i;
+
+	if (unlikely(elba > dev->total_pages)) {
+		pr_err("nvm: L2P data from device is out of bounds!\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nlb; i++) {
+		u64 pba = le64_to_cpu(entries[i]);
+		/* LNVM treats address-spaces as silos, LBA and PBA are
+		 * equally large and zero-indexed.
+		 */
+		if (unlikely(pba >= max_pages && pba != U64_MAX)) {
+			pr_err("nvm: L2P data entry is out of bounds!\n");
+			return -EINVAL;
+		}
+
+		/* Address zero is a special one. The first page on a disk is
+		 * protected. As it often holds internal device boot
+		 * information.
+		 */
+		if (!pba)
+			continue;
+
+		/* entries are resolved to blocks of this target only */
+		if (pba < poffset || pba >= poffset + rrpc_debug->nr_pages)
+			continue;
+
+		rrpc_debug_map_set(rrpc_debug, slba + i, pba);
+		rrpc_debug_rev(rrpc_debug, pba)->addr = slba + i;
+	}
+
+	return 0;
+}
+
+/* Run @fn for every lun partition on the unbound workqueue, so bring-up
+ * spreads over all cpus, and wait for all of them.
+ */
+static int rrpc_debug_init_parallel(struct rrpc_debug *rrpc_debug, work_func_t fn)
+{
+	struct rrpc_debug_init_work *works;
+	int i, ret = 0;
+
+	works = kcalloc(rrpc_debug->nr_luns, sizeof(struct rrpc_debug_init_work),
+								GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+
+	for (i = 0; i < rrpc_debug->nr_luns; i++) {
+		works[i].rrpc_debug = rrpc_debug;
+		works[i].part = i;
+		INIT_WORK(&works[i].ws, fn);
+		queue_work(system_unbound_wq, &works[i].ws);
+	}
+
+	for (i = 0; i < rrpc_debug->nr_luns; i++) {
+		flush_work(&works[i].ws);
+		if (works[i].ret)
+			ret = works[i].ret;
+	}
+
+	kfree(works);
+	return ret;
+}
+
+/* bounds of partition @part when splitting @total entries in nr_luns */
+static void rrpc_debug_init_part(struct rrpc_debug *rrpc_debug, int part,
+					u64 total, u64 *start, u64 *end)
+{
+	*start = div_u64(total * part, rrpc_debug->nr_luns);
+	*end = div_u64(total * (part + 1), rrpc_debug->nr_luns);
+}
+
+static void rrpc_debug_map_clear(struct work_struct *work)
+{
+	struct rrpc_debug_init_work *w = container_of(work,
+					struct rrpc_debug_init_work, ws);
+	struct rrpc_debug *rrpc_debug = w->rrpc_debug;
+	u64 i, start, end;
+
+	rrpc_debug_init_part(rrpc_debug, w->part, rrpc_debug->nr_pages,
+								&start, &end);
+
+	/* translation pages not written yet read back as empty */
+	for (i = start; i < end; i++) {
+		if (rrpc_debug->trans_map)
+			rrpc_debug_l2p(rrpc_debug, i)->addr = ADDR_EMPTY;
+		rrpc_debug_rev(rrpc_debug, rrpc_debug->poffset + i)->addr =
+								ADDR_EMPTY;
+
+		if (!(i & 0xffff))
+			cond_resched();
+	}
+}
+
+/* Import a part of the device L2P table. Parts cover disjoint logical
+ * ranges, so they never share a map entry. They share reverse map entries
+ * only if a physical page appears more than once in the device table, which
+ * is assumed not to happen.
+ */
+static void rrpc_debug_map_import(struct work_struct *work)
+{
+	struct rrpc_debug_init_work *w = container_of(work,
+					struct rrpc_debug_init_work, ws);
+	struct rrpc_debug *rrpc_debug = w->rrpc_debug;
+	struct nvm_dev *dev = rrpc_debug->dev;
+	u64 start, end;
+
+	rrpc_debug_init_part(rrpc_debug, w->part, dev->total_pages,
+								&start, &end);
+	if (start == end)
+		return;
+
+	w->ret = dev->ops->get_l2p_tbl(dev, start, end - start,
+					rrpc_debug_l2p_update, rrpc_debug);
+}
+
+/* Checkpoints and journal */
+
+static unsigned int rrpc_debug_blk_idx(struct rrpc_debug *rrpc_debug,
+						struct rrpc_debug_block *rblk)
+{
+	struct rrpc_debug_lun *rlun = rblk->rlun;
+
+	return (rlun - rrpc_debug->luns) * rrpc_debug->dev->blks_per_lun +
+							(rblk - rlun->blocks);
+}
+
+static struct rrpc_debug_block *rrpc_debug_idx_to_rblk(struct rrpc_debug *rrpc_debug,
+							unsigned int idx)
+{
+	int blks = rrpc_debug->dev->blks_per_lun;
+
+	return &rrpc_debug->luns[idx / blks].blocks[idx % blks];
+}
+
+/* Records of generation @gen were dropped. The journal of @gen has a hole
+ * now, so only a checkpoint started from here on covers them. Requires
+ * jnl_lock.
+ */
+static void rrpc_debug_jnl_hole(struct rrpc_debug *rrpc_debug, u64 gen)
+{
+	rrpc_debug->jnl_lost[gen & 1] = true;
+	rrpc_debug->jnl_need = rrpc_debug->ckpt_runs + 1;
+}
+
+static void rrpc_debug_jnl_add(struct rrpc_debug *rrpc_debug, int type, u64 a,
+									u64 b)
+{
+	struct rrpc_debug_jnl_hdr *hdr;
+	struct rrpc_debug_jnl_rec *rec;
+	unsigned long flags;
+
+	if (!rrpc_debug->ckpt_pages)
+		return;
+
+	spin_lock_irqsave(&rrpc_debug->jnl_lock, flags);
+	if (!rrpc_debug->jnl_cur) {
+		rrpc_debug->jnl_cur = mempool_alloc(rrpc_debug->jnl_pool,
+								GFP_ATOMIC);
+		if (!rrpc_debug->jnl_cur) {
+			rrpc_debug_jnl_hole(rrpc_debug, rrpc_debug->jnl_gen);
+			spin_unlock_irqrestore(&rrpc_debug->jnl_lock, flags);
+			mod_delayed_work(rrpc_debug->kmeta_wq,
+						&rrpc_debug->ws_ckpt, 0);
+			return;
+		}
+
+		hdr = page_address(rrpc_debug->jnl_cur);
+		memset(hdr, 0, sizeof(struct rrpc_debug_jnl_hdr));
+		hdr->magic = cpu_to_le32(RRPC_DEBUG_JNL_MAGIC);
+		hdr->gen = cpu_to_le64(rrpc_debug->jnl_gen);
+	}
+
+	hdr = page_address(rrpc_debug->jnl_cur);
+	rec = (struct rrpc_debug_jnl_rec *)(hdr + 1) + le32_to_cpu(hdr->nr);
+	rec->type = cpu_to_le32(type);
+	rec->rsvd = 0;
+	rec->a = cpu_to_le64(a);
+	rec->b = cpu_to_le64(b);
+	le32_add_cpu(&hdr->nr, 1);
+
+	if (le32_to_cpu(hdr->nr) == RRPC_DEBUG_JNL_RECS) {
+		list_add_tail(&rrpc_debug->jnl_cur->lru, &rrpc_debug->jnl_full);
+		rrpc_debug->jnl_cur = NULL;
+		queue_work(rrpc_debug->kjnl_wq, &rrpc_debug->ws_jnl);
+	}
+	spin_unlock_irqrestore(&rrpc_debug->jnl_lock, flags);
+}
+
+/* a page is journaled once it is on the media */
+static void rrpc_debug_jnl_committed(struct rrpc_debug *rrpc_debug, u64 paddr)
+{
+	u64 laddr;
+
+	if (!rrpc_debug->ckpt_pages)
+		return;
+
+	laddr = rrpc_debug_rev(rrpc_debug, paddr)->addr;
+	if (laddr == ADDR_EMPTY || rrpc_debug_l2p(rrpc_debug, laddr)->addr != paddr)
+		return;
+
+	rrpc_debug_jnl_add(rrpc_debug, RRPC_DEBUG_JNL_MAP, laddr, paddr);
+}
+
+static void rrpc_debug_jnl_blk(struct rrpc_debug *rrpc_debug,
+				struct rrpc_debug_block *rblk, int used)
+{
+	unsigned int idx;
+
+	if (!rrpc_debug->ckpt_pages)
+		return;
+
+	idx = rrpc_debug_blk_idx(rrpc_debug, rblk);
+	if (used)
+		set_bit(idx, rrpc_debug->blk_used);
+	else
+		clear_bit(idx, rrpc_debug->blk_used);
+
+	rrpc_debug_jnl_add(rrpc_debug, used ? RRPC_DEBUG_JNL_GET :
+						RRPC_DEBUG_JNL_PUT, idx, 0);
+}
+
+/* Synchronous I/O of @nr pages from @paddr on, within one block. Reads
+ * return the oob areas in @oob if given, writes leave them untagged.
+ */
+static int rrpc_debug_meta_io(struct rrpc_debug *rrpc_debug, int rw, u64 paddr,
+				struct page **pages, int nr, void *oob,
+				dma_addr_t dma_oob)
+{
+	struct nvm_dev *dev = rrpc_debug->dev;
+	DECLARE_COMPLETION_ONSTACK(wait);
+	struct rrpc_debug_rq *rrqd;
+	struct nvm_rq *rqd;
+	struct bio *bio;
+	int i, err;
+
+	bio = bio_alloc(GFP_NOIO, nr);
+	if (!bio)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		if (bio_add_pc_page(dev->q, bio, pages[i],
+				RRPC_DEBUG_EXPOSED_PAGE_SIZE, 0) !=
+						RRPC_DEBUG_EXPOSED_PAGE_SIZE) {
+			bio_put(bio);
+			return -EIO;
+		}
+	}
+	bio->bi_rw = rw;
+
+	rqd = rrpc_debug_alloc_rq(rrpc_debug, GFP_NOIO);
+
+	if (oob) {
+		rqd->metadata = oob;
+		rqd->dma_metadata = dma_oob;
+	} else if (rw == WRITE &&
+		   rrpc_debug_oob_alloc(rrpc_debug, rqd, nr, GFP_NOIO)) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (nr > 1) {
+		rqd->ppa_list = rrpc_debug_get_ppa_list(rrpc_debug, rqd, GFP_NOIO);
+		if (!rqd->ppa_list) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		rrpc_debug_ppa_run(rrpc_debug, rqd->ppa_list, paddr, nr);
+	} else {
+		rqd->ppa_addr = rrpc_debug_ppa_to_gaddr(rrpc_debug, paddr);
+	}
+
+	rqd->opcode = (rw == WRITE) ? NVM_OP_HBWRITE : NVM_OP_HBREAD;
+	rqd->bio = bio;
+	rqd->ins = &rrpc_debug->instance;
+	rqd->nr_pages = nr;
+
+	rrqd = nvm_rq_to_pdu(rqd);
+	rrqd->flags = NVM_IOTYPE_NONE;
+	rrqd->wait = &wait;
+	rrqd->unit = NULL;
+
+	err = nvm_submit_io(dev, rqd);
+	if (!err) {
+		wait_for_completion_io(&wait);
+		err = bio->bi_error;
+	}
+
+	if (nr > 1)
+		rrpc_debug_put_ppa_list(rrpc_debug, rqd);
+out:
+	/* the oob buffer of the caller is not freed with the request */
+	if (oob)
+		rqd->metadata = NULL;
+	rrpc_debug_free_rq(rrpc_debug, rqd);
+	bio_put(bio);
+	return err;
+}
+
+/* I/O of @nr pages from page @pg of the reserved area starting at block @blk */
+static int rrpc_debug_meta_rw(struct rrpc_debug *rrpc_debug, int rw, int blk,
+			unsigned int pg, struct page **pages, unsigned int nr)
+{
+	unsigned int pgs = rrpc_debug->dev->pgs_per_blk;
+	struct rrpc_debug_block *rblk;
+	unsigned int n;
+	int err;
+
+	while (nr) {
+		n = min3(nr, rrpc_debug->meta_chunk, pgs - pg % pgs);
+		rblk = &rrpc_debug->luns[0].blocks[blk + pg / pgs];
+
+		err = rrpc_debug_meta_io(rrpc_debug, rw,
+				block_to_addr(rrpc_debug, rblk) + pg % pgs,
+				pages, n, NULL, 0);
+		if (err)
+			return err;
+
+		pg += n;
+		pages += n;
+		nr -= n;
+	}
+
+	return 0;
+}
+
+static void rrpc_debug_meta_erase(struct rrpc_debug *rrpc_debug, int blk, int nr)
+{
+	int i;
+
+	for (i = blk; i < blk + nr; i++)
+		nvm_erase_blk(rrpc_debug->dev, rrpc_debug->luns[0].blocks[i].parent);
+}
+
+static int rrpc_debug_jnl_blks(struct rrpc_debug *rrpc_debug)
+{
+	return DIV_ROUND_UP(rrpc_debug->jnl_pages, rrpc_debug->dev->pgs_per_blk);
+}
+
+/* the journal of generation @gen, the two alternate like the slots */
+static int rrpc_debug_jnl_blk_start(struct rrpc_debug *rrpc_debug, u64 gen)
+{
+	return 2 * rrpc_debug->ckpt_blks +
+				(gen & 1) * rrpc_debug_jnl_blks(rrpc_debug);
+}
+
+static void rrpc_debug_jnl_free_page(struct rrpc_debug *rrpc_debug, struct page *page)
+{
+	mempool_free(page, rrpc_debug->jnl_pool);
+}
+
+/* Write the full journal pages on media, each to the journal of its
+ * generation. Pages of generations older than the last checkpoint are
+ * covered by it and dropped.
+ */
+static void rrpc_debug_jnl_write(struct rrpc_debug *rrpc_debug)
+{
+	struct rrpc_debug_jnl_hdr *hdr;
+	struct page *page;
+	unsigned int n, nr, i, area;
+	LIST_HEAD(pages);
+	unsigned long flags;
+	bool skip, ckpt = false;
+	u64 gen;
+
+	spin_lock_irqsave(&rrpc_debug->jnl_lock, flags);
+	list_splice_init(&rrpc_debug->jnl_full, &pages);
+	spin_unlock_irqrestore(&rrpc_debug->jnl_lock, flags);
+
+	mutex_lock(&rrpc_debug->jnl_mutex);
+	while (!list_empty(&pages)) {
+		page = list_first_entry(&pages, struct page, lru);
+		hdr = page_address(page);
+		gen = le64_to_cpu(hdr->gen);
+		area = gen & 1;
+
+		n = 0;
+		while (n < rrpc_debug->meta_chunk && !list_empty(&pages)) {
+			page = list_first_entry(&pages, struct page, lru);
+			hdr = page_address(page);
+			if (le64_to_cpu(hdr->gen) != gen)
+				break;
+
+			list_del(&page->lru);
+			rrpc_debug->jnl_batch[n++] = page;
+		}
+
+		/* pages are programmed in whole units, pad with empty ones */
+		nr = round_up(n, rrpc_debug->prog_pages);
+
+		spin_lock_irqsave(&rrpc_debug->jnl_lock, flags);
+		skip = gen < rrpc_debug->ckpt_gen;
+		if (!skip && (rrpc_debug->jnl_lost[area] ||
+			rrpc_debug->jnl_next[area] + nr > rrpc_debug->jnl_pages)) {
+			rrpc_debug_jnl_hole(rrpc_debug, gen);
+			skip = true;
+			ckpt = true;
+		}
+		spin_unlock_irqrestore(&rrpc_debug->jnl_lock, flags);
+
+		if (skip) {
+			nr = n;
+			goto free;
+		}
+
+		for (i = n; i < nr; i++) {
+			rrpc_debug->jnl_batch[i] = mempool_alloc(
+					rrpc_debug->jnl_pool, GFP_NOIO);
+			hdr = page_address(rrpc_debug->jnl_batch[i]);
+			memset(hdr, 0, sizeof(struct rrpc_debug_jnl_hdr));
+			hdr->magic = cpu_to_le32(RRPC_DEBUG_JNL_MAGIC);
+			hdr->gen = cpu_to_le64(gen);
+		}
+
+		for (i = 0; i < nr; i++) {
+			hdr = page_address(rrpc_debug->jnl_batch[i]);
+			hdr->idx = cpu_to_le64(rrpc_debug->jnl_next[area] + i);
+			hdr->crc = cpu_to_le32(crc32_le(~0, hdr + 1,
+				le32_to_cpu(hdr->nr) *
+				sizeof(struct rrpc_debug_jnl_rec)));
+		}
+
+		if (rrpc_debug_meta_rw(rrpc_debug, WRITE,
+				rrpc_debug_jnl_blk_start(rrpc_debug, gen),
+				rrpc_debug->jnl_next[area],
+				rrpc_debug->jnl_batch, nr)) {
+			pr_err("nvm: rrpc_debug: journal write failed\n");
+			spin_lock_irqsave(&rrpc_debug->jnl_lock, flags);
+			rrpc_debug_jnl_hole(rrpc_debug, gen);
+			spin_unlock_irqrestore(&rrpc_debug->jnl_lock, flags);
+			ckpt = true;
+		}
+		rrpc_debug->jnl_next[area] += nr;
+free:
+		for (i = 0; i < nr; i++)
+			rrpc_debug_jnl_free_page(rrpc_debug,
+						rrpc_debug->jnl_batch[i]);
+
+		/* checkpoint before the journal being added to runs out */
+		if (gen == READ_ONCE(rrpc_debug->jnl_gen) &&
+		    rrpc_debug->jnl_next[area] > rrpc_debug->jnl_pages / 4 * 3)
+			ckpt = true;
+	}
+	mutex_unlock(&rrpc_debug->jnl_mutex);
+
+	if (ckpt)
+		mod_delayed_work(rrpc_debug->kmeta_wq, &rrpc_debug->ws_ckpt, 0);
+}
+
+static void rrpc_debug_jnl_work(struct work_struct *work)
+{
+	struct rrpc_debug *rrpc_debug = container_of(work, struct rrpc_debug,
+								ws_jnl);
+
+	rrpc_debug_jnl_write(rrpc_debug);
+}
+
+/* are the records dropped so far covered by a completed checkpoint */
+static bool rrpc_debug_jnl_durable(struct rrpc_debug *rrpc_debug)
+{
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&rrpc_debug->jnl_lock, flags);
+	ret = rrpc_debug->ckpt_done >= rrpc_debug->jnl_need;
+	spin_unlock_irqrestore(&rrpc_debug->jnl_lock, flags);
+
+	return ret;
+}
+
+/* Make every record added so far durable, for flush requests and erases.
+ * Only the journal writes are waited for, a running checkpoint is not.
+ * Records that were dropped are covered by the next checkpoint, which is
+ * waited for if @wait is set. Returns -EIO if they are not durable.
+ */
+static int rrpc_debug_jnl_sync(struct rrpc_debug *rrpc_debug, bool wait)
+{
+	unsigned long flags;
+
+	if (!rrpc_debug->ckpt_pages)
+		return 0;
+
+	spin_lock_irqsave(&rrpc_debug->jnl_lock, flags);
+	if (rrpc_debug->jnl_cur) {
+		list_add_tail(&rrpc_debug->jnl_cur->lru, &rrpc_debug->jnl_full);
+		rrpc_debug->jnl_cur = NULL;
+	}
+	spin_unlock_irqrestore(&rrpc_debug->jnl_lock, flags);
+
+	queue_work(rrpc_debug->kjnl_wq, &rrpc_debug->ws_jnl);
+	flush_work(&rrpc_debug->ws_jnl);
+
+	if (rrpc_debug_jnl_durable(rrpc_debug))
+		return 0;
+
+	mod_delayed_work(rrpc_debug->kmeta_wq, &rrpc_debug->ws_ckpt, 0);
+	if (!wait)
+		return -EIO;
+
+	flush_delayed_work(&rrpc_debug->ws_ckpt);
+
+	return rrpc_debug_jnl_durable(rrpc_debug) ? 0 : -EIO;
+}
+
+/* Copy the map entries of @nr pages from @laddr on. Writes and GC point an
+ * entry at its new page before that is written, and hold the range lock
+ * until it is. Taking the lock waits for them, so only entries of pages on
+ * the media are copied.
+ */
+static void rrpc_debug_ckpt_copy(struct rrpc_debug *rrpc_debug, sector_t laddr,
+					unsigned int nr, __le64 *entries)
+{
+	struct rrpc_debug_inflight_rq r;
+	unsigned int i;
+
+	if (rrpc_debug_lock_laddr(rrpc_debug, laddr, nr, &r)) {
+		/* buffered pages are locked until written, get them going */
+		rrpc_debug_wb_kick(rrpc_debug, laddr, nr);
+
+		wait_event(rrpc_debug->inflight_wait,
+			!rrpc_debug_lock_laddr(rrpc_debug, laddr, nr, &r));
+	}
+
+	for (i = 0; i < nr; i++)
+		entries[i] = cpu_to_le64(rrpc_debug_l2p(rrpc_debug,
+							laddr + i)->addr);
+
+	rrpc_debug_unlock_laddr(rrpc_debug, &r);
+}
+
+/* page @pg of the checkpoint image: the map, then a byte per block */
+static void rrpc_debug_ckpt_fill(struct rrpc_debug *rrpc_debug, unsigned int pg,
+								void *buf)
+{
+	unsigned int per = RRPC_DEBUG_EXPOSED_PAGE_SIZE / sizeof(__le64);
+	__le64 *entries = buf;
+	u8 *used = buf;
+	u64 i, start, n;
+
+	memset(buf, 0, RRPC_DEBUG_EXPOSED_PAGE_SIZE);
+
+	if (pg < rrpc_debug->ckpt_map_pages) {
+		start = (u64)pg * per;
+		n = min_t(u64, per, rrpc_debug->nr_pages - start);
+
+		for (i = 0; i < n; i += RRPC_DEBUG_INFLIGHT_STRIPE)
+			rrpc_debug_ckpt_copy(rrpc_debug, start + i,
+				min_t(u64, n - i, RRPC_DEBUG_INFLIGHT_STRIPE),
+				entries + i);
+		return;
+	}
+
+	start = (u64)(pg - rrpc_debug->ckpt_map_pages) *
+						RRPC_DEBUG_EXPOSED_PAGE_SIZE;
+	for (i = 0; i < RRPC_DEBUG_EXPOSED_PAGE_SIZE &&
+				start + i < rrpc_debug->total_blocks; i++)
+		used[i] = test_bit(start + i, rrpc_debug->blk_used);
+}
+
+static void rrpc_debug_ckpt_load_page(struct rrpc_debug *rrpc_debug,
+						unsigned int pg, void *buf)
+{
+	unsigned int per = RRPC_DEBUG_EXPOSED_PAGE_SIZE / sizeof(__le64);
+	__le64 *entries = buf;
+	u8 *used = buf;
+	u64 i, start, n;
+
+	if (pg < rrpc_debug->ckpt_map_pages) {
+		start = (u64)pg * per;
+		n = min_t(u64, per, rrpc_debug->nr_pages - start);
+
+		rrpc_debug_map_pin(rrpc_debug, start, n);
+		for (i = 0; i < n; i++)
+			rrpc_debug_l2p(rrpc_debug, start + i)->addr =
+						le64_to_cpu(entries[i]);
+		rrpc_debug_map_dirty(rrpc_debug, start);
+		rrpc_debug_map_dirty(rrpc_debug, start + n - 1);
+		rrpc_debug_map_unpin(rrpc_debug, start, n);
+		return;
+	}
+
+	start = (u64)(pg - rrpc_debug->ckpt_map_pages) *
+						RRPC_DEBUG_EXPOSED_PAGE_SIZE;
+	for (i = 0; i < RRPC_DEBUG_EXPOSED_PAGE_SIZE &&
+				start + i < rrpc_debug->total_blocks; i++)
+		if (used[i])
+			set_bit(start + i, rrpc_debug->blk_used);
+}
+
+/* Write a checkpoint to the slot of the next generation. Records added from
+ * here on go to the journal of that generation, which is erased first. The
+ * journal of the last checkpoint is kept, a crash before this one is
+ * complete replays both. A checkpoint that failed is taken again in the
+ * same generation, its journal holds records already.
+ */
+static int rrpc_debug_ckpt_write(struct rrpc_debug *rrpc_debug)
+{
+	unsigned int data_pages = rrpc_debug->ckpt_map_pages +
+						rrpc_debug->ckpt_blk_pages;
+	struct rrpc_debug_ckpt_trailer *tr;
+	unsigned int pg, n, i;
+	unsigned long flags;
+	u32 crc = ~0;
+	void *buf;
+	int blk, err;
+	u64 gen, run;
+	bool again;
+
+	/* keep the last checkpoint, it still holds the lost entries */
+	if (READ_ONCE(rrpc_debug->map_lost))
+		return -EIO;
+
+	mutex_lock(&rrpc_debug->jnl_mutex);
+	gen = rrpc_debug->ckpt_gen + 1;
+	again = rrpc_debug->jnl_gen == gen;
+
+	/* its journal was of the generation before the last checkpoint */
+	if (!again) {
+		rrpc_debug_meta_erase(rrpc_debug,
+				rrpc_debug_jnl_blk_start(rrpc_debug, gen),
+				rrpc_debug_jnl_blks(rrpc_debug));
+		rrpc_debug->jnl_next[gen & 1] = 0;
+	}
+
+	spin_lock_irqsave(&rrpc_debug->jnl_lock, flags);
+	rrpc_debug->jnl_gen = gen;
+	if (!again)
+		rrpc_debug->jnl_lost[gen & 1] = false;
+	run = ++rrpc_debug->ckpt_runs;
+	if (rrpc_debug->jnl_cur) {
+		list_add_tail(&rrpc_debug->jnl_cur->lru, &rrpc_debug->jnl_full);
+		rrpc_debug->jnl_cur = NULL;
+	}
+	spin_unlock_irqrestore(&rrpc_debug->jnl_lock, flags);
+	mutex_unlock(&rrpc_debug->jnl_mutex);
+
+	blk = (gen & 1) * rrpc_debug->ckpt_blks;
+	rrpc_debug_meta_erase(rrpc_debug, blk, rrpc_debug->ckpt_blks);
+
+	for (pg = 0; pg < rrpc_debug->ckpt_pages; pg += n) {
+		n = min(rrpc_debug->meta_chunk, rrpc_debug->ckpt_pages - pg);
+
+		for (i = 0; i < n; i++) {
+			buf = page_address(rrpc_debug->meta_pages[i]);
+
+			if (pg + i < rrpc_debug->ckpt_pages - 1) {
+				rrpc_debug_ckpt_fill(rrpc_debug, pg + i, buf);
+				if (pg + i < data_pages)
+					crc = crc32_le(crc, buf,
+						RRPC_DEBUG_EXPOSED_PAGE_SIZE);
+				continue;
+			}
+
+			memset(buf, 0, RRPC_DEBUG_EXPOSED_PAGE_SIZE);
+			tr = buf;
+			tr->magic = cpu_to_le32(RRPC_DEBUG_CKPT_MAGIC);
+			tr->version = cpu_to_le32(RRPC_DEBUG_CKPT_VERSION);
+			tr->gen = cpu_to_le64(gen);
+			tr->nr_pages = cpu_to_le64(rrpc_debug->nr_pages);
+			tr->oob_seq = cpu_to_le64(
+					atomic64_read(&rrpc_debug->oob_seq));
+			tr->nr_blocks = cpu_to_le32(rrpc_debug->total_blocks);
+			tr->crc = cpu_to_le32(crc);
+			tr->sec_per_pg = cpu_to_le32(
+					rrpc_debug->geo.sec_per_pg.d);
+			tr->nr_planes = cpu_to_le32(
+					rrpc_debug->geo.nr_planes.d);
+		}
+
+		err = rrpc_debug_meta_rw(rrpc_debug, WRITE, blk, pg,
+						rrpc_debug->meta_pages, n);
+		if (err) {
+			pr_err("nvm: rrpc_debug: checkpoint %llu failed: %d\n",
+							gen, err);
+			return err;
+		}
+	}
+
+	spin_lock_irqsave(&rrpc_debug->jnl_lock, flags);
+	rrpc_debug->ckpt_gen = gen;
+	rrpc_debug->ckpt_done = run;
+	spin_unlock_irqrestore(&rrpc_debug->jnl_lock, flags);
+
+	/* the journal of the previous checkpoint is covered now */
+	queue_work(rrpc_debug->kjnl_wq, &rrpc_debug->ws_jnl);
+
+	return 0;
+}
+
+static void rrpc_debug_ckpt_work(struct work_struct *work)
+{
+	struct rrpc_debug *rrpc_debug = container_of(to_delayed_work(work),
+						struct rrpc_debug, ws_ckpt);
+
+	rrpc_debug_ckpt_write(rrpc_debug);
+
+	if (checkpoint_ms)
+		queue_delayed_work(rrpc_debug->kmeta_wq, &rrpc_debug->ws_ckpt,
+					msecs_to_jiffies(checkpoint_ms));
+}
+
+/* Generation of the checkpoint in @slot, 0 if it holds none of this target.
+ * -EINVAL if the target wrote it with another address layout, its data
+ * would not be found.
+ */
+static s64 rrpc_debug_ckpt_probe(struct rrpc_debug *rrpc_debug, int slot)
+{
+	struct rrpc_debug_geo *geo = &rrpc_debug->geo;
+	struct nvm_dev *dev = rrpc_debug->dev;
+	struct rrpc_debug_ckpt_trailer *tr;
+	u32 version;
+
+	if (rrpc_debug_meta_rw(rrpc_debug, READ, slot * rrpc_debug->ckpt_blks,
+				rrpc_debug->ckpt_pages - 1,
+				rrpc_debug->meta_pages, 1))
+		return 0;
+
+	tr = page_address(rrpc_debug->meta_pages[0]);
+	if (le32_to_cpu(tr->magic) != RRPC_DEBUG_CKPT_MAGIC)
+		return 0;
+
+	version = le32_to_cpu(tr->version);
+	if (version == RRPC_DEBUG_CKPT_VERSION ?
+	    (le32_to_cpu(tr->sec_per_pg) != geo->sec_per_pg.d ||
+	     le32_to_cpu(tr->nr_planes) != geo->nr_planes.d) :
+	    (version < RRPC_DEBUG_CKPT_VERSION &&
+	     dev->sec_per_blk != dev->pgs_per_blk)) {
+		pr_err("nvm: rrpc_debug: checkpoint in slot %d has another address layout\n",
+									slot);
+		return -EINVAL;
+	}
+
+	if (version != RRPC_DEBUG_CKPT_VERSION &&
+	    version != RRPC_DEBUG_CKPT_VERSION - 1)
+		return 0;
+
+	if (le64_to_cpu(tr->nr_pages) != rrpc_debug->nr_pages ||
+	    le32_to_cpu(tr->nr_blocks) != rrpc_debug->total_blocks ||
+	    (le64_to_cpu(tr->gen) & 1) != slot)
+		return 0;
+
+	return le64_to_cpu(tr->gen);
+}
+
+static int rrpc_debug_ckpt_read(struct rrpc_debug *rrpc_debug, int slot)
+{
+	unsigned int data_pages = rrpc_debug->ckpt_map_pages +
+						rrpc_debug->ckpt_blk_pages;
+	struct rrpc_debug_ckpt_trailer *tr;
+	unsigned int pg, n, i;
+	u32 crc = ~0;
+	void *buf;
+	int err;
+
+	bitmap_zero(rrpc_debug->blk_used, rrpc_debug->total_blocks);
+
+	for (pg = 0; pg < rrpc_debug->ckpt_pages; pg += n) {
+		n = min(rrpc_debug->meta_chunk, rrpc_debug->ckpt_pages - pg);
+
+		err = rrpc_debug_meta_rw(rrpc_debug, READ,
+				slot * rrpc_debug->ckpt_blks, pg,
+				rrpc_debug->meta_pages, n);
+		if (err)
+			return err;
+
+		for (i = 0; i < n; i++) {
+			buf = page_address(rrpc_debug->meta_pages[i]);
+
+			if (pg + i < data_pages) {
+				crc = crc32_le(crc, buf,
+						RRPC_DEBUG_EXPOSED_PAGE_SIZE);
+				rrpc_debug_ckpt_load_page(rrpc_debug, pg + i, buf);
+			} else if (pg + i == rrpc_debug->ckpt_pages - 1) {
+				tr = buf;
+				if (le32_to_cpu(tr->crc) != crc)
+					return -EILSEQ;
+
+				/* pages written after the checkpoint have
+				 * higher numbers, skip past them
+				 */
+				atomic64_set(&rrpc_debug->oob_seq,
+					le64_to_cpu(tr->oob_seq) +
+					RRPC_DEBUG_OOB_SEQ_SKIP);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void rrpc_debug_jnl_apply(struct rrpc_debug *rrpc_debug,
+					struct rrpc_debug_jnl_rec *rec)
+{
+	u64 a = le64_to_cpu(rec->a), b = le64_to_cpu(rec->b);
+
+	switch (le32_to_cpu(rec->type)) {
+	case RRPC_DEBUG_JNL_MAP:
+		if (a < rrpc_debug->nr_pages && (b == ADDR_EMPTY ||
+		    (b >= rrpc_debug->poffset &&
+		     b < rrpc_debug->poffset + rrpc_debug->nr_pages)))
+			rrpc_debug_map_set(rrpc_debug, a, b);
+		break;
+	case RRPC_DEBUG_JNL_GET:
+		if (a < rrpc_debug->total_blocks)
+			set_bit(a, rrpc_debug->blk_used);
+		break;
+	case RRPC_DEBUG_JNL_PUT:
+		if (a < rrpc_debug->total_blocks)
+			clear_bit(a, rrpc_debug->blk_used);
+		break;
+	}
+}
+
+/* Replay the journal of generation @gen up to its first gap. Returns the
+ * number of pages replayed.
+ */
+static unsigned int rrpc_debug_jnl_replay(struct rrpc_debug *rrpc_debug,
+								u64 gen)
+{
+	struct rrpc_debug_jnl_hdr *hdr;
+	unsigned int pg, n, i, j, nr;
+
+	for (pg = 0; pg < rrpc_debug->jnl_pages; pg += n) {
+		n = min(rrpc_debug->meta_chunk, rrpc_debug->jnl_pages - pg);
+
+		if (rrpc_debug_meta_rw(rrpc_debug, READ,
+				rrpc_debug_jnl_blk_start(rrpc_debug, gen), pg,
+				rrpc_debug->meta_pages, n))
+			return pg;
+
+		for (i = 0; i < n; i++) {
+			hdr = page_address(rrpc_debug->meta_pages[i]);
+			nr = le32_to_cpu(hdr->nr);
+
+			if (le32_to_cpu(hdr->magic) != RRPC_DEBUG_JNL_MAGIC ||
+			    le64_to_cpu(hdr->gen) != gen ||
+			    le64_to_cpu(hdr->idx) != pg + i ||
+			    nr > RRPC_DEBUG_JNL_RECS ||
+			    le32_to_cpu(hdr->crc) != crc32_le(~0, hdr + 1,
+					nr * sizeof(struct rrpc_debug_jnl_rec)))
+				return pg + i;
+
+			for (j = 0; j < nr; j++)
+				rrpc_debug_jnl_apply(rrpc_debug,
+					(struct rrpc_debug_jnl_rec *)(hdr + 1) + j);
+		}
+	}
+
+	return pg;
+}
+
+/* Load the newest complete checkpoint and replay its journal into the map.
+ * Returns 1 if one was loaded, 0 if there is none.
+ */
+static int rrpc_debug_ckpt_load(struct rrpc_debug *rrpc_debug)
+{
+	int slot, tried = 0;
+	s64 gen[2];
+
+	if (!rrpc_debug->ckpt_pages)
+		return 0;
+
+	gen[0] = rrpc_debug_ckpt_probe(rrpc_debug, 0);
+	gen[1] = rrpc_debug_ckpt_probe(rrpc_debug, 1);
+	if (gen[0] < 0 || gen[1] < 0)
+		return -EINVAL;
+
+	while (gen[0] || gen[1]) {
+		slot = gen[1] > gen[0];
+		tried = 1;
+
+		if (!rrpc_debug_ckpt_read(rrpc_debug, slot)) {
+			rrpc_debug->ckpt_gen = gen[slot];
+			rrpc_debug->jnl_gen = gen[slot];
+			rrpc_debug_jnl_replay(rrpc_debug, gen[slot]);
+
+			/* a checkpoint that did not complete leaves its
+			 * journal, it is taken again in that generation
+			 */
+			if (rrpc_debug_jnl_replay(rrpc_debug, gen[slot] + 1))
+				rrpc_debug->jnl_gen = gen[slot] + 1;
+
+			pr_info("nvm: rrpc_debug: loaded checkpoint %llu\n",
+								gen[slot]);
+			rrpc_debug->ckpt_loaded = true;
+			return 1;
+		}
+
+		pr_warn("nvm: rrpc_debug: checkpoint %llu is corrupt\n",
+								gen[slot]);
+		gen[slot] = 0;
+	}
+
+	/* start over from the map of the device */
+	if (tried) {
+		bitmap_zero(rrpc_debug->blk_used, rrpc_debug->total_blocks);
+		return rrpc_debug_init_parallel(rrpc_debug,
+						rrpc_debug_map_clear);
+	}
+
+	return 0;
+}
+
+/* Take the blocks of @rlun set in @want from the free list of the media
+ * manager, their bits are cleared. Blocks it holds as used already are left
+ * as they are.
+ */
+static int rrpc_debug_claim_blks(struct rrpc_debug *rrpc_debug,
+			struct rrpc_debug_lun *rlun, unsigned long *want)
+{
+	struct nvm_dev *dev = rrpc_debug->dev;
+	struct nvm_block **others, *blk;
+	int i, n = 0;
+
+	others = kcalloc(dev->blks_per_lun, sizeof(struct nvm_block *),
+								GFP_KERNEL);
+	if (!others)
+		return -ENOMEM;
+
+	while ((blk = nvm_get_blk(dev, rlun->parent, 1))) {
+		if (!test_and_clear_bit(blk->id % dev->blks_per_lun, want))
+			others[n++] = blk;
+	}
+
+	for (i = 0; i < n; i++)
+		nvm_put_blk(dev, others[i]);
+
+	kfree(others);
+	rrpc_debug_free_tree_update(rrpc_debug, rlun);
+
+	return 0;
+}
+
+/* blocks at the start of the first lun reserved for checkpoints */
+static int rrpc_debug_ckpt_reserved(struct rrpc_debug *rrpc_debug)
+{
+	if (!rrpc_debug->ckpt_pages)
+		return 0;
+
+	return (rrpc_debug->ckpt_blks + rrpc_debug_jnl_blks(rrpc_debug)) * 2;
+}
+
+/* Take over a block found in use at bring-up. It is not written to anymore,
+ * and every page not holding the current copy of a logical page is invalid.
+ */
+static void rrpc_debug_adopt_blk(struct rrpc_debug *rrpc_debug,
+					struct rrpc_debug_block *rblk)
+{
+	struct rrpc_debug_lun *rlun = rblk->rlun;
+	unsigned int pgs = rrpc_debug->dev->pgs_per_blk;
+	u64 paddr, laddr;
+	int off;
+
+	rblk->parent->priv = rblk;
+	rblk->next_page = pgs;
+	rblk->nr_invalid_pages = 0;
+	bitmap_zero(rblk->invalid_pages, pgs);
+	atomic_set(&rblk->data_cmnt_size, pgs);
+
+	for (off = 0; off < pgs; off++) {
+		paddr = block_to_addr(rrpc_debug, rblk) + off;
+		laddr = rrpc_debug_rev(rrpc_debug, paddr)->addr;
+		if (laddr != ADDR_EMPTY &&
+		    rrpc_debug_map_get(rrpc_debug, laddr) == paddr)
+			continue;
+
+		set_bit(off, rblk->invalid_pages);
+		rblk->nr_invalid_pages++;
+	}
+
+	if (rrpc_debug->ckpt_pages)
+		set_bit(rrpc_debug_blk_idx(rrpc_debug, rblk),
+						rrpc_debug->blk_used);
+
+	spin_lock(&rlun->lock);
+	rblk->closed = jiffies;
+	rrpc_debug_prio_add(rlun, rblk);
+	spin_unlock(&rlun->lock);
+}
+
+/* blocks in use after a checkpoint was loaded, their state follows from
+ * the map
+ */
+static void rrpc_debug_ckpt_lun_blocks(struct work_struct *work)
+{
+	struct rrpc_debug_init_work *w = container_of(work,
+					struct rrpc_debug_init_work, ws);
+	struct rrpc_debug *rrpc_debug = w->rrpc_debug;
+	struct rrpc_debug_lun *rlun = &rrpc_debug->luns[w->part];
+	int blks = rrpc_debug->dev->blks_per_lun;
+	struct rrpc_debug_block *rblk;
+	unsigned long *want;
+	int i;
+
+	want = kcalloc(BITS_TO_LONGS(blks), sizeof(unsigned long), GFP_KERNEL);
+	if (!want) {
+		w->ret = -ENOMEM;
+		return;
+	}
+
+	for (i = 0; i < blks; i++) {
+		rblk = &rlun->blocks[i];
+
+		if (!w->part && i < rrpc_debug_ckpt_reserved(rrpc_debug)) {
+			set_bit(i, want);
+			continue;
+		}
+
+		if (!test_bit(rrpc_debug_blk_idx(rrpc_debug, rblk),
+							rrpc_debug->blk_used))
+			continue;
+
+		set_bit(i, want);
+		rrpc_debug_adopt_blk(rrpc_debug, rblk);
+	}
+
+	w->ret = rrpc_debug_claim_blks(rrpc_debug, rlun, want);
+	if (!w->ret && !w->part &&
+	    find_first_bit(want, blks) < rrpc_debug_ckpt_reserved(rrpc_debug)) {
+		pr_err("nvm: rrpc_debug: checkpoint blocks are in use\n");
+		w->ret = -EBUSY;
+	}
+	kfree(want);
+}
+
+/* rebuild the reverse map and block state from the loaded map */
+static int rrpc_debug_ckpt_blocks_init(struct rrpc_debug *rrpc_debug)
+{
+	u64 i, paddr;
+
+	for (i = 0; i < rrpc_debug->nr_pages; i++) {
+		paddr = rrpc_debug_map_get(rrpc_debug, i);
+		if (paddr == ADDR_EMPTY)
+			continue;
+
+		rrpc_debug_rev(rrpc_debug, paddr)->addr = i;
+		if (!(i & 0xffff))
+			cond_resched();
+	}
+
+	return rrpc_debug_init_parallel(rrpc_debug, rrpc_debug_ckpt_lun_blocks);
+}
+
+/* does @rblk hold a page that is mapped */
+static int rrpc_debug_blk_has_data(struct rrpc_debug *rrpc_debug,
+					struct rrpc_debug_block *rblk)
+{
+	u64 paddr, laddr;
+	int off;
+
+	for (off = 0; off < rrpc_debug->dev->pgs_per_blk; off++) {
+		paddr = block_to_addr(rrpc_debug, rblk) + off;
+		laddr = rrpc_debug_rev(rrpc_debug, paddr)->addr;
+		if (laddr != ADDR_EMPTY &&
+		    rrpc_debug_map_get(rrpc_debug, laddr) == paddr)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Without a checkpoint, the blocks in use follow from the imported map. The
+ * reserved area is only taken if none of its blocks hold data.
+ */
+static int rrpc_debug_ckpt_fresh(struct rrpc_debug *rrpc_debug)
+{
+	int nr = rrpc_debug_ckpt_reserved(rrpc_debug);
+	struct rrpc_debug_lun *rlun;
+	struct rrpc_debug_block *rblk;
+	unsigned long *want;
+	int i, j, ret;
+
+	rrpc_debug_for_each_lun(rrpc_debug, rlun, i) {
+		for (j = 0; j < rrpc_debug->dev->blks_per_lun; j++) {
+			rblk = &rlun->blocks[j];
+			if (!rrpc_debug_blk_has_data(rrpc_debug, rblk))
+				continue;
+
+			if (!i && j < nr) {
+				pr_warn("nvm: rrpc_debug: checkpoint area holds data, checkpoints disabled\n");
+				rrpc_debug->ckpt_pages = 0;
+				return 0;
+			}
+
+			set_bit(rrpc_debug_blk_idx(rrpc_debug, rblk),
+							rrpc_debug->blk_used);
+		}
+		cond_resched();
+	}
+
+	want = kcalloc(BITS_TO_LONGS(rrpc_debug->dev->blks_per_lun),
+					sizeof(unsigned long), GFP_KERNEL);
+	if (!want)
+		return -ENOMEM;
+
+	for (j = 0; j < nr; j++)
+		set_bit(j, want);
+
+	rlun = &rrpc_debug->luns[0];
+	ret = rrpc_debug_claim_blks(rrpc_debug, rlun, want);
+	if (ret || bitmap_empty(want, nr))
+		goto out;
+
+	/* some are bad or in use, hand back the ones taken */
+	pr_warn("nvm: rrpc_debug: checkpoint area unavailable, checkpoints disabled\n");
+	for (j = 0; j < nr; j++)
+		if (!test_bit(j, want))
+			nvm_put_blk(rrpc_debug->dev, rlun->blocks[j].parent);
+	rrpc_debug_free_tree_update(rrpc_debug, rlun);
+	rrpc_debug->ckpt_pages = 0;
+out:
+	kfree(want);
+	return ret;
+}
+
+static void rrpc_debug_ckpt_free(struct rrpc_debug *rrpc_debug)
+{
+	struct page *page, *next;
+	int i;
+
+	if (rrpc_debug->kmeta_wq)
+		destroy_workqueue(rrpc_debug->kmeta_wq);
+	if (rrpc_debug->kjnl_wq)
+		destroy_workqueue(rrpc_debug->kjnl_wq);
+
+	if (rrpc_debug->jnl_pool) {
+		if (rrpc_debug->jnl_cur)
+			list_add_tail(&rrpc_debug->jnl_cur->lru,
+						&rrpc_debug->jnl_full);
+		list_for_each_entry_safe(page, next, &rrpc_debug->jnl_full, lru)
+			rrpc_debug_jnl_free_page(rrpc_debug, page);
+		mempool_destroy(rrpc_debug->jnl_pool);
+	}
 
-		return rrpc_debug_read_ppalist_rq(rrpc_debug, bio, rqd, flags, npages);
+	if (rrpc_debug->meta_pages) {
+		for (i = 0; i < rrpc_debug->meta_chunk; i++)
+			if (rrpc_debug->meta_pages[i])
+				__free_page(rrpc_debug->meta_pages[i]);
+		kfree(rrpc_debug->meta_pages);
 	}
 
-	if (bio_rw(bio) == WRITE)
-		return rrpc_debug_write_rq(rrpc_debug, bio, rqd, flags);
+	kfree(rrpc_debug->jnl_batch);
+	kfree(rrpc_debug->blk_used);
+}
 
-	return rrpc_debug_read_rq(rrpc_debug, bio, rqd, flags);
+static int rrpc_debug_ckpt_init(struct rrpc_debug *rrpc_debug)
+{
+	struct nvm_dev *dev = rrpc_debug->dev;
+	unsigned int pgs = dev->pgs_per_blk;
+	unsigned int per = RRPC_DEBUG_EXPOSED_PAGE_SIZE / sizeof(__le64);
+	unsigned int chunk;
+	int i;
+
+	spin_lock_init(&rrpc_debug->jnl_lock);
+	mutex_init(&rrpc_debug->jnl_mutex);
+	INIT_LIST_HEAD(&rrpc_debug->jnl_full);
+	INIT_WORK(&rrpc_debug->ws_jnl, rrpc_debug_jnl_work);
+	INIT_DELAYED_WORK(&rrpc_debug->ws_ckpt, rrpc_debug_ckpt_work);
+
+	/* also the write size of the translation log */
+	chunk = min_t(unsigned int, pgs,
+			dev->max_rq_size / RRPC_DEBUG_EXPOSED_PAGE_SIZE);
+	rrpc_debug->meta_chunk = max_t(unsigned int,
+			rounddown(chunk, rrpc_debug->prog_pages),
+			rrpc_debug->prog_pages);
+
+	if (!checkpoint_ms)
+		return 0;
+
+	rrpc_debug->ckpt_map_pages = DIV_ROUND_UP_ULL(rrpc_debug->nr_pages, per);
+	rrpc_debug->ckpt_blk_pages = DIV_ROUND_UP(rrpc_debug->total_blocks,
+						RRPC_DEBUG_EXPOSED_PAGE_SIZE);
+	rrpc_debug->jnl_pages = journal_blocks * pgs;
+
+	/* journals found on media are replayed, not written to. One is only
+	 * started by a checkpoint.
+	 */
+	rrpc_debug->jnl_next[0] = rrpc_debug->jnl_pages;
+	rrpc_debug->jnl_next[1] = rrpc_debug->jnl_pages;
+
+	/* the trailer is programmed last, with the unit it is in */
+	rrpc_debug->ckpt_pages = round_up(rrpc_debug->ckpt_map_pages +
+				rrpc_debug->ckpt_blk_pages + 1,
+				rrpc_debug->prog_pages);
+	rrpc_debug->ckpt_blks = DIV_ROUND_UP(rrpc_debug->ckpt_pages, pgs);
+
+	if (!journal_blocks || (rrpc_debug->ckpt_blks + journal_blocks) * 2 >
+						dev->blks_per_lun / 4) {
+		pr_err("nvm: rrpc_debug: checkpoint does not fit the first lun\n");
+		rrpc_debug->ckpt_pages = 0;
+		return -EINVAL;
+	}
+
+	rrpc_debug->meta_pages = kcalloc(rrpc_debug->meta_chunk,
+					sizeof(struct page *), GFP_KERNEL);
+	rrpc_debug->jnl_batch = kcalloc(rrpc_debug->meta_chunk,
+					sizeof(struct page *), GFP_KERNEL);
+	rrpc_debug->blk_used = kcalloc(BITS_TO_LONGS(rrpc_debug->total_blocks),
+					sizeof(unsigned long), GFP_KERNEL);
+	if (!rrpc_debug->meta_pages || !rrpc_debug->jnl_batch ||
+						!rrpc_debug->blk_used)
+		goto err;
+
+	for (i = 0; i < rrpc_debug->meta_chunk; i++) {
+		rrpc_debug->meta_pages[i] = alloc_page(GFP_KERNEL);
+		if (!rrpc_debug->meta_pages[i])
+			goto err;
+	}
+
+	rrpc_debug->jnl_pool = mempool_create_page_pool(
+					rrpc_debug->meta_chunk * 2, 0);
+	if (!rrpc_debug->jnl_pool)
+		goto err;
+
+	rrpc_debug->kmeta_wq = alloc_ordered_workqueue("rrpc_debug-meta",
+							WQ_MEM_RECLAIM);
+	rrpc_debug->kjnl_wq = alloc_ordered_workqueue("rrpc_debug-jnl",
+							WQ_MEM_RECLAIM);
+	if (!rrpc_debug->kmeta_wq || !rrpc_debug->kjnl_wq)
+		goto err;
+
+	return 0;
+err:
+	rrpc_debug->ckpt_pages = 0;
+	return -ENOMEM;
 }
 
-static int rrpc_debug_submit_io(struct rrpc_debug *rrpc_debug, struct bio *bio,
-				struct nvm_rq *rqd, unsigned long flags)
+/* Demand paged map */
+
+/* Block holding page @pg of the translation log, and its offset there. The
+ * log takes the last map_blks blocks of every lun, its blocks alternate
+ * between luns.
+ */
+static struct rrpc_debug_block *rrpc_debug_map_log_blk(struct rrpc_debug *rrpc_debug,
+							u64 pg, u32 *off)
 {
-	int err;
-	struct rrpc_debug_rq *rrq = nvm_rq_to_pdu(rqd);
-	uint8_t nr_pages = rrpc_debug_get_pages(bio);
-	int bio_size = bio_sectors(bio) << 9;
+	struct nvm_dev *dev = rrpc_debug->dev;
+	u32 lun;
+	u64 blk;
 
-	printk(KERN_INFO "target_submit_io\n");
+	blk = div_u64_rem(pg, dev->pgs_per_blk, off);
+	blk = div_u64_rem(blk, rrpc_debug->nr_luns, &lun);
 
-	if (bio_size < rrpc_debug->dev->sec_size)
-		return NVM_IO_ERR;
-	else if (bio_size > rrpc_debug->dev->max_rq_size)
-		return NVM_IO_ERR;
+	return &rrpc_debug->luns[lun].blocks[dev->blks_per_lun - 1 - blk];
+}
 
-	err = rrpc_debug_setup_rq(rrpc_debug, bio, rqd, flags, nr_pages);
+static u64 rrpc_debug_map_log_addr(struct rrpc_debug *rrpc_debug, u64 pg)
+{
+	struct rrpc_debug_block *rblk;
+	u32 off;
+
+	rblk = rrpc_debug_map_log_blk(rrpc_debug, pg, &off);
+	return block_to_addr(rrpc_debug, rblk) + off;
+}
+
+/* write @nr pages to the log from page @pg on, padded to a program unit */
+static int rrpc_debug_map_log_write(struct rrpc_debug *rrpc_debug, u64 pg,
+						struct page **pages, int nr)
+{
+	int n, err;
+
+	nr = round_up(nr, rrpc_debug->prog_pages);
+	while (nr) {
+		n = min_t(int, nr, rrpc_debug->meta_chunk);
+		err = rrpc_debug_meta_io(rrpc_debug, WRITE,
+				rrpc_debug_map_log_addr(rrpc_debug, pg),
+				pages, n, NULL, 0);
+		if (err)
+			return err;
+
+		pg += n;
+		pages += n;
+		nr -= n;
+	}
+
+	return 0;
+}
+
+/* The entries of translation page @idx are gone. Serving or checkpointing
+ * the map would hand out or persist them as unmapped, so the target fails
+ * all I/O from here on. The checkpoint and journal on media still hold them
+ * for the next bring-up.
+ */
+static void rrpc_debug_map_lost(struct rrpc_debug *rrpc_debug, u64 idx)
+{
+	pr_err_ratelimited("nvm: rrpc_debug: translation page %llu lost, failing target\n",
+						(unsigned long long)idx);
+	WRITE_ONCE(rrpc_debug->map_lost, true);
+}
+
+/* Make room at the tail of the log. Entering a block, the translation pages
+ * it holds the last copy of are saved, the block is erased and they are
+ * written back at its start. Cached ones are written again on eviction.
+ */
+static int rrpc_debug_map_log_prep(struct rrpc_debug *rrpc_debug)
+{
+	unsigned int pgs = rrpc_debug->dev->pgs_per_blk;
+	u64 *log_idx = rrpc_debug->map_log_idx;
+	struct rrpc_debug_tpage *tp;
+	u64 nr_blks, b, p, idx, next;
+	u32 off;
+	int n, i, err;
+
+	nr_blks = div_u64(rrpc_debug->map_log_pages, pgs);
+
+	for (b = 0; b < nr_blks; b++) {
+		if (rrpc_debug->map_next == rrpc_debug->map_log_pages)
+			rrpc_debug->map_next = 0;
+
+		next = rrpc_debug->map_next;
+		div_u64_rem(next, pgs, &off);
+		if (off)
+			return 0;
+
+		/* live pages move to the front of log_idx as they are read */
+		n = 0;
+		for (p = next; p < next + pgs; p++) {
+			idx = log_idx[p];
+			log_idx[p] = ADDR_EMPTY;
+			if (idx == ADDR_EMPTY || rrpc_debug->gtd[idx].log != p)
+				continue;
+
+			tp = rrpc_debug->gtd[idx].tp;
+			if (tp) {
+				rrpc_debug->gtd[idx].log = ADDR_EMPTY;
+				set_bit(RRPC_DEBUG_TPAGE_DIRTY, &tp->flags);
+				continue;
+			}
+
+			err = rrpc_debug_meta_io(rrpc_debug, READ,
+					rrpc_debug_map_log_addr(rrpc_debug, p),
+					&rrpc_debug->map_reloc[n], 1, NULL, 0);
+			if (err) {
+				rrpc_debug_map_lost(rrpc_debug, idx);
+				rrpc_debug->gtd[idx].log = ADDR_EMPTY;
+				continue;
+			}
+			log_idx[next + n++] = idx;
+		}
+
+		nvm_erase_blk(rrpc_debug->dev,
+			rrpc_debug_map_log_blk(rrpc_debug, next, &off)->parent);
+
+		if (n) {
+			err = rrpc_debug_map_log_write(rrpc_debug, next,
+						rrpc_debug->map_reloc, n);
+			if (err)
+				return err;
+
+			for (i = 0; i < n; i++)
+				rrpc_debug->gtd[log_idx[next + i]].log = next + i;
+		}
+
+		rrpc_debug->map_next = next + round_up(n, rrpc_debug->prog_pages);
+	}
+
+	return -ENOSPC;
+}
+
+/* Write dirty translation pages from the cold end of map_lru back to the
+ * log, as many as fit a write. They stay cached, pinned while written.
+ */
+static int rrpc_debug_map_writeback(struct rrpc_debug *rrpc_debug)
+{
+	u64 *log_idx = rrpc_debug->map_log_idx;
+	struct rrpc_debug_tpage *tp, *prev;
+	unsigned long flags;
+	__le64 *entries;
+	int i, j, n = 0, max, scan = 0, err;
+	u64 next;
+	u32 off;
+
+	err = rrpc_debug_map_log_prep(rrpc_debug);
 	if (err)
 		return err;
 
-	bio_get(bio);
-	rqd->bio = bio;
-	rqd->ins = &rrpc_debug->instance;
-	rqd->nr_pages = nr_pages;
-	rrq->flags = flags;
+	next = rrpc_debug->map_next;
+	rrpc_debug_map_log_blk(rrpc_debug, next, &off);
+	max = min_t(int, rrpc_debug->meta_chunk,
+					rrpc_debug->dev->pgs_per_blk - off);
 
-	err = nvm_submit_io(rrpc_debug->dev, rqd);
-        err = nvm_submit_io(rrpc_debug->dev, rqd);
-	if (err) {
-		pr_err("rrpc_debug: I/O submission failed: %d\n", err);
-		return NVM_IO_ERR;
+	spin_lock_irqsave(&rrpc_debug->map_lock, flags);
+	list_for_each_entry_safe_reverse(tp, prev, &rrpc_debug->map_lru, list) {
+		if (n == max || scan++ == 4 * max)
+			break;
+
+		if (!test_and_clear_bit(RRPC_DEBUG_TPAGE_DIRTY, &tp->flags))
+			continue;
+
+		tp->pins++;
+		list_del_init(&tp->list);
+		log_idx[next + n++] = tp->idx;
+	}
+	spin_unlock_irqrestore(&rrpc_debug->map_lock, flags);
+
+	/* entries changed from here on dirty the page again */
+	for (i = 0; i < n; i++) {
+		tp = rrpc_debug->gtd[log_idx[next + i]].tp;
+		entries = page_address(rrpc_debug->map_io[i]);
+		for (j = 0; j < RRPC_DEBUG_TPAGE_ENTRIES; j++)
+			entries[j] = cpu_to_le64(READ_ONCE(tp->map[j].addr));
 	}
 
-	return NVM_IO_OK;
+	err = rrpc_debug_map_log_write(rrpc_debug, next, rrpc_debug->map_io, n);
+
+	spin_lock_irqsave(&rrpc_debug->map_lock, flags);
+	for (i = 0; i < n; i++) {
+		tp = rrpc_debug->gtd[log_idx[next + i]].tp;
+		if (err)
+			set_bit(RRPC_DEBUG_TPAGE_DIRTY, &tp->flags);
+		else
+			rrpc_debug->gtd[tp->idx].log = next + i;
+
+		if (!--tp->pins)
+			list_add_tail(&tp->list, &rrpc_debug->map_lru);
+	}
+	spin_unlock_irqrestore(&rrpc_debug->map_lock, flags);
+
+	/* a failed unit is skipped */
+	for (i = 0; i < n; i++)
+		if (err)
+			log_idx[next + i] = ADDR_EMPTY;
+	rrpc_debug->map_next = next + round_up(n, rrpc_debug->prog_pages);
+
+	return err;
 }
 
-static blk_qc_t rrpc_debug_make_rq(struct request_queue *q, struct bio *bio)
+/* Take the least recently used translation page that is not pinned out of
+ * the cache, dirty ones are written back first. NULL if all are pinned, the
+ * worker is queued again on the next unpin.
+ */
+static struct rrpc_debug_tpage *rrpc_debug_map_victim(struct rrpc_debug *rrpc_debug)
 {
-	struct rrpc_debug *rrpc_debug = q->queuedata;
-	struct nvm_rq *rqd;
+	struct rrpc_debug_tpage *tp;
+	unsigned long flags;
 	int err;
 
-	printk(KERN_INFO "target_make_rq\n");
+	for (;;) {
+		spin_lock_irqsave(&rrpc_debug->map_lock, flags);
+		if (list_empty(&rrpc_debug->map_lru)) {
+			rrpc_debug->map_starved = true;
+			spin_unlock_irqrestore(&rrpc_debug->map_lock, flags);
+			return NULL;
+		}
 
-	if (bio->bi_rw & REQ_DISCARD) {
-		rrpc_debug_discard(rrpc_debug, bio);
-		return BLK_QC_T_NONE;
-	}
+		tp = list_last_entry(&rrpc_debug->map_lru,
+					struct rrpc_debug_tpage, list);
+		if (!test_bit(RRPC_DEBUG_TPAGE_DIRTY, &tp->flags)) {
+			list_del_init(&tp->list);
+			if (tp->idx != ADDR_EMPTY)
+				rrpc_debug->gtd[tp->idx].tp = NULL;
+			spin_unlock_irqrestore(&rrpc_debug->map_lock, flags);
+			return tp;
+		}
+		spin_unlock_irqrestore(&rrpc_debug->map_lock, flags);
 
-	rqd = mempool_alloc(rrpc_debug->rq_pool, GFP_KERNEL);
-	if (!rqd) {
-		pr_err_ratelimited("rrpc_debug: not able to queue bio.");
-		bio_io_error(bio);
-		return BLK_QC_T_NONE;
+		err = rrpc_debug_map_writeback(rrpc_debug);
+		if (err) {
+			pr_err_ratelimited("nvm: rrpc_debug: translation page write back failed (%d)\n",
+									err);
+			return ERR_PTR(err);
+		}
 	}
-	memset(rqd, 0, sizeof(struct nvm_rq));
+}
 
-	err = rrpc_debug_submit_io(rrpc_debug, bio, rqd, NVM_IOTYPE_NONE);
-	switch (err) {
-	case NVM_IO_OK:
-		return BLK_QC_T_NONE;
-	case NVM_IO_ERR:
-		bio_io_error(bio);
-		break;
-	case NVM_IO_DONE:
-		bio_endio(bio);
-		break;
-	case NVM_IO_REQUEUE:
-		spin_lock(&rrpc_debug->bio_lock);
-		bio_list_add(&rrpc_debug->requeue_bios, bio);
-		spin_unlock(&rrpc_debug->bio_lock);
-		queue_work(rrpc_debug->kgc_wq, &rrpc_debug->ws_requeue);
-		break;
+static void rrpc_debug_map_load(struct rrpc_debug *rrpc_debug,
+					struct rrpc_debug_tpage *tp, u64 idx)
+{
+	__le64 *entries = page_address(tp->page);
+	u64 log = rrpc_debug->gtd[idx].log;
+	int i;
+
+	if (log != ADDR_EMPTY) {
+		if (!rrpc_debug_meta_io(rrpc_debug, READ,
+				rrpc_debug_map_log_addr(rrpc_debug, log),
+				&tp->page, 1, NULL, 0)) {
+			for (i = 0; i < RRPC_DEBUG_TPAGE_ENTRIES; i++)
+				tp->map[i].addr = le64_to_cpu(entries[i]);
+			return;
+		}
+
+		rrpc_debug_map_lost(rrpc_debug, idx);
 	}
 
-	mempool_free(rqd, rrpc_debug->rq_pool);
-	return BLK_QC_T_NONE;
+	for (i = 0; i < RRPC_DEBUG_TPAGE_ENTRIES; i++)
+		tp->map[i].addr = ADDR_EMPTY;
 }
 
-static void rrpc_debug_requeue(struct work_struct *work)
+/* requeue the bios parked on a miss of translation page @idx */
+static void rrpc_debug_map_wake(struct rrpc_debug *rrpc_debug, u64 idx)
 {
-	struct rrpc_debug *rrpc_debug = container_of(work, struct rrpc_debug, ws_requeue);
+	struct rrpc_debug_map_waiters *w = rrpc_debug_map_waiters(rrpc_debug,
+									idx);
 	struct bio_list bios;
-	struct bio *bio;
+	unsigned long flags;
+
+	spin_lock_irqsave(&w->lock, flags);
+	w->seq++;
+	bios = w->bios;
+	bio_list_init(&w->bios);
+	spin_unlock_irqrestore(&w->lock, flags);
+
+	rrpc_debug_requeue_bios(rrpc_debug, &bios);
+}
+
+/* Load the translation pages asked for, lowest first. A load retries the
+ * requests parked on a miss of that page, as does a failed write back.
+ */
+static void rrpc_debug_map_work(struct work_struct *work)
+{
+	struct rrpc_debug *rrpc_debug = container_of(work, struct rrpc_debug,
+									ws_map);
+	struct rrpc_debug_tpage *tp;
+	unsigned long flags;
+	u64 idx;
+
+	for (;;) {
+		idx = find_first_bit(rrpc_debug->map_fault, rrpc_debug->nr_tpages);
+		if (idx >= rrpc_debug->nr_tpages)
+			break;
+
+		if (rrpc_debug->gtd[idx].tp) {
+			clear_bit(idx, rrpc_debug->map_fault);
+			continue;
+		}
+
+		tp = rrpc_debug_map_victim(rrpc_debug);
+		if (!tp)
+			break;
+
+		/* the requests parked on every page asked for retry and ask
+		 * again, nothing else would requeue them
+		 */
+		if (IS_ERR(tp)) {
+			for_each_set_bit(idx, rrpc_debug->map_fault,
+						rrpc_debug->nr_tpages) {
+				clear_bit(idx, rrpc_debug->map_fault);
+				rrpc_debug_map_wake(rrpc_debug, idx);
+			}
+			break;
+		}
+
+		rrpc_debug_map_load(rrpc_debug, tp, idx);
+
+		spin_lock_irqsave(&rrpc_debug->map_lock, flags);
+		tp->idx = idx;
+		tp->flags = 0;
+		rrpc_debug->gtd[idx].tp = tp;
+		list_add(&tp->list, &rrpc_debug->map_lru);
+		spin_unlock_irqrestore(&rrpc_debug->map_lock, flags);
+		clear_bit(idx, rrpc_debug->map_fault);
+
+		wake_up_all(&rrpc_debug->map_wait);
+		rrpc_debug_map_wake(rrpc_debug, idx);
+		if (wq_has_sleeper(&rrpc_debug->inflight_wait))
+			wake_up(&rrpc_debug->inflight_wait);
+	}
+
+	wake_up_all(&rrpc_debug->map_wait);
+}
+
+static void rrpc_debug_free_page_array(struct page **pages, int nr)
+{
+	int i;
+
+	if (!pages)
+		return;
+
+	for (i = 0; i < nr; i++)
+		if (pages[i])
+			__free_page(pages[i]);
+	kfree(pages);
+}
+
+static struct page **rrpc_debug_alloc_page_array(int nr)
+{
+	struct page **pages;
+	int i;
+
+	pages = kcalloc(nr, sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i]) {
+			rrpc_debug_free_page_array(pages, nr);
+			return NULL;
+		}
+	}
+
+	return pages;
+}
+
+static void rrpc_debug_map_cache_free(struct rrpc_debug *rrpc_debug)
+{
+	u64 i;
+
+	if (rrpc_debug->kmap_wq)
+		destroy_workqueue(rrpc_debug->kmap_wq);
+
+	if (rrpc_debug->tpages) {
+		for (i = 0; i < rrpc_debug->nr_cached; i++)
+			if (rrpc_debug->tpages[i].page)
+				__free_page(rrpc_debug->tpages[i].page);
+		vfree(rrpc_debug->tpages);
+	}
+
+	rrpc_debug_free_page_array(rrpc_debug->map_io, rrpc_debug->meta_chunk);
+	rrpc_debug_free_page_array(rrpc_debug->map_reloc,
+					rrpc_debug->dev->pgs_per_blk);
+	vfree(rrpc_debug->map_log_idx);
+	vfree(rrpc_debug->map_fault);
+	vfree(rrpc_debug->gtd);
+}
+
+/* take the log blocks from the media manager, none of them may be in use */
+static int rrpc_debug_map_claim(struct rrpc_debug *rrpc_debug)
+{
+	int blks = rrpc_debug->dev->blks_per_lun;
+	struct rrpc_debug_lun *rlun;
+	unsigned long *want;
+	int i, j, ret = 0;
+
+	want = kcalloc(BITS_TO_LONGS(blks), sizeof(unsigned long), GFP_KERNEL);
+	if (!want)
+		return -ENOMEM;
+
+	rrpc_debug_for_each_lun(rrpc_debug, rlun, i) {
+		for (j = 0; j < rrpc_debug->map_blks; j++)
+			set_bit(blks - 1 - j, want);
+
+		ret = rrpc_debug_claim_blks(rrpc_debug, rlun, want);
+		if (ret)
+			break;
+
+		if (!bitmap_empty(want, blks)) {
+			pr_err("nvm: rrpc_debug: translation log blocks of lun %d are in use\n",
+								rlun->parent->id);
+			ret = -EBUSY;
+			break;
+		}
+	}
+
+	kfree(want);
+	return ret;
+}
+
+/* Page the map when map_cache_pages is smaller than it. The log keeps every
+ * translation page twice, so a block entered holds half dead pages on
+ * average. The log does not outlive the target, the map is brought up from
+ * its usual sources every time. Only the logical to physical map is paged,
+ * the reverse map stays resident.
+ */
+static int rrpc_debug_map_cache_init(struct rrpc_debug *rrpc_debug)
+{
+	struct nvm_dev *dev = rrpc_debug->dev;
+	unsigned int pgs = dev->pgs_per_blk;
+	struct rrpc_debug_tpage *tp;
+	u64 i, nr_tpages;
+
+	spin_lock_init(&rrpc_debug->map_lock);
+	INIT_LIST_HEAD(&rrpc_debug->map_lru);
+	init_waitqueue_head(&rrpc_debug->map_wait);
+	INIT_WORK(&rrpc_debug->ws_map, rrpc_debug_map_work);
+	for (i = 0; i < RRPC_DEBUG_MAP_WAITERS; i++) {
+		bio_list_init(&rrpc_debug->map_waiters[i].bios);
+		spin_lock_init(&rrpc_debug->map_waiters[i].lock);
+	}
+	rrpc_debug->map_prefetch = map_prefetch;
+
+	nr_tpages = DIV_ROUND_UP_ULL(rrpc_debug->nr_pages,
+						RRPC_DEBUG_TPAGE_ENTRIES);
+
+	/* every lun bring-up worker pins a translation page at a time */
+	rrpc_debug->nr_cached = max_t(unsigned int, map_cache_pages,
+						2 * rrpc_debug->nr_luns + 16);
+	if (!map_cache_pages || rrpc_debug->nr_cached >= nr_tpages)
+		return 0;
+
+	rrpc_debug->map_blks = DIV_ROUND_UP_ULL(DIV_ROUND_UP_ULL(2 * nr_tpages,
+					pgs) + 1, rrpc_debug->nr_luns);
+	if (rrpc_debug->map_blks > dev->blks_per_lun / 4) {
+		pr_err("nvm: rrpc_debug: translation log does not fit the luns\n");
+		return -EINVAL;
+	}
+	rrpc_debug->map_log_pages = (u64)rrpc_debug->map_blks *
+						rrpc_debug->nr_luns * pgs;
+	rrpc_debug->nr_tpages = nr_tpages;
+
+	rrpc_debug->gtd = vmalloc(sizeof(struct rrpc_debug_gtd) * nr_tpages);
+	rrpc_debug->map_fault = vzalloc(BITS_TO_LONGS(nr_tpages) *
+						sizeof(unsigned long));
+	rrpc_debug->map_log_idx = vmalloc(sizeof(u64) *
+						rrpc_debug->map_log_pages);
+	rrpc_debug->tpages = vzalloc(sizeof(struct rrpc_debug_tpage) *
+						rrpc_debug->nr_cached);
+	rrpc_debug->map_io = rrpc_debug_alloc_page_array(rrpc_debug->meta_chunk);
+	rrpc_debug->map_reloc = rrpc_debug_alloc_page_array(pgs);
+	rrpc_debug->kmap_wq = alloc_ordered_workqueue("rrpc_debug-map",
+							WQ_MEM_RECLAIM);
+	if (!rrpc_debug->gtd || !rrpc_debug->map_fault ||
+	    !rrpc_debug->map_log_idx || !rrpc_debug->tpages ||
+	    !rrpc_debug->map_io || !rrpc_debug->map_reloc ||
+	    !rrpc_debug->kmap_wq)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_tpages; i++) {
+		rrpc_debug->gtd[i].log = ADDR_EMPTY;
+		rrpc_debug->gtd[i].tp = NULL;
+	}
+
+	for (i = 0; i < rrpc_debug->map_log_pages; i++)
+		rrpc_debug->map_log_idx[i] = ADDR_EMPTY;
+
+	for (i = 0; i < rrpc_debug->nr_cached; i++) {
+		tp = &rrpc_debug->tpages[i];
+		tp->page = alloc_page(GFP_KERNEL);
+		if (!tp->page)
+			return -ENOMEM;
+
+		tp->map = page_address(tp->page);
+		tp->idx = ADDR_EMPTY;
+		list_add_tail(&tp->list, &rrpc_debug->map_lru);
+	}
+
+	pr_info("nvm: rrpc_debug: %u of %llu translation pages cached, log in %u blocks per lun\n",
+			rrpc_debug->nr_cached, (unsigned long long)nr_tpages,
+			rrpc_debug->map_blks);
+
+	return rrpc_debug_map_claim(rrpc_debug);
+}
+
+/* Scan recovery */
+
+static void rrpc_debug_seq_max(atomic64_t *v, u64 seq)
+{
+	u64 old;
+
+	while ((old = atomic64_read(v)) < seq)
+		if (atomic64_cmpxchg(v, old, seq) == old)
+			break;
+}
+
+/* Read the oob tags of @nr pages from @paddr. If that fails the pages are
+ * read one by one, and those that still fail are set in @bad, from bit @off
+ * on. After RRPC_DEBUG_SCAN_HOLE failures in a row the rest is taken as
+ * unwritten too, and not read.
+ */
+static void rrpc_debug_scan_read(struct rrpc_debug *rrpc_debug, u64 paddr,
+			struct page **pages, int nr, void *oob, dma_addr_t dma_oob,
+			unsigned long *bad, int off)
+{
+	int i, hole = 0;
+
+	if (!rrpc_debug_meta_io(rrpc_debug, READ, paddr, pages, nr, oob,
+								dma_oob))
+		return;
+
+	for (i = 0; i < nr; i++) {
+		if (hole < RRPC_DEBUG_SCAN_HOLE &&
+		    !rrpc_debug_meta_io(rrpc_debug, READ, paddr + i, pages, 1,
+					oob + i * rrpc_debug->oob_size,
+					dma_oob + i * rrpc_debug->oob_size)) {
+			hole = 0;
+			continue;
+		}
+
+		set_bit(off + i, bad);
+		hole++;
+	}
+}
+
+/* Read the oob tags of the written pages of a lun. Each physical page
+ * records its logical page in the reverse map, and the newest sequence
+ * number of every logical page is kept. Blocks are written in order, so
+ * a block is read until RRPC_DEBUG_SCAN_HOLE pages in a row are unreadable;
+ * an unreadable page before the last tagged one was written and is lost.
+ * next_page holds how far it was tagged until its state is set up.
+ */
+static void rrpc_debug_scan_lun(struct work_struct *work)
+{
+	struct rrpc_debug_init_work *w = container_of(work,
+					struct rrpc_debug_init_work, ws);
+	struct rrpc_debug *rrpc_debug = w->rrpc_debug;
+	struct rrpc_debug_lun *rlun = &rrpc_debug->luns[w->part];
+	struct nvm_dev *dev = rrpc_debug->dev;
+	struct rrpc_debug_block *rblk;
+	struct rrpc_debug_oob *oob;
+	struct page **pages;
+	unsigned long *bad;
+	dma_addr_t dma_oob;
+	u64 paddr, laddr, seq, max_seq = 0;
+	int chunk, i, j, pg, n, hole;
+	void *oobs;
+
+	chunk = min3(dev->pgs_per_blk,
+			dev->max_rq_size / RRPC_DEBUG_EXPOSED_PAGE_SIZE,
+			(int)(PAGE_SIZE / rrpc_debug->oob_size));
+	chunk = clamp(chunk, 1, 64);
+
+	pages = kcalloc(chunk, sizeof(struct page *), GFP_KERNEL);
+	bad = kcalloc(BITS_TO_LONGS(dev->pgs_per_blk), sizeof(unsigned long),
+								GFP_KERNEL);
+	oobs = nvm_dev_dma_alloc(dev, GFP_KERNEL, &dma_oob);
+	if (!pages || !bad || !oobs) {
+		w->ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < chunk; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i]) {
+			w->ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < dev->blks_per_lun; i++) {
+		rblk = &rlun->blocks[i];
+		rblk->next_page = 0;
+
+		if (!w->part && i < rrpc_debug_ckpt_reserved(rrpc_debug))
+			continue;
 
-	bio_list_init(&bios);
+		if (i >= dev->blks_per_lun - rrpc_debug->map_blks)
+			continue;
 
-	spin_lock(&rrpc_debug->bio_lock);
-	bio_list_merge(&bios, &rrpc_debug->requeue_bios);
-	bio_list_init(&rrpc_debug->requeue_bios);
-	spin_unlock(&rrpc_debug->bio_lock);
+		bitmap_zero(bad, dev->pgs_per_blk);
+		hole = 0;
 
-	while ((bio = bio_list_pop(&bios)))
-		rrpc_debug_make_rq(rrpc_debug->disk->queue, bio);
-}
+		for (pg = 0; pg < dev->pgs_per_blk &&
+				hole < RRPC_DEBUG_SCAN_HOLE; pg += n) {
+			n = min(chunk, dev->pgs_per_blk - pg);
+			paddr = block_to_addr(rrpc_debug, rblk) + pg;
 
-static void rrpc_debug_gc_free(struct rrpc_debug *rrpc_debug)
-{
-	struct rrpc_debug_lun *rlun;
-	int i;
+			rrpc_debug_scan_read(rrpc_debug, paddr, pages, n,
+						oobs, dma_oob, bad, pg);
 
-	if (rrpc_debug->krqd_wq)
-		destroy_workqueue(rrpc_debug->krqd_wq);
+			for (j = 0; j < n; j++) {
+				if (test_bit(pg + j, bad)) {
+					hole++;
+					continue;
+				}
+				hole = 0;
 
-	if (rrpc_debug->kgc_wq)
-		destroy_workqueue(rrpc_debug->kgc_wq);
+				oob = oobs + j * rrpc_debug->oob_size;
+				laddr = le64_to_cpu(oob->laddr);
+				seq = le64_to_cpu(oob->seq);
 
-	if (!rrpc_debug->luns)
-		return;
+				/* untagged, or erased and read back as ones */
+				if (!seq || seq == U64_MAX)
+					continue;
 
-	for (i = 0; i < rrpc_debug->nr_luns; i++) {
-		rlun = &rrpc_debug->luns[i];
+				rblk->next_page = pg + j + 1;
+				max_seq = max(max_seq, seq);
 
-		if (!rlun->blocks)
-			break;
-		vfree(rlun->blocks);
+				if (laddr >= rrpc_debug->nr_pages)
+					continue;
+
+				rrpc_debug_rev(rrpc_debug, paddr + j)->addr = laddr;
+				rrpc_debug->scan_pseq[paddr + j -
+						rrpc_debug->poffset] = seq;
+				rrpc_debug_seq_max(&rrpc_debug->scan_lseq[laddr],
+									seq);
+			}
+		}
+
+		for_each_set_bit(j, bad, rblk->next_page)
+			pr_warn("nvm: rrpc_debug: page %llu unreadable, its data is lost\n",
+				(unsigned long long)(block_to_addr(rrpc_debug,
+								rblk) + j));
+		cond_resched();
+	}
+
+	rrpc_debug_seq_max(&rrpc_debug->oob_seq, max_seq);
+out:
+	if (pages) {
+		for (i = 0; i < chunk; i++)
+			if (pages[i])
+				__free_page(pages[i]);
+		kfree(pages);
 	}
+	kfree(bad);
+	if (oobs)
+		nvm_dev_dma_free(dev, oobs, dma_oob);
 }
 
-static int rrpc_debug_gc_init(struct rrpc_debug *rrpc_debug)
+/* map every logical page to its copy with the newest sequence number */
+static void rrpc_debug_scan_resolve(struct work_struct *work)
 {
-	rrpc_debug->krqd_wq = alloc_workqueue("rrpc_debug-lun", WQ_MEM_RECLAIM|WQ_UNBOUND,
-								rrpc_debug->nr_luns);
-	if (!rrpc_debug->krqd_wq)
-		return -ENOMEM;
+	struct rrpc_debug_init_work *w = container_of(work,
+					struct rrpc_debug_init_work, ws);
+	struct rrpc_debug *rrpc_debug = w->rrpc_debug;
+	struct rrpc_debug_lun *rlun = &rrpc_debug->luns[w->part];
+	struct rrpc_debug_block *rblk;
+	u64 paddr, laddr, idx;
+	int i, off;
 
-	rrpc_debug->kgc_wq = alloc_workqueue("rrpc_debug-bg", WQ_MEM_RECLAIM, 1);
-	if (!rrpc_debug->kgc_wq)
-		return -ENOMEM;
+	for (i = 0; i < rrpc_debug->dev->blks_per_lun; i++) {
+		rblk = &rlun->blocks[i];
 
-	setup_timer(&rrpc_debug->gc_timer, rrpc_debug_gc_timer, (unsigned long)rrpc_debug);
+		for (off = 0; off < rblk->next_page; off++) {
+			paddr = block_to_addr(rrpc_debug, rblk) + off;
+			idx = paddr - rrpc_debug->poffset;
+			laddr = rrpc_debug_rev(rrpc_debug, paddr)->addr;
 
-	return 0;
+			if (laddr != ADDR_EMPTY && rrpc_debug->scan_pseq[idx] ==
+				atomic64_read(&rrpc_debug->scan_lseq[laddr]))
+				rrpc_debug_map_set(rrpc_debug, laddr, paddr);
+		}
+	}
 }
 
-static void rrpc_debug_map_free(struct rrpc_debug *rrpc_debug)
+static int rrpc_debug_map_scan(struct rrpc_debug *rrpc_debug)
 {
-	vfree(rrpc_debug->rev_trans_map);
-	vfree(rrpc_debug->trans_map);
+	int ret = -ENOMEM;
+
+	rrpc_debug->scan_lseq = vzalloc(sizeof(atomic64_t) *
+						rrpc_debug->nr_pages);
+	rrpc_debug->scan_pseq = vzalloc(sizeof(u64) * rrpc_debug->nr_pages);
+	if (!rrpc_debug->scan_lseq || !rrpc_debug->scan_pseq)
+		goto out;
+
+	/* all luns are scanned before any copy is resolved */
+	ret = rrpc_debug_init_parallel(rrpc_debug, rrpc_debug_scan_lun);
+	if (ret)
+		goto out;
+
+	ret = rrpc_debug_init_parallel(rrpc_debug, rrpc_debug_scan_resolve);
+out:
+	vfree(rrpc_debug->scan_lseq);
+	vfree(rrpc_debug->scan_pseq);
+	rrpc_debug->scan_lseq = NULL;
+	rrpc_debug->scan_pseq = NULL;
+	return ret;
 }
 
-static int rrpc_debug_l2p_update(u64 slba, u32 nlb, __le64 *entries, void *private)
+/* blocks found written by the scan are taken from the media manager */
+static void rrpc_debug_scan_lun_blocks(struct work_struct *work)
 {
-	struct rrpc_debug *rrpc_debug = (struct rrpc_debug *)private;
-	struct nvm_dev *dev = rrpc_debug->dev;
-	struct rrpc_debug_addr *addr = rrpc_debug->trans_map + slba;
-	struct rrpc_debug_rev_addr *raddr = rrpc_debug->rev_trans_map;
-	sector_t max_pages = dev->total_pages * (dev->sec_size >> 9);
-	u64 elba = slba + nlb;
-	u64 i;
+	struct rrpc_debug_init_work *w = container_of(work,
+					struct rrpc_debug_init_work, ws);
+	struct rrpc_debug *rrpc_debug = w->rrpc_debug;
+	struct rrpc_debug_lun *rlun = &rrpc_debug->luns[w->part];
+	int blks = rrpc_debug->dev->blks_per_lun;
+	struct rrpc_debug_block *rblk;
+	unsigned long *want;
+	int i;
 
-	if (unlikely(elba > dev->total_pages)) {
-		pr_err("nvm: L2P data from device is out of bounds!\n");
-		return -EINVAL;
+	want = kcalloc(BITS_TO_LONGS(blks), sizeof(unsigned long), GFP_KERNEL);
+	if (!want) {
+		w->ret = -ENOMEM;
+		return;
 	}
 
-	for (i = 0; i < nlb; i++) {
-		u64 pba = le64_to_cpu(entries[i]);
-		/* LNVM treats address-spaces as silos, LBA and PBA are
-		 * equally large and zero-indexed.
-		 */
-		if (unlikely(pba >= max_pages && pba != U64_MAX)) {
-			pr_err("nvm: L2P data entry is out of bounds!\n");
-			return -EINVAL;
-		}
-
-		/* Address zero is a special one. The first page on a disk is
-		 * protected. As it often holds internal device boot
-		 * information.
-		 */
-		if (!pba)
+	for (i = 0; i < blks; i++) {
+		rblk = &rlun->blocks[i];
+		if (!rblk->next_page)
 			continue;
 
-		addr[i].addr = pba;
-		raddr[pba].addr = slba + i;
+		set_bit(i, want);
+		rrpc_debug_adopt_blk(rrpc_debug, rblk);
 	}
 
-	return 0;
+	w->ret = rrpc_debug_claim_blks(rrpc_debug, rlun, want);
+	kfree(want);
 }
 
 static int rrpc_debug_map_init(struct rrpc_debug *rrpc_debug)
 {
 	struct nvm_dev *dev = rrpc_debug->dev;
-	sector_t i;
 	int ret;
 
-	rrpc_debug->trans_map = vzalloc(sizeof(struct rrpc_debug_addr) * rrpc_debug->nr_pages);
-	if (!rrpc_debug->trans_map)
-		return -ENOMEM;
+	ret = rrpc_debug_map_cache_init(rrpc_debug);
+	if (ret)
+		return ret;
+
+	if (!rrpc_debug->gtd) {
+		rrpc_debug->trans_map = rrpc_debug_parts_alloc(rrpc_debug,
+					sizeof(struct rrpc_debug_addr), 0);
+		if (!rrpc_debug->trans_map)
+			return -ENOMEM;
+	}
 
-	rrpc_debug->rev_trans_map = vmalloc(sizeof(struct rrpc_debug_rev_addr)
-							* rrpc_debug->nr_pages);
+	rrpc_debug->rev_trans_map = rrpc_debug_parts_alloc(rrpc_debug,
+					sizeof(struct rrpc_debug_rev_addr), 1);
 	if (!rrpc_debug->rev_trans_map)
 		return -ENOMEM;
 
-	for (i = 0; i < rrpc_debug->nr_pages; i++) {
-		struct rrpc_debug_addr *p = &rrpc_debug->trans_map[i];
-		struct rrpc_debug_rev_addr *r = &rrpc_debug->rev_trans_map[i];
+	rrpc_debug->heat = vzalloc(sizeof(struct rrpc_debug_heat) *
+		((rrpc_debug->nr_pages >> RRPC_DEBUG_HEAT_SHIFT) + 1));
+	if (!rrpc_debug->heat)
+		return -ENOMEM;
 
-		p->addr = ADDR_EMPTY;
-		r->addr = ADDR_EMPTY;
+	/* every entry must be cleared before any is imported */
+	ret = rrpc_debug_init_parallel(rrpc_debug, rrpc_debug_map_clear);
+	if (ret)
+		return ret;
+
+	/* a checkpoint is newer than the map kept by the device */
+	ret = rrpc_debug_ckpt_load(rrpc_debug);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	if (rrpc_debug->map_scan) {
+		ret = rrpc_debug_map_scan(rrpc_debug);
+		if (ret)
+			pr_err("nvm: rrpc_debug: could not scan oob metadata.\n");
+		return ret;
 	}
 
 	if (!dev->ops->get_l2p_tbl)
 		return 0;
 
 	/* Bring up the mapping table from device */
-	ret = dev->ops->get_l2p_tbl(dev, 0, dev->total_pages,
-							rrpc_debug_l2p_update, rrpc_debug);
+	ret = rrpc_debug_init_parallel(rrpc_debug, rrpc_debug_map_import);
 	if (ret) {
 		pr_err("nvm: rrpc_debug: could not read L2P table.\n");
 		return -EINVAL;
@@ -1041,8 +5292,76 @@ static int rrpc_debug_map_init(struct rrpc_debug *rrpc_debug)
 #define PAGE_POOL_SIZE 16
 #define ADDR_POOL_SIZE 64
 
+static void rrpc_debug_rq_set_free(struct rrpc_debug *rrpc_debug,
+					struct rrpc_debug_rq_set *set)
+{
+	struct rrpc_debug_rq *rrqd;
+	int i;
+
+	if (!set->rqs)
+		return;
+
+	for (i = 0; i < set->nr && set->rqs[i]; i++) {
+		rrqd = nvm_rq_to_pdu(set->rqs[i]);
+		if (rrqd->dma_buf)
+			nvm_dev_dma_free(rrpc_debug->dev, rrqd->dma_buf,
+							rrqd->dma_buf_addr);
+		kmem_cache_free(rrpc_debug_rq_cache, set->rqs[i]);
+	}
+
+	percpu_ida_destroy(&set->tags);
+	kfree(set->rqs);
+
+	set->rqs = NULL;
+	set->nr = 0;
+}
+
+/* @nr requests, of which a cpu caches up to @cpu_tags free tags */
+static int rrpc_debug_rq_set_init(struct rrpc_debug *rrpc_debug,
+			struct rrpc_debug_rq_set *set, unsigned int nr,
+			unsigned int cpu_tags)
+{
+	struct rrpc_debug_rq *rrqd;
+	struct nvm_rq *rqd;
+	int i;
+
+	set->rqs = kcalloc(nr, sizeof(struct nvm_rq *), GFP_KERNEL);
+	if (!set->rqs)
+		return -ENOMEM;
+
+	if (__percpu_ida_init(&set->tags, nr, cpu_tags,
+					max(cpu_tags / 2, 1U))) {
+		kfree(set->rqs);
+		set->rqs = NULL;
+		return -ENOMEM;
+	}
+	set->nr = nr;
+
+	for (i = 0; i < nr; i++) {
+		rqd = kmem_cache_alloc(rrpc_debug_rq_cache, GFP_KERNEL);
+		if (!rqd)
+			goto err;
+		set->rqs[i] = rqd;
+
+		rrqd = nvm_rq_to_pdu(rqd);
+		rrqd->set = set;
+		rrqd->tag = i;
+		rrqd->dma_buf = nvm_dev_dma_alloc(rrpc_debug->dev, GFP_KERNEL,
+							&rrqd->dma_buf_addr);
+		if (!rrqd->dma_buf)
+			goto err;
+	}
+
+	return 0;
+err:
+	rrpc_debug_rq_set_free(rrpc_debug, set);
+	return -ENOMEM;
+}
+
 static int rrpc_debug_core_init(struct rrpc_debug *rrpc_debug)
 {
+	int i, ret;
+
 	down_write(&rrpc_debug_lock);
 	if (!rrpc_debug_gcb_cache) {
 		rrpc_debug_gcb_cache = kmem_cache_create("rrpc_debug_gcb",
@@ -1063,7 +5382,19 @@ static int rrpc_debug_core_init(struct rrpc_debug *rrpc_debug)
 	}
 	up_write(&rrpc_debug_lock);
 
-	rrpc_debug->page_pool = mempool_create_page_pool(PAGE_POOL_SIZE, 0);
+	rrpc_debug->gc_batch = clamp_t(unsigned int, gc_batch_pages, 1,
+						RRPC_DEBUG_GC_MAX_BATCH);
+	rrpc_debug->gc_batch = min_t(unsigned int, rrpc_debug->gc_batch,
+		max(rrpc_debug->dev->max_rq_size / RRPC_DEBUG_EXPOSED_PAGE_SIZE, 1));
+	rrpc_debug->gc_qd = clamp_t(unsigned int, gc_queue_depth, 1,
+						RRPC_DEBUG_GC_MAX_QD);
+
+	/* GC holds every page of its pipeline until the writes complete. The
+	 * reserve keeps one pipeline going, the others only take what is
+	 * left, see rrpc_debug_gc_fill.
+	 */
+	rrpc_debug->page_pool = mempool_create_page_pool(max_t(unsigned int,
+			PAGE_POOL_SIZE, rrpc_debug->gc_batch * rrpc_debug->gc_qd), 0);
 	if (!rrpc_debug->page_pool)
 		return -ENOMEM;
 
@@ -1076,14 +5407,45 @@ static int rrpc_debug_core_init(struct rrpc_debug *rrpc_debug)
 	if (!rrpc_debug->rq_pool)
 		return -ENOMEM;
 
-	spin_lock_init(&rrpc_debug->inflights.lock);
-	INIT_LIST_HEAD(&rrpc_debug->inflights.reqs);
+	/* internal I/O: one GC pipeline, flushes of every write buffer unit
+	 * and read-ahead of every stream at once. Pipelines of further luns
+	 * fall back to rq_pool.
+	 */
+	ret = rrpc_debug_rq_set_init(rrpc_debug, &rrpc_debug->int_rqs,
+			rrpc_debug->gc_qd + RRPC_DEBUG_RA_STREAMS +
+			rrpc_debug->nr_luns * RRPC_DEBUG_WB_UNITS, 2);
+	if (ret)
+		return ret;
+
+	/* Each request holds a DMA pool buffer. Sized for the cpus online at
+	 * init; cpus onlined later take tags from the others' caches.
+	 */
+	if (queue_depth) {
+		ret = rrpc_debug_rq_set_init(rrpc_debug, &rrpc_debug->user_rqs,
+				min_t(unsigned int, queue_depth * num_online_cpus(),
+						RRPC_DEBUG_MAX_USER_RQS),
+				min_t(unsigned int, queue_depth,
+						RRPC_DEBUG_MAX_USER_RQS));
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < RRPC_DEBUG_INFLIGHT_BUCKETS; i++) {
+		struct rrpc_debug_inflight_bucket *b =
+					&rrpc_debug->inflights.buckets[i];
+
+		spin_lock_init(&b->lock);
+		INIT_LIST_HEAD(&b->reqs);
+		bio_list_init(&b->waiters);
+	}
 
 	return 0;
 }
 
 static void rrpc_debug_core_free(struct rrpc_debug *rrpc_debug)
 {
+	rrpc_debug_rq_set_free(rrpc_debug, &rrpc_debug->user_rqs);
+	rrpc_debug_rq_set_free(rrpc_debug, &rrpc_debug->int_rqs);
 	mempool_destroy(rrpc_debug->page_pool);
 	mempool_destroy(rrpc_debug->gcb_pool);
 	mempool_destroy(rrpc_debug->rq_pool);
@@ -1091,16 +5453,50 @@ static void rrpc_debug_core_free(struct rrpc_debug *rrpc_debug)
 
 static void rrpc_debug_luns_free(struct rrpc_debug *rrpc_debug)
 {
+	kfree(rrpc_debug->lun_order);
 	kfree(rrpc_debug->luns);
 }
 
+/* order luns by their position within the channel first, so that walking
+ * the order visits every channel before coming back to one
+ */
+static int rrpc_debug_lun_order_cmp(const void *a, const void *b)
+{
+	const struct nvm_lun *la = (*(struct rrpc_debug_lun **)a)->parent;
+	const struct nvm_lun *lb = (*(struct rrpc_debug_lun **)b)->parent;
+
+	if (la->lun_id != lb->lun_id)
+		return la->lun_id - lb->lun_id;
+
+	return la->chnl_id - lb->chnl_id;
+}
+
+/* In affinity mode the lun at @order in lun_order is written by the cpus
+ * of its group, its maps and GC are kept on their node. Otherwise they are
+ * kept on the node of the device.
+ */
+static int rrpc_debug_lun_node(struct rrpc_debug *rrpc_debug, int order)
+{
+	int groups = rrpc_debug->nr_lun_groups;
+	int cpu;
+
+	if (rrpc_debug->lun_affinity)
+		for_each_online_cpu(cpu)
+			if (cpu % groups == order % groups)
+				return cpu_to_node(cpu);
+
+	return rrpc_debug->dev->q->node;
+}
+
 static int rrpc_debug_luns_init(struct rrpc_debug *rrpc_debug, int lun_begin, int lun_end)
 {
 	struct nvm_dev *dev = rrpc_debug->dev;
 	struct rrpc_debug_lun *rlun;
+	unsigned int prog, stripe;
 	int i, j;
 
-	spin_lock_init(&rrpc_debug->rev_lock);
+	rrpc_debug->free_tree = RB_ROOT;
+	spin_lock_init(&rrpc_debug->free_lock);
 
 	rrpc_debug->luns = kcalloc(rrpc_debug->nr_luns, sizeof(struct rrpc_debug_lun),
 								GFP_KERNEL);
@@ -1120,9 +5516,11 @@ static int rrpc_debug_luns_init(struct rrpc_debug *rrpc_debug, int lun_begin, in
 		rlun = &rrpc_debug->luns[i];
 		rlun->rrpc_debug = rrpc_debug;
 		rlun->parent = lun;
-		INIT_LIST_HEAD(&rlun->prio_list);
+		RB_CLEAR_NODE(&rlun->free_node);
+		INIT_LIST_HEAD(&rlun->age_list);
 		INIT_WORK(&rlun->ws_gc, rrpc_debug_lun_gc);
 		spin_lock_init(&rlun->lock);
+		spin_lock_init(&rlun->rev_lock);
 
 		rrpc_debug->total_blocks += dev->blks_per_lun;
 		rrpc_debug->nr_pages += dev->sec_per_lun;
@@ -1132,28 +5530,186 @@ static int rrpc_debug_luns_init(struct rrpc_debug *rrpc_debug, int lun_begin, in
 		if (!rlun->blocks)
 			goto err;
 
+		rlun->prio_buckets = kcalloc(dev->pgs_per_blk + 1,
+					sizeof(struct list_head), GFP_KERNEL);
+		if (!rlun->prio_buckets)
+			goto err;
+
+		for (j = 0; j <= dev->pgs_per_blk; j++)
+			INIT_LIST_HEAD(&rlun->prio_buckets[j]);
+
 		for (j = 0; j < rrpc_debug->dev->blks_per_lun; j++) {
 			struct rrpc_debug_block *rblk = &rlun->blocks[j];
 			struct nvm_block *blk = &lun->blocks[j];
 
 			rblk->parent = blk;
+			rblk->rlun = rlun;
 			INIT_LIST_HEAD(&rblk->prio);
+			INIT_LIST_HEAD(&rblk->age);
 			spin_lock_init(&rblk->lock);
 		}
 	}
 
+	rrpc_debug->lun_order = kcalloc(rrpc_debug->nr_luns,
+				sizeof(struct rrpc_debug_lun *), GFP_KERNEL);
+	if (!rrpc_debug->lun_order)
+		goto err;
+
+	rrpc_debug_for_each_lun(rrpc_debug, rlun, i)
+		rrpc_debug->lun_order[i] = rlun;
+
+	sort(rrpc_debug->lun_order, rrpc_debug->nr_luns,
+			sizeof(struct rrpc_debug_lun *), rrpc_debug_lun_order_cmp, NULL);
+
+	for (i = 0; i < rrpc_debug->nr_luns; i++)
+		rrpc_debug->lun_order[i]->node = rrpc_debug_lun_node(rrpc_debug, i);
+
+	/* whole program units, no more than a request holds */
+	prog = rrpc_debug->prog_pages;
+	stripe = max_t(unsigned int, dev->max_rq_size /
+					RRPC_DEBUG_EXPOSED_PAGE_SIZE, prog);
+	stripe = clamp_t(unsigned int, stripe_pages ? stripe_pages : prog,
+								prog, stripe);
+	rrpc_debug->stripe_pages = rounddown(stripe, prog);
+
 	return 0;
 err:
 	return -ENOMEM;
 }
 
+static void rrpc_debug_lun_stats_sum(struct rrpc_debug *rrpc_debug, int lun,
+					struct rrpc_debug_lun_stats *sum)
+{
+	struct rrpc_debug_lun_stats *st;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(rrpc_debug->lun_stats, cpu);
+		for (i = 0; i < RRPC_DEBUG_NR_STATS; i++)
+			sum->cnt[i] += st[lun].cnt[i];
+	}
+}
+
+static int rrpc_debug_luns_show(struct seq_file *s, void *data)
+{
+	struct rrpc_debug *rrpc_debug = s->private;
+	struct rrpc_debug_lun_stats sum;
+	struct rrpc_debug_lun *rlun;
+	u64 user, gc, wa;
+	int i;
+
+	seq_puts(s, "lun user_pages gc_pages erases requeues free_blocks wa\n");
+
+	rrpc_debug_for_each_lun(rrpc_debug, rlun, i) {
+		rrpc_debug_lun_stats_sum(rrpc_debug, i, &sum);
+		user = sum.cnt[RRPC_DEBUG_STAT_USER_PAGES];
+		gc = sum.cnt[RRPC_DEBUG_STAT_GC_PAGES];
+		wa = user ? div64_u64((user + gc) * 1000, user) : 0;
+
+		seq_printf(s, "%d %llu %llu %llu %llu %u %llu.%03llu\n",
+			rlun->parent->id, user, gc,
+			sum.cnt[RRPC_DEBUG_STAT_ERASES],
+			sum.cnt[RRPC_DEBUG_STAT_REQUEUES],
+			rlun->parent->nr_free_blocks,
+			div_u64(wa, 1000), wa - div_u64(wa, 1000) * 1000);
+	}
+
+	rrpc_debug_lun_stats_sum(rrpc_debug, rrpc_debug->nr_luns, &sum);
+	seq_printf(s, "unmapped requeues %llu\n",
+				sum.cnt[RRPC_DEBUG_STAT_REQUEUES]);
+
+	return 0;
+}
+
+static int rrpc_debug_latency_show(struct seq_file *s, void *data)
+{
+	static const char * const names[RRPC_DEBUG_NR_LAT] = {
+		[RRPC_DEBUG_LAT_READ]	= "read",
+		[RRPC_DEBUG_LAT_WRITE]	= "write",
+		[RRPC_DEBUG_LAT_GC]	= "gc",
+	};
+	struct rrpc_debug *rrpc_debug = s->private;
+	int type, b, cpu;
+	u64 n;
+
+	for (type = 0; type < RRPC_DEBUG_NR_LAT; type++) {
+		seq_printf(s, "%s\n", names[type]);
+
+		for (b = 0; b < RRPC_DEBUG_LAT_BUCKETS; b++) {
+			n = 0;
+			for_each_possible_cpu(cpu)
+				n += per_cpu_ptr(rrpc_debug->lat, cpu)->bucket[type][b];
+			if (!n)
+				continue;
+
+			if (!b)
+				seq_printf(s, "  <1us %llu\n", n);
+			else
+				seq_printf(s, "  >=%lluus %llu\n", 1ULL << (b - 1), n);
+		}
+	}
+
+	return 0;
+}
+
+static int rrpc_debug_luns_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rrpc_debug_luns_show, inode->i_private);
+}
+
+static int rrpc_debug_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rrpc_debug_latency_show, inode->i_private);
+}
+
+static const struct file_operations rrpc_debug_luns_fops = {
+	.owner		= THIS_MODULE,
+	.open		= rrpc_debug_luns_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations rrpc_debug_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= rrpc_debug_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* statistics are best effort, the target works without them */
+static void rrpc_debug_debugfs_init(struct rrpc_debug *rrpc_debug)
+{
+	if (IS_ERR_OR_NULL(rrpc_debug_debugfs_root))
+		return;
+
+	rrpc_debug->debugfs = debugfs_create_dir(rrpc_debug->disk->disk_name,
+						rrpc_debug_debugfs_root);
+	if (IS_ERR_OR_NULL(rrpc_debug->debugfs))
+		return;
+
+	debugfs_create_file("luns", 0444, rrpc_debug->debugfs, rrpc_debug,
+							&rrpc_debug_luns_fops);
+	debugfs_create_file("latency", 0444, rrpc_debug->debugfs, rrpc_debug,
+							&rrpc_debug_latency_fops);
+}
+
 static void rrpc_debug_free(struct rrpc_debug *rrpc_debug)
 {
+	debugfs_remove_recursive(rrpc_debug->debugfs);
 	rrpc_debug_gc_free(rrpc_debug);
+	rrpc_debug_wb_free(rrpc_debug);
+	rrpc_debug_rc_free(rrpc_debug);
 	rrpc_debug_map_free(rrpc_debug);
+	rrpc_debug_ckpt_free(rrpc_debug);
 	rrpc_debug_core_free(rrpc_debug);
 	rrpc_debug_luns_free(rrpc_debug);
 
+	free_percpu(rrpc_debug->lat);
+	free_percpu(rrpc_debug->lun_stats);
+	free_percpu(rrpc_debug->lun_cursor);
 	kfree(rrpc_debug);
 }
 
@@ -1161,11 +5717,20 @@ static void rrpc_debug_exit(void *private)
 {
 	struct rrpc_debug *rrpc_debug = private;
 
+	rrpc_debug_wb_flush(rrpc_debug, 1);
+	del_timer_sync(&rrpc_debug->wb_timer);
 	del_timer(&rrpc_debug->gc_timer);
 
 	flush_workqueue(rrpc_debug->krqd_wq);
 	flush_workqueue(rrpc_debug->kgc_wq);
 
+	if (rrpc_debug->ckpt_pages) {
+		cancel_delayed_work_sync(&rrpc_debug->ws_ckpt);
+		flush_workqueue(rrpc_debug->kmeta_wq);
+		rrpc_debug_ckpt_write(rrpc_debug);
+		flush_workqueue(rrpc_debug->kjnl_wq);
+	}
+
 	rrpc_debug_free(rrpc_debug);
 }
 
@@ -1185,64 +5750,116 @@ static sector_t rrpc_debug_capacity(void *private)
  * comparing the logical to physical address with the physical address.
  * Returns 0 on free, otherwise 1 if in use
  */
-static void rrpc_debug_block_map_update(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
+/* returns the offset of the last valid page of @rblk, -1 if there is none */
+static int rrpc_debug_block_map_update(struct rrpc_debug *rrpc_debug, struct rrpc_debug_block *rblk)
 {
 	struct nvm_dev *dev = rrpc_debug->dev;
-	int offset;
-	struct rrpc_debug_addr *laddr;
+	int offset, last = -1;
 	u64 paddr, pladdr;
 
 	for (offset = 0; offset < dev->pgs_per_blk; offset++) {
 		paddr = block_to_addr(rrpc_debug, rblk) + offset;
 
-		pladdr = rrpc_debug->rev_trans_map[paddr].addr;
+		pladdr = rrpc_debug_rev(rrpc_debug, paddr)->addr;
 		if (pladdr == ADDR_EMPTY)
 			continue;
 
-		laddr = &rrpc_debug->trans_map[pladdr];
-
-		if (paddr == laddr->addr) {
-			laddr->rblk = rblk;
-		} else {
+		if (paddr != rrpc_debug_map_get(rrpc_debug, pladdr)) {
 			set_bit(offset, rblk->invalid_pages);
 			rblk->nr_invalid_pages++;
+		} else {
+			last = offset;
 		}
 	}
+
+	return last;
 }
 
-static int rrpc_debug_blocks_init(struct rrpc_debug *rrpc_debug)
+/* Without a checkpoint or a scan, the sequence numbers of new oob tags go on
+ * from the newest found on the lun: that of the last valid page of every
+ * block, as blocks are written in order. Pages written after it were
+ * invalidated since, the skip covers them.
+ */
+static void rrpc_debug_lun_blocks_init(struct work_struct *work)
 {
-	struct rrpc_debug_lun *rlun;
+	struct rrpc_debug_init_work *w = container_of(work,
+					struct rrpc_debug_init_work, ws);
+	struct rrpc_debug *rrpc_debug = w->rrpc_debug;
+	struct rrpc_debug_lun *rlun = &rrpc_debug->luns[w->part];
 	struct rrpc_debug_block *rblk;
-	int lun_iter, blk_iter;
-
-	for (lun_iter = 0; lun_iter < rrpc_debug->nr_luns; lun_iter++) {
-		rlun = &rrpc_debug->luns[lun_iter];
+	struct rrpc_debug_oob *oob = NULL;
+	struct page *page = NULL;
+	dma_addr_t dma_oob;
+	u64 seq, max_seq = 0;
+	int blk_iter, last;
+
+	if (rrpc_debug->oob_size) {
+		page = alloc_page(GFP_KERNEL);
+		oob = nvm_dev_dma_alloc(rrpc_debug->dev, GFP_KERNEL, &dma_oob);
+		if (!page || !oob) {
+			w->ret = -ENOMEM;
+			goto out;
+		}
+	}
 
-		for (blk_iter = 0; blk_iter < rrpc_debug->dev->blks_per_lun;
-								blk_iter++) {
-			rblk = &rlun->blocks[blk_iter];
-			rrpc_debug_block_map_update(rrpc_debug, rblk);
+	for (blk_iter = 0; blk_iter < rrpc_debug->dev->blks_per_lun; blk_iter++) {
+		rblk = &rlun->blocks[blk_iter];
+		last = rrpc_debug_block_map_update(rrpc_debug, rblk);
+
+		if (oob && last >= 0 &&
+		    !rrpc_debug_meta_io(rrpc_debug, READ,
+				block_to_addr(rrpc_debug, rblk) + last,
+				&page, 1, oob, dma_oob)) {
+			seq = le64_to_cpu(oob->seq);
+			if (seq != U64_MAX)
+				max_seq = max(max_seq, seq);
 		}
+		cond_resched();
 	}
 
-	return 0;
+	if (max_seq)
+		rrpc_debug_seq_max(&rrpc_debug->oob_seq,
+					max_seq + RRPC_DEBUG_OOB_SEQ_SKIP);
+out:
+	if (page)
+		__free_page(page);
+	if (oob)
+		nvm_dev_dma_free(rrpc_debug->dev, oob, dma_oob);
+}
+
+/* the blocks of a lun are only touched by the partition of that lun */
+static int rrpc_debug_blocks_init(struct rrpc_debug *rrpc_debug)
+{
+	int ret;
+
+	if (rrpc_debug->ckpt_loaded)
+		return rrpc_debug_ckpt_blocks_init(rrpc_debug);
+
+	ret = rrpc_debug_init_parallel(rrpc_debug, rrpc_debug->map_scan ?
+					rrpc_debug_scan_lun_blocks :
+					rrpc_debug_lun_blocks_init);
+	if (ret || !rrpc_debug->ckpt_pages)
+		return ret;
+
+	return rrpc_debug_ckpt_fresh(rrpc_debug);
 }
 
 static int rrpc_debug_luns_configure(struct rrpc_debug *rrpc_debug)
 {
 	struct rrpc_debug_lun *rlun;
 	struct rrpc_debug_block *rblk;
-	int i;
+	int i, stream;
 
 	for (i = 0; i < rrpc_debug->nr_luns; i++) {
 		rlun = &rrpc_debug->luns[i];
 
-		rblk = rrpc_debug_get_blk(rrpc_debug, rlun, 0);
-		if (!rblk)
-			return -EINVAL;
+		for (stream = 0; stream < RRPC_DEBUG_NR_STREAMS; stream++) {
+			rblk = rrpc_debug_get_blk(rrpc_debug, rlun, 0);
+			if (!rblk)
+				return -EINVAL;
 
-		rrpc_debug_set_lun_cur(rlun, rblk);
+			rrpc_debug_set_lun_cur(rlun, stream, rblk);
+		}
 
 		/* Emergency gc block */
 		rblk = rrpc_debug_get_blk(rrpc_debug, rlun, 1);
@@ -1262,16 +5879,11 @@ static void *rrpc_debug_init(struct nvm_dev *dev, struct gendisk *tdisk,
 	struct request_queue *bqueue = dev->q;
 	struct request_queue *tqueue = tdisk->queue;
 	struct rrpc_debug *rrpc_debug;
-	int ret;
+	u64 start = ktime_get_ns();
+	int cpu, ret;
 
 	printk(KERN_INFO "target_init\n");
 
-	if (!(dev->identity.dom & NVM_RSP_L2P)) {
-		pr_err("nvm: rrpc_debug: device does not support l2p (%x)\n",
-							dev->identity.dom);
-		return ERR_PTR(-EINVAL);
-	}
-
 	rrpc_debug = kzalloc(sizeof(struct rrpc_debug), GFP_KERNEL);
 	if (!rrpc_debug)
 		return ERR_PTR(-ENOMEM);
@@ -1281,13 +5893,54 @@ static void *rrpc_debug_init(struct nvm_dev *dev, struct gendisk *tdisk,
 	rrpc_debug->disk = tdisk;
 
 	bio_list_init(&rrpc_debug->requeue_bios);
+	bio_list_init(&rrpc_debug->nospace_bios);
 	spin_lock_init(&rrpc_debug->bio_lock);
 	INIT_WORK(&rrpc_debug->ws_requeue, rrpc_debug_requeue);
+	atomic_set(&rrpc_debug->free_seq, 0);
+	init_waitqueue_head(&rrpc_debug->inflight_wait);
+
+	/* every oob area of a vector command fits a DMA buffer */
+	if (dev->oob_size >= sizeof(struct rrpc_debug_oob) &&
+	    dev->oob_size * 64 <= PAGE_SIZE)
+		rrpc_debug->oob_size = dev->oob_size;
+	atomic64_set(&rrpc_debug->oob_seq, 0);
+
+	/* without an L2P table the map is rebuilt from the oob tags */
+	if (!(dev->identity.dom & NVM_RSP_L2P) && !rrpc_debug->oob_size) {
+		pr_err("nvm: rrpc_debug: device supports neither l2p nor oob metadata (%x)\n",
+							dev->identity.dom);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	rrpc_debug->map_scan = rrpc_debug->oob_size && (scan_recovery ||
+				!(dev->identity.dom & NVM_RSP_L2P) ||
+				!dev->ops->get_l2p_tbl);
 
 	rrpc_debug->nr_luns = lun_end - lun_begin + 1;
 
-	/* simple round-robin strategy */
-	atomic_set(&rrpc_debug->next_lun, -1);
+	rrpc_debug->gc_policy = rrpc_debug_gc_policy_get(gc_policy);
+	if (!rrpc_debug->gc_policy) {
+		pr_err("nvm: rrpc_debug: unknown gc policy '%s'\n", gc_policy);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	/* simple round-robin strategy, one cursor per cpu */
+	rrpc_debug->lun_cursor = alloc_percpu(unsigned int);
+	if (!rrpc_debug->lun_cursor) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(rrpc_debug->lun_cursor, cpu) = cpu - 1;
+
+	rrpc_debug->lun_affinity = lun_affinity;
+	rrpc_debug->nr_lun_groups = min_t(int, num_online_cpus(),
+							rrpc_debug->nr_luns);
+
+	rrpc_debug_geo_init(rrpc_debug);
 
 	ret = rrpc_debug_luns_init(rrpc_debug, lun_begin, lun_end);
 	if (ret) {
@@ -1295,6 +5948,15 @@ static void *rrpc_debug_init(struct nvm_dev *dev, struct gendisk *tdisk,
 		goto err;
 	}
 
+	rrpc_debug->lun_stats = __alloc_percpu(sizeof(struct rrpc_debug_lun_stats) *
+				(rrpc_debug->nr_luns + 1),
+				__alignof__(struct rrpc_debug_lun_stats));
+	rrpc_debug->lat = alloc_percpu(struct rrpc_debug_lat_hist);
+	if (!rrpc_debug->lun_stats || !rrpc_debug->lat) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
 	rrpc_debug->poffset = dev->sec_per_lun * lun_begin;
 	rrpc_debug->lun_offset = lun_begin;
 
@@ -1304,6 +5966,12 @@ static void *rrpc_debug_init(struct nvm_dev *dev, struct gendisk *tdisk,
 		goto err;
 	}
 
+	ret = rrpc_debug_ckpt_init(rrpc_debug);
+	if (ret) {
+		pr_err("nvm: rrpc_debug: could not initialize checkpoints\n");
+		goto err;
+	}
+
 	ret = rrpc_debug_map_init(rrpc_debug);
 	if (ret) {
 		pr_err("nvm: rrpc_debug: could not initialize maps\n");
@@ -1328,12 +5996,41 @@ static void *rrpc_debug_init(struct nvm_dev *dev, struct gendisk *tdisk,
 		goto err;
 	}
 
+	ret = rrpc_debug_wb_init(rrpc_debug);
+	if (ret) {
+		pr_err("nvm: rrpc_debug: could not initialize write buffer\n");
+		goto err;
+	}
+
+	ret = rrpc_debug_rc_init(rrpc_debug);
+	if (ret) {
+		pr_err("nvm: rrpc_debug: could not initialize read cache\n");
+		goto err;
+	}
+
 	/* inherit the size from the underlying device */
 	blk_queue_logical_block_size(tqueue, queue_physical_block_size(bqueue));
 	blk_queue_max_hw_sectors(tqueue, queue_max_hw_sectors(bqueue));
 
-	pr_info("nvm: rrpc_debug initialized with %u luns and %llu pages.\n",
-			rrpc_debug->nr_luns, (unsigned long long)rrpc_debug->nr_pages);
+	/* buffered writes and journaled mappings are only durable after a
+	 * flush
+	 */
+	if (rrpc_debug->wb_pages || rrpc_debug->ckpt_pages)
+		blk_queue_flush(tqueue, REQ_FLUSH | REQ_FUA);
+
+	/* the first checkpoint covers the state found at bring-up, later
+	 * ones run on the ordered metadata workqueue
+	 */
+	if (rrpc_debug->ckpt_pages) {
+		mod_delayed_work(rrpc_debug->kmeta_wq, &rrpc_debug->ws_ckpt, 0);
+		flush_delayed_work(&rrpc_debug->ws_ckpt);
+	}
+
+	pr_info("nvm: rrpc_debug initialized with %u luns and %llu pages in %llu ms.\n",
+			rrpc_debug->nr_luns, (unsigned long long)rrpc_debug->nr_pages,
+			div_u64(ktime_get_ns() - start, NSEC_PER_MSEC));
+
+	rrpc_debug_debugfs_init(rrpc_debug);
 
 	mod_timer(&rrpc_debug->gc_timer, jiffies + msecs_to_jiffies(10));
 
@@ -1358,14 +6055,26 @@ static struct nvm_tgt_type tt_rrpc_debug = {
 
 static int __init rrpc_debug_module_init(void)
 {
+	int ret;
+
 	printk(KERN_INFO "init");
-	return nvm_register_target(&tt_rrpc_debug);
+
+	rrpc_debug_debugfs_root = debugfs_create_dir("rrpc_debug", NULL);
+
+	ret = nvm_register_target(&tt_rrpc_debug);
+	if (ret) {
+		debugfs_remove_recursive(rrpc_debug_debugfs_root);
+		return ret;
+	}
+
 	printk(KERN_INFO "init_ok");
+	return 0;
 }
 
 static void rrpc_debug_module_exit(void)
 {
 	nvm_unregister_target(&tt_rrpc_debug);
+	debugfs_remove_recursive(rrpc_debug_debugfs_root);
 }
 
 module_init(rrpc_debug_module_init);
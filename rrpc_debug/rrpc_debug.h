@@ -23,6 +23,15 @@
 #include <linux/module.h>
 #include <linux/kthread.h>
 #include <linux/vmalloc.h>
+#include <linux/rbtree.h>
+#include <linux/radix-tree.h>
+#include <linux/highmem.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu_ida.h>
+#include <linux/crc32.h>
+#include <linux/reciprocal_div.h>
 
 #include <linux/lightnvm.h>
 
@@ -35,26 +44,281 @@
 
 #define NR_PHY_IN_LOG (RRPC_DEBUG_EXPOSED_PAGE_SIZE / RRPC_DEBUG_SECTOR)
 
-struct rrpc_debug_inflight {
+/* Weight of an erase in the load of a lun, in outstanding pages */
+#define RRPC_DEBUG_ERASE_LOAD 32
+
+/* Update frequency is tracked per region of logical pages */
+#define RRPC_DEBUG_HEAT_SHIFT 8
+
+/* Open blocks per LUN, data is separated by expected lifetime */
+enum {
+	RRPC_DEBUG_STREAM_HOT,		/* user writes to often updated regions */
+	RRPC_DEBUG_STREAM_COLD,		/* other user writes */
+	RRPC_DEBUG_STREAM_GC,		/* data relocated by GC */
+	RRPC_DEBUG_NR_STREAMS,
+};
+
+/* Upper bounds for the GC pipeline, see gc_batch_pages and gc_queue_depth */
+#define RRPC_DEBUG_GC_MAX_BATCH 64
+#define RRPC_DEBUG_GC_MAX_QD 32
+
+/* Upper bound of preallocated user requests, see queue_depth */
+#define RRPC_DEBUG_MAX_USER_RQS 1024
+
+/* Statistics are kept per cpu and summed when read from debugfs */
+enum {
+	RRPC_DEBUG_STAT_USER_PAGES,	/* user pages written to the lun */
+	RRPC_DEBUG_STAT_GC_PAGES,	/* valid pages moved off the lun */
+	RRPC_DEBUG_STAT_ERASES,
+	RRPC_DEBUG_STAT_REQUEUES,	/* by lun of the first page */
+	RRPC_DEBUG_NR_STATS,
+};
+
+struct rrpc_debug_lun_stats {
+	u64 cnt[RRPC_DEBUG_NR_STATS];
+};
+
+enum {
+	RRPC_DEBUG_LAT_READ,
+	RRPC_DEBUG_LAT_WRITE,
+	RRPC_DEBUG_LAT_GC,		/* reclaim of a block */
+	RRPC_DEBUG_NR_LAT,
+};
+
+/* bucket 0 counts latencies below 1us, bucket i those of [2^(i-1), 2^i) us */
+#define RRPC_DEBUG_LAT_BUCKETS 32
+
+struct rrpc_debug_lat_hist {
+	u64 bucket[RRPC_DEBUG_NR_LAT][RRPC_DEBUG_LAT_BUCKETS];
+};
+
+/* Checkpoints and journals of the mapping live in blocks reserved at the
+ * start of the first lun: two checkpoint slots written in turn, then two
+ * journals used in the same turn. A checkpoint ends with its trailer page,
+ * so a torn one is never taken for complete. The journal of a generation
+ * holds what changed after its checkpoint started, in pages written in
+ * order. It is written while that checkpoint is, so both the journal of the
+ * last complete checkpoint and the one of the next are replayed.
+ */
+#define RRPC_DEBUG_CKPT_MAGIC 0x52435054	/* "RCPT" */
+#define RRPC_DEBUG_CKPT_VERSION 4
+#define RRPC_DEBUG_JNL_MAGIC 0x524a4e4c		/* "RJNL" */
+
+struct rrpc_debug_ckpt_trailer {
+	__le32 magic;
+	__le32 version;
+	__le64 gen;
+	__le64 nr_pages;		/* entries of the map */
+	__le64 oob_seq;			/* of the last page tagged */
+	__le32 nr_blocks;
+	__le32 crc;			/* of the map and block pages */
+	__le32 sec_per_pg;		/* program unit of the address layout */
+	__le32 nr_planes;
+};
+
+enum {
+	RRPC_DEBUG_JNL_MAP,		/* a: laddr, b: paddr or ADDR_EMPTY */
+	RRPC_DEBUG_JNL_GET,		/* a: block index within the target */
+	RRPC_DEBUG_JNL_PUT,
+};
+
+struct rrpc_debug_jnl_rec {
+	__le32 type;
+	__le32 rsvd;
+	__le64 a;
+	__le64 b;
+};
+
+struct rrpc_debug_jnl_hdr {
+	__le32 magic;
+	__le32 nr;			/* records in the page */
+	__le64 gen;
+	__le64 idx;			/* page within the journal */
+	__le32 crc;			/* of the records */
+	__le32 rsvd;
+};
+
+#define RRPC_DEBUG_JNL_RECS ((RRPC_DEBUG_EXPOSED_PAGE_SIZE - \
+				sizeof(struct rrpc_debug_jnl_hdr)) / \
+				sizeof(struct rrpc_debug_jnl_rec))
+
+/* Out-of-band metadata written with every page, at the start of the oob
+ * area of its sector. seq tells the newest copy of a logical page when the
+ * map is rebuilt by scanning the media; 0 is never used.
+ */
+struct rrpc_debug_oob {
+	__le64 laddr;			/* ADDR_EMPTY for padding */
+	__le64 seq;
+};
+
+/* unreadable pages in a row a scan takes as the end of a block's data */
+#define RRPC_DEBUG_SCAN_HOLE 4
+
+/* the oob areas of a request follow the ppa list of a vector command in
+ * its DMA buffer
+ */
+#define RRPC_DEBUG_OOB_OFFSET (64 * sizeof(u64))
+
+/* Sequence numbers skipped after loading a checkpoint, more than the pages
+ * written until the next one.
+ */
+#define RRPC_DEBUG_OOB_SEQ_SKIP (1ULL << 40)
+
+/* Read-ahead into the read cache. Sequential readers are tracked in a few
+ * streams, each prefetching a window that grows while its pages are hit in
+ * the cache and shrinks when they were evicted before use.
+ */
+#define RRPC_DEBUG_RA_STREAMS 8
+#define RRPC_DEBUG_RA_MIN 4
+#define RRPC_DEBUG_RA_MAX 64
+
+/* target internal read-ahead, only completes into the read cache */
+#define RRPC_DEBUG_IOTYPE_RA (1 << 8)
+/* set on a user read served from the read cache */
+#define RRPC_DEBUG_RQ_RC_HIT (1 << 9)
+
+struct rrpc_debug_ra_stream {
+	sector_t next;			/* expected next logical page */
+	sector_t ra_start;		/* prefetched and not yet passed */
+	sector_t ra_end;
+	unsigned int depth;
+	unsigned long used;		/* jiffies */
+};
+
+/* Host write buffer. Single page writes are gathered per lun into units of a
+ * flash page on every plane, which are written by one vector command. While a
+ * unit is filled another one of the lun may be on its way to the media.
+ */
+#define RRPC_DEBUG_WB_MAX_PAGES 64
+#define RRPC_DEBUG_WB_UNITS 2
+#define RRPC_DEBUG_WB_RETRIES 3		/* rewrites of a failed unit */
+#define RRPC_DEBUG_WB_SHARDS 16		/* of the buffered page index */
+
+enum {
+	RRPC_DEBUG_WB_FREE,
+	RRPC_DEBUG_WB_OPEN,		/* gathering writes */
+	RRPC_DEBUG_WB_FLUSHING,		/* contents fixed, being written */
+};
+
+/* Inflight logical ranges are tracked in buckets hashed by the stripe of the
+ * logical address space they cover. A locked range is never longer than a
+ * stripe, so it is linked into at most two buckets, and I/O to unrelated
+ * stripes never takes the same lock.
+ */
+#define RRPC_DEBUG_INFLIGHT_STRIPE_SHIFT 8
+#define RRPC_DEBUG_INFLIGHT_STRIPE (1 << RRPC_DEBUG_INFLIGHT_STRIPE_SHIFT)
+#define RRPC_DEBUG_INFLIGHT_BUCKETS 64
+
+/* Bios that found their range locked park on the bucket of the conflicting
+ * range and are requeued by its next unlock. seq counts unlocks, so a bio
+ * whose range got unlocked before it was parked is retried right away.
+ */
+struct rrpc_debug_inflight_bucket {
 	struct list_head reqs;
+	struct bio_list waiters;
+	unsigned int seq;
 	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+struct rrpc_debug_inflight {
+	struct rrpc_debug_inflight_bucket buckets[RRPC_DEBUG_INFLIGHT_BUCKETS];
 };
 
-struct rrpc_debug_inflight_rq {
+#define RRPC_DEBUG_MAP_WAITERS 16
+
+/* Bios whose translation page was not cached, hashed by that page and
+ * requeued once it is loaded. seq counts loads, like the bucket's.
+ */
+struct rrpc_debug_map_waiters {
+	struct bio_list bios;
+	unsigned int seq;
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+struct rrpc_debug_inflight_rq;
+
+struct rrpc_debug_inflight_link {
 	struct list_head list;
+	struct rrpc_debug_inflight_rq *r;
+};
+
+struct rrpc_debug_inflight_rq {
+	/* links into the bucket of the first and the last stripe */
+	struct rrpc_debug_inflight_link link[2];
 	sector_t l_start;
 	sector_t l_end;
+
+	/* set when locking failed: bucket of the conflict and its seq then,
+	 * NULL if a translation page of the range is being loaded, which
+	 * fault and busy_seq then refer to
+	 */
+	struct rrpc_debug_inflight_bucket *busy;
+	struct rrpc_debug_map_waiters *fault;
+	unsigned int busy_seq;
 };
 
 struct rrpc_debug_rq {
 	struct rrpc_debug_inflight_rq inflight_rq;
 	struct rrpc_debug_addr *addr;
 	unsigned long flags;
+	struct completion *wait;	/* completed by end_io for GC vectors */
+	struct rrpc_debug_wb_unit *unit;	/* set when flushing the write buffer */
+	struct bvec_iter iter;		/* payload of the bio as submitted */
+	bio_end_io_t *bi_end_io;	/* of the user bio, while reads are */
+	void *bi_private;		/* hooked to fill the read cache */
+	u64 start;			/* submission time, ns */
+	unsigned int free_seq;		/* rrpc_debug->free_seq at submission */
+	struct rrpc_debug_rq_set *set;	/* NULL when taken from rq_pool */
+	int tag;
+	void *dma_buf;			/* preallocated with the request */
+	dma_addr_t dma_buf_addr;
+};
+
+/* Requests preallocated together with a DMA buffer and handed out by tag,
+ * with free tags cached per cpu. The buffer starts with the ppa list, the
+ * rest of it is left for per-page metadata.
+ */
+struct rrpc_debug_rq_set {
+	unsigned int nr;		/* 0 when disabled */
+	struct percpu_ida tags;
+	struct nvm_rq **rqs;
 };
 
+/* A buffered logical page. Its range stays locked from the time it is
+ * buffered until it is on the media, so only the buffer serves it meanwhile.
+ */
+struct rrpc_debug_wb_slot {
+	struct rrpc_debug_inflight_rq inflight;
+	struct rrpc_debug_wb_unit *unit;
+	sector_t laddr;
+	struct page *page;
+};
+
+struct rrpc_debug_wb_unit {
+	struct rrpc_debug_lun *rlun;
+	int state;
+	int nr_pages;			/* buffered, the rest is padding */
+	int retries;			/* failed writes so far */
+	int nr_mapped;			/* pages reserved before it was parked */
+	struct work_struct ws_flush;
+	struct list_head park;		/* waiting for a block to be freed */
+
+	u64 paddr[RRPC_DEBUG_WB_MAX_PAGES];
+	struct rrpc_debug_wb_slot slots[RRPC_DEBUG_WB_MAX_PAGES];
+};
+
+/* Buffered logical pages, indexed by their slot in the shard of laddr */
+struct rrpc_debug_wb_shard {
+	spinlock_t lock;
+	struct radix_tree_root tree;
+} ____cacheline_aligned_in_smp;
+
 struct rrpc_debug_block {
 	struct nvm_block *parent;
+	struct rrpc_debug_lun *rlun;
 	struct list_head prio;
+	struct list_head age;		/* GC candidates, oldest first */
+	unsigned long closed;		/* jiffies when the block became full */
 
 #define MAX_INVALID_PAGES_STORAGE 8
 	/* Bitmap for invalid page intries */
@@ -68,15 +332,90 @@ struct rrpc_debug_block {
 	atomic_t data_cmnt_size; /* data pages committed to stable storage */
 };
 
+/*
+ * Reverse map entries and block invalidation state are protected by the
+ * rev_lock of the LUN that owns the physical address. Lock ordering:
+ *
+ *   rlun->rev_lock -> inflight bucket lock
+ *   rlun->rev_lock -> rlun->lock -> rblk->lock
+ *   wb shard lock -> rlun->wb_lock -> inflight bucket lock
+ *   rrpc_debug->bio_lock is taken alone
+ *   rrpc_debug->map_lock is taken last
+ *
+ * No path holds two rev_locks at once: remapping a logical address drops the
+ * lock of the old LUN before taking the lock of the new one. A trans_map entry
+ * may only be changed by the holder of the inflight range lock covering it,
+ * which also pins its translation page when the map is demand paged.
+ */
 struct rrpc_debug_lun {
 	struct rrpc_debug *rrpc_debug;
 	struct nvm_lun *parent;
-	struct rrpc_debug_block *cur, *gc_cur;
+	struct rrpc_debug_block *cur[RRPC_DEBUG_NR_STREAMS];
+	struct rrpc_debug_block *gc_cur;	/* emergency gc block */
 	struct rrpc_debug_block *blocks;	/* Reference to block allocation */
-	struct list_head prio_list;		/* Blocks that may be GC'ed */
+
+	/* Blocks that may be GC'ed, bucketed by their number of invalid
+	 * pages. prio_max is never below the highest non-empty bucket.
+	 */
+	struct list_head *prio_buckets;
+	unsigned int prio_max;
+	unsigned int nr_prio;
+	struct list_head age_list;
+
 	struct work_struct ws_gc;
+	int node;			/* of its reverse map and GC work */
+
+	/* page migration pipeline, one victim of the LUN at a time */
+	struct rrpc_debug_gc_batch *gc_batches;
+	struct mutex gc_mutex;
 
 	spinlock_t lock;
+
+	/* luns ordered by number of free blocks, see rrpc_debug->free_tree */
+	struct rb_node free_node;
+	unsigned int free_key;
+
+	spinlock_t rev_lock ____cacheline_aligned_in_smp;
+
+	/* load seen by the write scheduler */
+	atomic_t inflight ____cacheline_aligned_in_smp;	/* pages */
+	atomic_t erasing;
+
+	/* write buffer units, protected by wb_lock */
+	spinlock_t wb_lock;
+	struct rrpc_debug_wb_unit *wb_units;
+	struct rrpc_debug_wb_unit *wb_open;	/* NULL while all are flushing */
+};
+
+struct rrpc_debug_gc_policy {
+	const char *name;
+	/* pick a victim among the LUN's GC candidates, requires rlun->lock */
+	struct rrpc_debug_block *(*select)(struct rrpc_debug_lun *rlun);
+
+	/* write amplification of all targets running the policy */
+	atomic64_t user_pages;
+	atomic64_t gc_pages;
+};
+
+/* A divisor of the device geometry. Powers of two are applied as a shift
+ * and a mask, others as a multiplication with their reciprocal.
+ */
+struct rrpc_debug_div {
+	u32 d;
+	int shift;			/* -1 if not a power of two */
+	struct reciprocal_value r;
+};
+
+/* converts linear physical addresses to device addresses, see
+ * rrpc_debug_ppa_to_gaddr
+ */
+struct rrpc_debug_geo {
+	struct rrpc_debug_div sec_per_pg;
+	struct rrpc_debug_div nr_planes;
+	struct rrpc_debug_div pgs_per_blk;
+	struct rrpc_debug_div blks_per_lun;
+	struct rrpc_debug_div luns_per_chnl;
+	bool pow2;			/* all of them are powers of two */
 };
 
 struct rrpc_debug {
@@ -88,9 +427,17 @@ struct rrpc_debug {
 
 	u64 poffset; /* physical page offset */
 	int lun_offset;
+	struct rrpc_debug_geo geo;
 
 	int nr_luns;
 	struct rrpc_debug_lun *luns;
+	/* luns in write order, neighbours are on different channels */
+	struct rrpc_debug_lun **lun_order;
+
+	/* pages the device programs together: a flash page on every plane */
+	int prog_pages;
+	/* pages of a vector write placed on a lun before moving to the next */
+	int stripe_pages;
 
 	/* calculated values */
 	unsigned long long nr_pages;
@@ -99,30 +446,157 @@ struct rrpc_debug {
 	/* Write strategy variables. Move these into each for structure for each
 	 * strategy
 	 */
-	atomic_t next_lun; /* Whenever a page is written, this is updated
-			    * to point to the next write lun
-			    */
+	unsigned int __percpu *lun_cursor; /* Whenever a page is written, the
+					    * cursor of the writing cpu is
+					    * moved to its next write lun
+					    */
+	int lun_affinity;		/* cpus only write to their lun group */
+	int nr_lun_groups;
+
+	/* GC destinations are taken from the lun with most free blocks */
+	struct rb_root free_tree;
+	spinlock_t free_lock;
 
 	spinlock_t bio_lock;
 	struct bio_list requeue_bios;
 	struct work_struct ws_requeue;
 
+	/* Writes that found no free page wait on nospace_bios until a block
+	 * is put back. free_seq counts put blocks.
+	 */
+	struct bio_list nospace_bios;
+	atomic_t free_seq;
+
+	/* woken on every range unlock that has sleepers (discard, GC) */
+	wait_queue_head_t inflight_wait;
+
 	/* Simple translation map of logical addresses to physical addresses.
 	 * The logical addresses is known by the host system, while the physical
-	 * addresses are used when writing to the disk block device.
+	 * addresses are used when writing to the disk block device. Both maps
+	 * are partitioned, see rrpc_debug_l2p and rrpc_debug_rev.
 	 */
-	struct rrpc_debug_addr *trans_map;
+	struct rrpc_debug_addr **trans_map;
 	/* also store a reverse map for garbage collection */
-	struct rrpc_debug_rev_addr *rev_trans_map;
-	spinlock_t rev_lock;
+	struct rrpc_debug_rev_addr **rev_trans_map;
+
+	/* Demand paged map instead of trans_map when gtd is set. Unpinned
+	 * translation pages are on map_lru, most recently used first.
+	 */
+	struct rrpc_debug_gtd *gtd;
+	u64 nr_tpages;
+	struct rrpc_debug_tpage *tpages;
+	unsigned int nr_cached;
+	spinlock_t map_lock;
+	struct list_head map_lru;
+	unsigned long *map_fault;	/* translation pages to load */
+	struct rrpc_debug_map_waiters map_waiters[RRPC_DEBUG_MAP_WAITERS];
+	bool map_starved;		/* loads wait for a page to be unpinned */
+	bool map_lost;			/* a translation page could not be read */
+	wait_queue_head_t map_wait;
+	struct workqueue_struct *kmap_wq;
+	struct work_struct ws_map;
+
+	unsigned int map_blks;		/* log blocks at the end of a lun */
+	u64 map_log_pages;
+	u64 map_next;			/* next log page written */
+	u64 *map_log_idx;		/* translation page of every log page */
+	struct page **map_io;		/* meta_chunk pages to write back from */
+	struct page **map_reloc;	/* a block of pages to relocate into */
+	unsigned int map_prefetch;	/* translation pages loaded ahead */
+
+	/* update frequency per logical region, selects the write stream */
+	struct rrpc_debug_heat *heat;
 
 	struct rrpc_debug_inflight inflights;
 
+	/* Write buffer, disabled when wb_pages is 0. The shards map buffered
+	 * logical pages to their slot.
+	 */
+	int wb_pages;			/* pages per unit */
+	struct rrpc_debug_wb_shard wb_shards[RRPC_DEBUG_WB_SHARDS];
+	struct list_head wb_parked;	/* units out of space */
+	spinlock_t wb_park_lock;
+	atomic_t wb_buffered;
+	atomic_t wb_flushing;		/* units on their way to the media */
+	atomic_t wb_error;		/* pages lost, fails the next flush */
+	wait_queue_head_t wb_wait;
+	struct timer_list wb_timer;
+
+	/* Read cache of logical pages, disabled when rc_nr is 0. An entry
+	 * only changes under the range lock of its logical page.
+	 */
+	unsigned int rc_nr;
+	unsigned int rc_hand;
+	struct rrpc_debug_rc_entry *rc_entries;
+	struct radix_tree_root rc_tree;
+	spinlock_t rc_lock;
+
+	struct rrpc_debug_ra_stream ra_streams[RRPC_DEBUG_RA_STREAMS];
+	unsigned int ra_max;
+	spinlock_t ra_lock;
+
+	/* nr_luns + 1 entries, the last for requeues of unmapped pages */
+	struct rrpc_debug_lun_stats __percpu *lun_stats;
+	struct rrpc_debug_lat_hist __percpu *lat;
+	struct dentry *debugfs;
+
 	mempool_t *addr_pool;
 	mempool_t *page_pool;
 	mempool_t *gcb_pool;
 	mempool_t *rq_pool;
 
+	/* User I/O sleeps for a request of user_rqs. GC, write buffer and
+	 * read-ahead I/O take one of int_rqs if any is free, and fall back to
+	 * rq_pool otherwise.
+	 */
+	struct rrpc_debug_rq_set user_rqs;
+	struct rrpc_debug_rq_set int_rqs;
+
+	/* oob area per sector, 0 if pages are not tagged */
+	unsigned int oob_size;
+	atomic64_t oob_seq;
+	bool map_scan;			/* map is rebuilt from oob tags */
+	atomic64_t *scan_lseq;		/* only while scanning: newest seq */
+	u64 *scan_pseq;			/* and seq of every physical page */
+
+	/* Checkpoint and journal, disabled when ckpt_pages is 0. Checkpoints
+	 * are written from kmeta_wq, the journal from kjnl_wq so that syncing
+	 * it does not wait for a checkpoint.
+	 */
+	unsigned int ckpt_pages;	/* of a slot, trailer included */
+	unsigned int ckpt_map_pages;
+	unsigned int ckpt_blk_pages;
+	unsigned int ckpt_blks;		/* blocks of a slot */
+	unsigned int jnl_pages;
+	unsigned int meta_chunk;	/* pages per metadata I/O */
+	struct page **meta_pages;	/* meta_chunk pages to build I/O in */
+	struct page **jnl_batch;
+	bool ckpt_loaded;
+	u64 ckpt_gen;			/* of the newest checkpoint on media */
+	u64 ckpt_runs;			/* checkpoints started */
+	u64 ckpt_done;			/* run of the newest one on media */
+	unsigned long *blk_used;	/* blocks the target got */
+	struct workqueue_struct *kmeta_wq;
+	struct workqueue_struct *kjnl_wq;
+	struct delayed_work ws_ckpt;
+	struct work_struct ws_jnl;
+
+	mempool_t *jnl_pool;
+	spinlock_t jnl_lock;
+	u64 jnl_gen;			/* of the records being added */
+	struct page *jnl_cur;		/* page records are added to */
+	struct list_head jnl_full;	/* pages waiting to be written */
+	struct mutex jnl_mutex;		/* journal writes and erases */
+	unsigned int jnl_next[2];	/* next page of each journal */
+	bool jnl_lost[2];		/* a journal has a hole */
+	u64 jnl_need;			/* run covering all dropped records */
+
+	struct rrpc_debug_gc_policy *gc_policy;
+
+	/* GC page migration pipeline */
+	unsigned int gc_batch;
+	unsigned int gc_qd;
+
 	struct timer_list gc_timer;
 	struct workqueue_struct *krqd_wq;
 	struct workqueue_struct *kgc_wq;
@@ -134,10 +608,74 @@ struct rrpc_debug_block_gc {
 	struct work_struct ws_gc;
 };
 
-/* Logical to physical mapping */
+/* Valid pages moved off a block by one vector read and one vector write. The
+ * logical addresses stay locked from the read until the write completes.
+ */
+struct rrpc_debug_gc_batch {
+	struct nvm_rq *rqd;
+	struct bio *bio;
+	struct completion wait;
+
+	int nr_pages;
+	sector_t laddr[RRPC_DEBUG_GC_MAX_BATCH];
+	u64 paddr[RRPC_DEBUG_GC_MAX_BATCH];
+	struct page *pages[RRPC_DEBUG_GC_MAX_BATCH];
+	struct rrpc_debug_inflight_rq inflight[RRPC_DEBUG_GC_MAX_BATCH];
+};
+
+/* Logical to physical mapping. The block owning a physical address is
+ * derived from the device geometry, an unmapped entry holds ADDR_EMPTY.
+ */
 struct rrpc_debug_addr {
 	u64 addr;
-	struct rrpc_debug_block *rblk;
+};
+
+/* Demand paged map, enabled by map_cache_pages. The map is split in
+ * translation pages, which are written to a log in the last blocks of every
+ * lun and of which map_cache_pages are cached. An entry is only accessed
+ * while its translation page is pinned.
+ */
+#define RRPC_DEBUG_TPAGE_SHIFT 9
+#define RRPC_DEBUG_TPAGE_ENTRIES (1 << RRPC_DEBUG_TPAGE_SHIFT)
+
+enum {
+	RRPC_DEBUG_TPAGE_DIRTY,
+};
+
+struct rrpc_debug_tpage {
+	struct rrpc_debug_addr *map;
+	struct page *page;
+	u64 idx;			/* translation page held, or ADDR_EMPTY */
+	int pins;
+	unsigned long flags;
+	struct list_head list;		/* on map_lru while not pinned */
+};
+
+/* Where a translation page is. Both are only changed by the map worker,
+ * tp under map_lock.
+ */
+struct rrpc_debug_gtd {
+	u64 log;			/* page in the log, ADDR_EMPTY if none */
+	struct rrpc_debug_tpage *tp;	/* if cached */
+};
+
+/* Number of writes to a logical region. The count is halved for every heat
+ * period that passed since the region was last written. Updates are racy,
+ * the count is only a hint. The epoch wraps after 2^32 periods, a region
+ * idle for that long reads as written recently.
+ */
+struct rrpc_debug_heat {
+	u32 epoch;
+	u8 count;
+};
+
+/* Read cache entry, replaced in CLOCK order */
+struct rrpc_debug_rc_entry {
+	sector_t laddr;
+	struct page *page;
+	unsigned int ref;		/* hit since the hand last passed */
+	unsigned int used;
+	unsigned int busy;		/* out of the cache, being filled */
 };
 
 /* Physical to logical mapping */
@@ -145,6 +683,35 @@ struct rrpc_debug_rev_addr {
 	u64 addr;
 };
 
+/* The maps are kept in partitions of 2MB, each allocated on the NUMA node
+ * of the luns using it, and physically contiguous with map_hugepages.
+ */
+#define RRPC_DEBUG_MAP_PART_SHIFT 18
+#define RRPC_DEBUG_MAP_PART_ENTRIES (1 << RRPC_DEBUG_MAP_PART_SHIFT)
+
+/* One partition of target bring-up, run in parallel with the others */
+struct rrpc_debug_init_work {
+	struct work_struct ws;
+	struct rrpc_debug *rrpc_debug;
+	int part;			/* lun index */
+	int ret;
+};
+
+static inline void rrpc_debug_stat_add(struct rrpc_debug *rrpc_debug, int lun,
+							int stat, u64 n)
+{
+	this_cpu_add(rrpc_debug->lun_stats[lun].cnt[stat], n);
+}
+
+static inline void rrpc_debug_lat_add(struct rrpc_debug *rrpc_debug, int type,
+								u64 start)
+{
+	u64 us = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+	int b = us ? min_t(int, ilog2(us) + 1, RRPC_DEBUG_LAT_BUCKETS - 1) : 0;
+
+	this_cpu_inc(rrpc_debug->lat->bucket[type][b]);
+}
+
 static inline sector_t rrpc_debug_get_laddr(struct bio *bio)
 {
 	return bio->bi_iter.bi_sector / NR_PHY_IN_LOG;
@@ -163,30 +730,277 @@ static inline sector_t rrpc_debug_get_sector(sector_t laddr)
 static inline int request_intersects(struct rrpc_debug_inflight_rq *r,
 				sector_t laddr_start, sector_t laddr_end)
 {
-	return (laddr_end >= r->l_start && laddr_end <= r->l_end) &&
-		(laddr_start >= r->l_start && laddr_start <= r->l_end);
+	return (laddr_end >= r->l_start) && (laddr_start <= r->l_end);
+}
+
+static inline struct rrpc_debug_inflight_bucket *rrpc_debug_inflight_bucket(
+			struct rrpc_debug *rrpc_debug, sector_t laddr)
+{
+	unsigned int idx = (laddr >> RRPC_DEBUG_INFLIGHT_STRIPE_SHIFT) &
+					(RRPC_DEBUG_INFLIGHT_BUCKETS - 1);
+
+	return &rrpc_debug->inflights.buckets[idx];
+}
+
+/* buckets are always locked in address order, so two ranges sharing both of
+ * their buckets cannot deadlock.
+ */
+static inline void rrpc_debug_inflight_lock(struct rrpc_debug_inflight_bucket *a,
+				struct rrpc_debug_inflight_bucket *b,
+				unsigned long *flags)
+{
+	if (a == b) {
+		spin_lock_irqsave(&a->lock, *flags);
+		return;
+	}
+
+	if (a > b)
+		swap(a, b);
+
+	spin_lock_irqsave(&a->lock, *flags);
+	spin_lock_nested(&b->lock, SINGLE_DEPTH_NESTING);
+}
+
+static inline void rrpc_debug_inflight_unlock(struct rrpc_debug_inflight_bucket *a,
+				struct rrpc_debug_inflight_bucket *b,
+				unsigned long flags)
+{
+	if (a != b)
+		spin_unlock(&(a > b ? a : b)->lock);
+	spin_unlock_irqrestore(&(a > b ? b : a)->lock, flags);
+}
+
+static inline int rrpc_debug_inflight_busy(struct rrpc_debug_inflight_bucket *b,
+				sector_t laddr_start, sector_t laddr_end)
+{
+	struct rrpc_debug_inflight_link *lnk;
+
+	list_for_each_entry(lnk, &b->reqs, list)
+		if (unlikely(request_intersects(lnk->r, laddr_start, laddr_end)))
+			return 1;
+
+	return 0;
+}
+
+static inline struct rrpc_debug_rev_addr *rrpc_debug_rev(struct rrpc_debug *rrpc_debug,
+								u64 paddr)
+{
+	u64 off = paddr - rrpc_debug->poffset;
+
+	return &rrpc_debug->rev_trans_map[off >> RRPC_DEBUG_MAP_PART_SHIFT]
+				[off & (RRPC_DEBUG_MAP_PART_ENTRIES - 1)];
+}
+
+static inline struct rrpc_debug_addr *rrpc_debug_l2p(struct rrpc_debug *rrpc_debug,
+							sector_t laddr)
+{
+	if (!rrpc_debug->gtd)
+		return &rrpc_debug->trans_map[laddr >> RRPC_DEBUG_MAP_PART_SHIFT]
+				[laddr & (RRPC_DEBUG_MAP_PART_ENTRIES - 1)];
+
+	return &rrpc_debug->gtd[laddr >> RRPC_DEBUG_TPAGE_SHIFT].tp->map[laddr &
+					(RRPC_DEBUG_TPAGE_ENTRIES - 1)];
+}
+
+/* An entry changed, its translation page is written back before eviction.
+ * The map worker clears the bit before it copies the page.
+ */
+static inline void rrpc_debug_map_dirty(struct rrpc_debug *rrpc_debug,
+							sector_t laddr)
+{
+	if (!rrpc_debug->gtd)
+		return;
+
+	smp_mb__before_atomic();
+	set_bit(RRPC_DEBUG_TPAGE_DIRTY,
+		&rrpc_debug->gtd[laddr >> RRPC_DEBUG_TPAGE_SHIFT].tp->flags);
+}
+
+static inline struct rrpc_debug_map_waiters *rrpc_debug_map_waiters(
+				struct rrpc_debug *rrpc_debug, u64 idx)
+{
+	return &rrpc_debug->map_waiters[idx & (RRPC_DEBUG_MAP_WAITERS - 1)];
+}
+
+static inline void __rrpc_debug_map_fault(struct rrpc_debug *rrpc_debug, u64 idx)
+{
+	if (idx < rrpc_debug->nr_tpages && !rrpc_debug->gtd[idx].tp &&
+	    !test_and_set_bit(idx, rrpc_debug->map_fault))
+		queue_work(rrpc_debug->kmap_wq, &rrpc_debug->ws_map);
+}
+
+/* Pin the translation pages of a range without sleeping. A range is at most
+ * a translation page long, so it spans two at most. Pages that are not
+ * cached are queued for loading, together with the next map_prefetch ones,
+ * and @r if given is pointed at the waiters of the missing one. A
+ * sequential reader gets the next page loaded once it reaches the last
+ * quarter of the current one.
+ */
+static int rrpc_debug_map_trypin(struct rrpc_debug *rrpc_debug, sector_t laddr,
+		unsigned int pages, struct rrpc_debug_inflight_rq *r)
+{
+	u64 first = laddr >> RRPC_DEBUG_TPAGE_SHIFT;
+	u64 last = (laddr + pages - 1) >> RRPC_DEBUG_TPAGE_SHIFT;
+	struct rrpc_debug_tpage *tp;
+	unsigned long flags;
+	u64 idx;
+	int ret = 0;
+
+	if (!rrpc_debug->gtd)
+		return 0;
+
+	spin_lock_irqsave(&rrpc_debug->map_lock, flags);
+	if (!rrpc_debug->gtd[first].tp || !rrpc_debug->gtd[last].tp) {
+		if (r) {
+			/* a load after the unlock bumps seq */
+			r->fault = rrpc_debug_map_waiters(rrpc_debug,
+				rrpc_debug->gtd[first].tp ? last : first);
+			r->busy_seq = READ_ONCE(r->fault->seq);
+		}
+		for (idx = first; idx <= last + rrpc_debug->map_prefetch; idx++)
+			__rrpc_debug_map_fault(rrpc_debug, idx);
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	for (idx = first; idx <= last; idx++) {
+		tp = rrpc_debug->gtd[idx].tp;
+		if (!tp->pins++)
+			list_del_init(&tp->list);
+	}
+
+	if (rrpc_debug->map_prefetch && ((laddr + pages) &
+			(RRPC_DEBUG_TPAGE_ENTRIES - 1)) >=
+			RRPC_DEBUG_TPAGE_ENTRIES / 4 * 3)
+		__rrpc_debug_map_fault(rrpc_debug, last + 1);
+out:
+	spin_unlock_irqrestore(&rrpc_debug->map_lock, flags);
+	return ret;
+}
+
+static void rrpc_debug_map_unpin(struct rrpc_debug *rrpc_debug, sector_t laddr,
+							unsigned int pages)
+{
+	u64 first = laddr >> RRPC_DEBUG_TPAGE_SHIFT;
+	u64 last = (laddr + pages - 1) >> RRPC_DEBUG_TPAGE_SHIFT;
+	struct rrpc_debug_tpage *tp;
+	unsigned long flags;
+	u64 idx;
+
+	if (!rrpc_debug->gtd)
+		return;
+
+	spin_lock_irqsave(&rrpc_debug->map_lock, flags);
+	for (idx = first; idx <= last; idx++) {
+		tp = rrpc_debug->gtd[idx].tp;
+		if (!--tp->pins)
+			list_add(&tp->list, &rrpc_debug->map_lru);
+	}
+
+	if (rrpc_debug->map_starved) {
+		rrpc_debug->map_starved = false;
+		queue_work(rrpc_debug->kmap_wq, &rrpc_debug->ws_map);
+	}
+	spin_unlock_irqrestore(&rrpc_debug->map_lock, flags);
+}
+
+/* pin from process context, waiting for the pages to be loaded */
+static void rrpc_debug_map_pin(struct rrpc_debug *rrpc_debug, sector_t laddr,
+							unsigned int pages)
+{
+	wait_event(rrpc_debug->map_wait,
+			!rrpc_debug_map_trypin(rrpc_debug, laddr, pages, NULL));
+}
+
+/* entry of @laddr, from process context without holding its range lock */
+static u64 rrpc_debug_map_get(struct rrpc_debug *rrpc_debug, sector_t laddr)
+{
+	u64 paddr;
+
+	rrpc_debug_map_pin(rrpc_debug, laddr, 1);
+	paddr = READ_ONCE(rrpc_debug_l2p(rrpc_debug, laddr)->addr);
+	rrpc_debug_map_unpin(rrpc_debug, laddr, 1);
+
+	return paddr;
+}
+
+/* set the entry of @laddr at bring-up, when no I/O runs */
+static void rrpc_debug_map_set(struct rrpc_debug *rrpc_debug, sector_t laddr,
+								u64 paddr)
+{
+	rrpc_debug_map_pin(rrpc_debug, laddr, 1);
+	rrpc_debug_l2p(rrpc_debug, laddr)->addr = paddr;
+	rrpc_debug_map_dirty(rrpc_debug, laddr);
+	rrpc_debug_map_unpin(rrpc_debug, laddr, 1);
+}
+
+/* entry of @laddr if it is at hand, ADDR_EMPTY otherwise */
+static u64 rrpc_debug_map_peek(struct rrpc_debug *rrpc_debug, sector_t laddr)
+{
+	struct rrpc_debug_tpage *tp;
+	unsigned long flags;
+	u64 paddr = ADDR_EMPTY;
+
+	if (!rrpc_debug->gtd)
+		return READ_ONCE(rrpc_debug_l2p(rrpc_debug, laddr)->addr);
+
+	spin_lock_irqsave(&rrpc_debug->map_lock, flags);
+	tp = rrpc_debug->gtd[laddr >> RRPC_DEBUG_TPAGE_SHIFT].tp;
+	if (tp)
+		paddr = READ_ONCE(tp->map[laddr &
+				(RRPC_DEBUG_TPAGE_ENTRIES - 1)].addr);
+	spin_unlock_irqrestore(&rrpc_debug->map_lock, flags);
+
+	return paddr;
 }
 
 static int __rrpc_debug_lock_laddr(struct rrpc_debug *rrpc_debug, sector_t laddr,
 			     unsigned pages, struct rrpc_debug_inflight_rq *r)
 {
 	sector_t laddr_end = laddr + pages - 1;
-	struct rrpc_debug_inflight_rq *rtmp;
+	struct rrpc_debug_inflight_bucket *first, *last;
+	unsigned long flags;
 
-	spin_lock_irq(&rrpc_debug->inflights.lock);
-	list_for_each_entry(rtmp, &rrpc_debug->inflights.reqs, list) {
-		if (unlikely(request_intersects(rtmp, laddr, laddr_end))) {
-			/* existing, overlapping request, come back later */
-			spin_unlock_irq(&rrpc_debug->inflights.lock);
-			return 1;
-		}
+	r->fault = NULL;
+
+	/* the entries of a locked range stay cached until its unlock */
+	if (rrpc_debug_map_trypin(rrpc_debug, laddr, pages, r)) {
+		r->busy = NULL;
+		return 1;
+	}
+
+	first = rrpc_debug_inflight_bucket(rrpc_debug, laddr);
+	last = rrpc_debug_inflight_bucket(rrpc_debug, laddr_end);
+
+	rrpc_debug_inflight_lock(first, last, &flags);
+	if (rrpc_debug_inflight_busy(first, laddr, laddr_end))
+		r->busy = first;
+	else if (last != first && rrpc_debug_inflight_busy(last, laddr, laddr_end))
+		r->busy = last;
+	else
+		r->busy = NULL;
+
+	if (r->busy) {
+		/* existing, overlapping request, come back after its unlock */
+		r->busy_seq = r->busy->seq;
+		rrpc_debug_inflight_unlock(first, last, flags);
+		rrpc_debug_map_unpin(rrpc_debug, laddr, pages);
+		return 1;
 	}
 
 	r->l_start = laddr;
 	r->l_end = laddr_end;
 
-	list_add_tail(&r->list, &rrpc_debug->inflights.reqs);
-	spin_unlock_irq(&rrpc_debug->inflights.lock);
+	r->link[0].r = r;
+	list_add_tail(&r->link[0].list, &first->reqs);
+
+	r->link[1].r = r;
+	if (last != first)
+		list_add_tail(&r->link[1].list, &last->reqs);
+	else
+		INIT_LIST_HEAD(&r->link[1].list);
+
+	rrpc_debug_inflight_unlock(first, last, flags);
 	return 0;
 }
 
@@ -195,6 +1009,7 @@ static inline int rrpc_debug_lock_laddr(struct rrpc_debug *rrpc_debug, sector_t
 				 struct rrpc_debug_inflight_rq *r)
 {
 	BUG_ON((laddr + pages) > rrpc_debug->nr_pages);
+	BUG_ON(pages > RRPC_DEBUG_INFLIGHT_STRIPE);
 
 	return __rrpc_debug_lock_laddr(rrpc_debug, laddr, pages, r);
 }
@@ -216,14 +1031,56 @@ static inline int rrpc_debug_lock_rq(struct rrpc_debug *rrpc_debug, struct bio *
 	return rrpc_debug_lock_laddr(rrpc_debug, laddr, pages, r);
 }
 
+/* hand parked bios back to the requeue worker */
+static inline void rrpc_debug_requeue_bios(struct rrpc_debug *rrpc_debug,
+							struct bio_list *bios)
+{
+	unsigned long flags;
+
+	if (bio_list_empty(bios))
+		return;
+
+	spin_lock_irqsave(&rrpc_debug->bio_lock, flags);
+	bio_list_merge(&rrpc_debug->requeue_bios, bios);
+	spin_unlock_irqrestore(&rrpc_debug->bio_lock, flags);
+
+	queue_work(rrpc_debug->kgc_wq, &rrpc_debug->ws_requeue);
+}
+
+static inline void rrpc_debug_inflight_wake(struct rrpc_debug_inflight_bucket *b,
+							struct bio_list *bios)
+{
+	b->seq++;
+	bio_list_merge(bios, &b->waiters);
+	bio_list_init(&b->waiters);
+}
+
 static inline void rrpc_debug_unlock_laddr(struct rrpc_debug *rrpc_debug,
 						struct rrpc_debug_inflight_rq *r)
 {
+	struct rrpc_debug_inflight_bucket *first, *last;
+	struct bio_list bios;
 	unsigned long flags;
 
-	spin_lock_irqsave(&rrpc_debug->inflights.lock, flags);
-	list_del_init(&r->list);
-	spin_unlock_irqrestore(&rrpc_debug->inflights.lock, flags);
+	first = rrpc_debug_inflight_bucket(rrpc_debug, r->l_start);
+	last = rrpc_debug_inflight_bucket(rrpc_debug, r->l_end);
+
+	bio_list_init(&bios);
+
+	rrpc_debug_inflight_lock(first, last, &flags);
+	list_del_init(&r->link[0].list);
+	list_del_init(&r->link[1].list);
+	rrpc_debug_inflight_wake(first, &bios);
+	if (last != first)
+		rrpc_debug_inflight_wake(last, &bios);
+	rrpc_debug_inflight_unlock(first, last, flags);
+
+	rrpc_debug_map_unpin(rrpc_debug, r->l_start,
+					r->l_end - r->l_start + 1);
+	rrpc_debug_requeue_bios(rrpc_debug, &bios);
+
+	if (wq_has_sleeper(&rrpc_debug->inflight_wait))
+		wake_up(&rrpc_debug->inflight_wait);
 }
 
 static inline void rrpc_debug_unlock_rq(struct rrpc_debug *rrpc_debug, struct nvm_rq *rqd)
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2015 IT University of Copenhagen
+ * Initial release: Matias Bjorling <m@bjorling.me>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Tracepoints of the rrpc_debug target.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rrpc_debug
+
+#if !defined(_RRPC_DEBUG_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RRPC_DEBUG_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(rrpc_debug_submit,
+
+	TP_PROTO(struct rrpc_debug *rrpc_debug, sector_t laddr,
+			unsigned int npages, int rw, unsigned long flags),
+
+	TP_ARGS(rrpc_debug, laddr, npages, rw, flags),
+
+	TP_STRUCT__entry(
+		__string(disk, rrpc_debug->disk->disk_name)
+		__field(sector_t, laddr)
+		__field(unsigned int, npages)
+		__field(int, rw)
+		__field(unsigned long, flags)
+	),
+
+	TP_fast_assign(
+		__assign_str(disk, rrpc_debug->disk->disk_name);
+		__entry->laddr = laddr;
+		__entry->npages = npages;
+		__entry->rw = rw;
+		__entry->flags = flags;
+	),
+
+	TP_printk("%s %s laddr=%llu npages=%u flags=0x%lx", __get_str(disk),
+		__entry->rw == WRITE ? "W" : "R",
+		(unsigned long long)__entry->laddr, __entry->npages,
+		__entry->flags)
+);
+
+TRACE_EVENT(rrpc_debug_complete,
+
+	TP_PROTO(struct rrpc_debug *rrpc_debug, sector_t laddr,
+			unsigned int npages, int rw, int error),
+
+	TP_ARGS(rrpc_debug, laddr, npages, rw, error),
+
+	TP_STRUCT__entry(
+		__string(disk, rrpc_debug->disk->disk_name)
+		__field(sector_t, laddr)
+		__field(unsigned int, npages)
+		__field(int, rw)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		__assign_str(disk, rrpc_debug->disk->disk_name);
+		__entry->laddr = laddr;
+		__entry->npages = npages;
+		__entry->rw = rw;
+		__entry->error = error;
+	),
+
+	TP_printk("%s %s laddr=%llu npages=%u error=%d", __get_str(disk),
+		__entry->rw == WRITE ? "W" : "R",
+		(unsigned long long)__entry->laddr, __entry->npages,
+		__entry->error)
+);
+
+TRACE_EVENT(rrpc_debug_requeue,
+
+	TP_PROTO(struct rrpc_debug *rrpc_debug, sector_t laddr,
+			unsigned int npages),
+
+	TP_ARGS(rrpc_debug, laddr, npages),
+
+	TP_STRUCT__entry(
+		__string(disk, rrpc_debug->disk->disk_name)
+		__field(sector_t, laddr)
+		__field(unsigned int, npages)
+	),
+
+	TP_fast_assign(
+		__assign_str(disk, rrpc_debug->disk->disk_name);
+		__entry->laddr = laddr;
+		__entry->npages = npages;
+	),
+
+	TP_printk("%s laddr=%llu npages=%u", __get_str(disk),
+		(unsigned long long)__entry->laddr, __entry->npages)
+);
+
+TRACE_EVENT(rrpc_debug_map,
+
+	TP_PROTO(struct rrpc_debug *rrpc_debug, sector_t laddr, u64 paddr,
+			int nr, int lun, int stream),
+
+	TP_ARGS(rrpc_debug, laddr, paddr, nr, lun, stream),
+
+	TP_STRUCT__entry(
+		__string(disk, rrpc_debug->disk->disk_name)
+		__field(sector_t, laddr)
+		__field(u64, paddr)
+		__field(int, nr)
+		__field(int, lun)
+		__field(int, stream)
+	),
+
+	TP_fast_assign(
+		__assign_str(disk, rrpc_debug->disk->disk_name);
+		__entry->laddr = laddr;
+		__entry->paddr = paddr;
+		__entry->nr = nr;
+		__entry->lun = lun;
+		__entry->stream = stream;
+	),
+
+	TP_printk("%s laddr=%llu paddr=%llu nr=%d lun=%d stream=%d",
+		__get_str(disk), (unsigned long long)__entry->laddr,
+		__entry->paddr, __entry->nr, __entry->lun, __entry->stream)
+);
+
+TRACE_EVENT(rrpc_debug_gc_select,
+
+	TP_PROTO(struct rrpc_debug *rrpc_debug, unsigned long blk,
+			unsigned int nr_invalid),
+
+	TP_ARGS(rrpc_debug, blk, nr_invalid),
+
+	TP_STRUCT__entry(
+		__string(disk, rrpc_debug->disk->disk_name)
+		__string(policy, rrpc_debug->gc_policy->name)
+		__field(unsigned long, blk)
+		__field(unsigned int, nr_invalid)
+	),
+
+	TP_fast_assign(
+		__assign_str(disk, rrpc_debug->disk->disk_name);
+		__assign_str(policy, rrpc_debug->gc_policy->name);
+		__entry->blk = blk;
+		__entry->nr_invalid = nr_invalid;
+	),
+
+	TP_printk("%s blk=%lu invalid=%u policy=%s", __get_str(disk),
+		__entry->blk, __entry->nr_invalid, __get_str(policy))
+);
+
+TRACE_EVENT(rrpc_debug_gc_move,
+
+	TP_PROTO(struct rrpc_debug *rrpc_debug, unsigned long blk, int nr),
+
+	TP_ARGS(rrpc_debug, blk, nr),
+
+	TP_STRUCT__entry(
+		__string(disk, rrpc_debug->disk->disk_name)
+		__field(unsigned long, blk)
+		__field(int, nr)
+	),
+
+	TP_fast_assign(
+		__assign_str(disk, rrpc_debug->disk->disk_name);
+		__entry->blk = blk;
+		__entry->nr = nr;
+	),
+
+	TP_printk("%s blk=%lu moved=%d", __get_str(disk), __entry->blk,
+		__entry->nr)
+);
+
+DECLARE_EVENT_CLASS(rrpc_debug_blk,
+
+	TP_PROTO(struct rrpc_debug *rrpc_debug, unsigned long blk),
+
+	TP_ARGS(rrpc_debug, blk),
+
+	TP_STRUCT__entry(
+		__string(disk, rrpc_debug->disk->disk_name)
+		__field(unsigned long, blk)
+	),
+
+	TP_fast_assign(
+		__assign_str(disk, rrpc_debug->disk->disk_name);
+		__entry->blk = blk;
+	),
+
+	TP_printk("%s blk=%lu", __get_str(disk), __entry->blk)
+);
+
+DEFINE_EVENT(rrpc_debug_blk, rrpc_debug_get_blk,
+	TP_PROTO(struct rrpc_debug *rrpc_debug, unsigned long blk),
+	TP_ARGS(rrpc_debug, blk)
+);
+
+DEFINE_EVENT(rrpc_debug_blk, rrpc_debug_put_blk,
+	TP_PROTO(struct rrpc_debug *rrpc_debug, unsigned long blk),
+	TP_ARGS(rrpc_debug, blk)
+);
+
+DEFINE_EVENT(rrpc_debug_blk, rrpc_debug_gc_erase,
+	TP_PROTO(struct rrpc_debug *rrpc_debug, unsigned long blk),
+	TP_ARGS(rrpc_debug, blk)
+);
+
+#endif /* _RRPC_DEBUG_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rrpc_debug_trace
+#include <trace/define_trace.h>